@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* acct.c - the accounts for the firewall login types
+ *
+ * The accounts from the "accountfile" and from the "account" lines are put
+ * into a hash table when the configuration is read, so that the children
+ * inherit it. If "account" lines appear in sections that depend on the
+ * client, the table only holds the accounts of the file and the lines are
+ * still looked up in the shrunk configuration.
+ *
+ * Successful verifications can be remembered for "authcachetime" seconds in
+ * shared memory, repeated logins then skip crypt(). The cache only holds
+ * HMAC-MD5 digests of the credentials, the key is random and never leaves
+ * the memory of the processes. */
+
+#include <fcntl.h>
+#include "jftpgw.h"
+
+#define ACCT_HASH_SIZE		1024
+#define ACCT_CACHE_SIZE		256
+#define ACCT_KEY_SIZE		64	/* the block size of MD5 */
+
+struct acct_entry {
+	char* user;
+	char* method;
+	char* pass;
+	struct acct_entry* next;
+};
+
+struct acct_cached {
+	char digest[ DIGEST_MD5LEN ];
+	time_t expires;
+};
+
+struct acct_cache {
+	unsigned char key[ ACCT_KEY_SIZE ];
+	struct acct_cached entries[ ACCT_CACHE_SIZE ];
+};
+
+static struct acct_entry* acct_hash[ ACCT_HASH_SIZE ];
+/* 1 if all the accounts are in the table */
+static int acct_complete;
+static struct acct_cache* acct_cache;
+
+
+static
+unsigned int acct_hashval(const char* s, unsigned int h) {
+	/* FNV-1a */
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+static
+void acct_clear(void) {
+	struct acct_entry* e, *next;
+	int i;
+
+	for (i = 0; i < ACCT_HASH_SIZE; i++) {
+		for (e = acct_hash[i]; e; e = next) {
+			next = e->next;
+			free(e->user);
+			free(e->method);
+			free(e->pass);
+			free(e);
+		}
+		acct_hash[i] = (struct acct_entry*) 0;
+	}
+	acct_complete = 0;
+}
+
+
+/* parse an account specification "user method password" and put it into
+ * the table. A later entry for the same user replaces an earlier one */
+
+static
+int acct_add(const char* spec) {
+	struct slist_t* line = config_split_line(spec, WHITESPACES);
+	struct acct_entry* e;
+	unsigned int h;
+
+	if (!line || !line->next || !line->next->next
+	    || !strlen(line->value) || !strlen(line->next->value)
+	    || !strlen(line->next->next->value)) {
+		jlog(5, "Incorrect account specification: %s", spec);
+		slist_destroy(line);
+		return -1;
+	}
+
+	h = acct_hashval(line->value, 2166136261U) % ACCT_HASH_SIZE;
+	for (e = acct_hash[h]; e; e = e->next) {
+		if (strcmp(e->user, line->value) == 0) {
+			break;
+		}
+	}
+	if (!e) {
+		e = (struct acct_entry*) malloc(sizeof(struct acct_entry));
+		enough_mem(e);
+		e->user = strdup(line->value);
+		enough_mem(e->user);
+		e->next = acct_hash[h];
+		acct_hash[h] = e;
+	} else {
+		free(e->method);
+		free(e->pass);
+	}
+	e->method = strdup(line->next->value);
+	enough_mem(e->method);
+	e->pass = strdup(line->next->next->value);
+	enough_mem(e->pass);
+
+	slist_destroy(line);
+	return 0;
+}
+
+
+static
+int acct_read_file(const char* fname) {
+	FILE* f;
+	char* line;
+	int n = 0;
+
+	if (!(f = open_file(fname))) {
+		return -1;
+	}
+	while ((line = config_read_line(f))) {
+		if (acct_add(line) == 0) {
+			n++;
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+
+/* acct_index_build() is called after the configuration has been read, the
+ * option list holds the global values at that time */
+
+void acct_index_build(void) {
+	struct slist_t* acct_list, *account;
+	const char* fname = config_get_option("accountfile");
+	int n = 0;
+
+	acct_clear();
+
+	if (fname) {
+		char* path = chrooted_path(fname);
+		n = acct_read_file(path);
+		free(path);
+		if (n < 0) {
+			n = 0;
+		}
+	}
+
+	acct_complete = !config_option_is_conditional("account");
+	if (acct_complete) {
+		acct_list = config_get_option_array("account");
+		for (account = acct_list; account; account = account->next) {
+			if (acct_add(account->value) == 0) {
+				n++;
+			}
+		}
+		slist_destroy(acct_list);
+	}
+	jlog(8, "Indexed %d accounts%s", n,
+		acct_complete ? "" : " (account lines depend on the client)");
+}
+
+
+int acct_index_complete(void) {
+	return acct_complete;
+}
+
+
+/* acct_lookup() looks up USER in the table. Returns 0 and sets METHOD and
+ * PASS if it has been found, 1 otherwise */
+
+int acct_lookup(const char* user, const char** method, const char** pass) {
+	struct acct_entry* e;
+	unsigned int h = acct_hashval(user, 2166136261U) % ACCT_HASH_SIZE;
+
+	for (e = acct_hash[h]; e; e = e->next) {
+		if (strcmp(e->user, user) == 0) {
+			*method = e->method;
+			*pass = e->pass;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/* ------------------ the cache of verified credentials ----------------- */
+
+int acct_cache_init(void) {
+	int fd, i;
+	ssize_t n = -1;
+
+	acct_cache = (struct acct_cache*) shmem_alloc(sizeof(struct acct_cache));
+	if (!acct_cache) {
+		return -1;
+	}
+	if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+		n = read(fd, acct_cache->key, sizeof(acct_cache->key));
+		close(fd);
+	}
+	if (n != sizeof(acct_cache->key)) {
+		jlog(5, "Could not read /dev/urandom, the key of the "
+			"authentication cache is predictable");
+		srand(time(NULL) ^ getpid());
+		for (i = 0; i < ACCT_KEY_SIZE; i++) {
+			acct_cache->key[i] = rand() & 0xff;
+		}
+	}
+	return 0;
+}
+
+
+/* acct_digest() computes the HMAC-MD5 of USER, CLEAR and CRYPTED with the
+ * key of the cache. The NUL characters are part of the message to keep
+ * "ab" + "c" apart from "a" + "bc" */
+
+static
+void acct_digest(const char* user, const char* clear, const char* crypted,
+		 char* digest) {
+	unsigned char pad[ ACCT_KEY_SIZE ];
+	unsigned char inner[ DIGEST_MD5LEN / 2 ];
+	char hex[ DIGEST_MD5LEN ];
+	struct digest d;
+	unsigned int byte;
+	int i;
+
+	for (i = 0; i < ACCT_KEY_SIZE; i++) {
+		pad[i] = acct_cache->key[i] ^ 0x36;
+	}
+	digest_init(&d);
+	digest_update(&d, (const char*) pad, sizeof(pad));
+	digest_update(&d, user, strlen(user) + 1);
+	digest_update(&d, clear, strlen(clear) + 1);
+	digest_update(&d, crypted, strlen(crypted));
+	digest_final(&d, hex);
+	/* the outer hash takes the inner one in binary */
+	for (i = 0; i < (int) sizeof(inner); i++) {
+		sscanf(hex + i * 2, "%2x", &byte);
+		inner[i] = (unsigned char) byte;
+	}
+
+	for (i = 0; i < ACCT_KEY_SIZE; i++) {
+		pad[i] = acct_cache->key[i] ^ 0x5c;
+	}
+	digest_init(&d);
+	digest_update(&d, (const char*) pad, sizeof(pad));
+	digest_update(&d, (const char*) inner, sizeof(inner));
+	digest_final(&d, digest);
+	memset(pad, 0, sizeof(pad));
+}
+
+
+/* acct_cache_check() returns 1 if the credentials have been verified
+ * recently */
+
+int acct_cache_check(const char* user, const char* clear,
+		     const char* crypted) {
+	char digest[ DIGEST_MD5LEN ];
+	time_t now = time(NULL);
+	int i, found = 0;
+
+	if (!acct_cache || config_get_ioption("authcachetime", 0) <= 0) {
+		return 0;
+	}
+	acct_digest(user, clear, crypted, digest);
+
+	shmem_lock(acct_cache);
+	for (i = 0; i < ACCT_CACHE_SIZE; i++) {
+		if (acct_cache->entries[i].expires > now
+		    && memcmp(acct_cache->entries[i].digest, digest,
+			      sizeof(digest)) == 0) {
+			found = 1;
+			break;
+		}
+	}
+	shmem_unlock(acct_cache);
+	return found;
+}
+
+
+void acct_cache_add(const char* user, const char* clear,
+		    const char* crypted) {
+	char digest[ DIGEST_MD5LEN ];
+	int cachetime = config_get_ioption("authcachetime", 0);
+	time_t now = time(NULL);
+	int i, victim = 0;
+
+	if (!acct_cache || cachetime <= 0) {
+		return;
+	}
+	acct_digest(user, clear, crypted, digest);
+
+	shmem_lock(acct_cache);
+	/* replace the entry that expires first */
+	for (i = 0; i < ACCT_CACHE_SIZE; i++) {
+		if (acct_cache->entries[i].expires
+				< acct_cache->entries[victim].expires) {
+			victim = i;
+		}
+		if (acct_cache->entries[i].expires <= now) {
+			victim = i;
+			break;
+		}
+	}
+	memcpy(acct_cache->entries[victim].digest, digest, sizeof(digest));
+	acct_cache->entries[victim].expires = now + cachetime;
+	shmem_unlock(acct_cache);
+}
+
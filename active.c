@@ -77,7 +77,9 @@ int portcommandcheck(const char* buffer, struct sockaddr_in* sin,
 
 /* 
  * activeclient() reads the "PORT x,x,x,x,x,x" command from the client,
- * opens that port on the client's side and returns the socket descriptor
+ * starts connecting to that port on the client's side and stores the
+ * socket descriptor. The connect() does not block, it is completed by
+ * transfer_negotiate() together with the connection to the server
  * 
  * Parameters: buffer: contains the "PORT x,x,x,x,x,x" command
  *             clntinfo: the connection variables
@@ -114,16 +116,18 @@ int activeclient(char* buffer, struct clientinfo* clntinfo) {
 	} else {
 		prs = actvrangeclient;
 	}
-	ret = openportiaddr(sin.sin_addr.s_addr,          /* dest ip   */
+	ret = openportiaddr_nb(sin.sin_addr.s_addr,       /* dest ip   */
 			    ntohs(sin.sin_port),          /* dest port */
 			    clntinfo->data_addr_to_client,/* source ip, port */
 			    prs);
 	if (ret < 0) {
 		jlog(8, "setting dataclientsock to -1 (openport error)");
 		clntinfo->dataclientsock = -1;
+		clntinfo->dataclientpending = 0;
 		return -1;
 	}
 	clntinfo->dataclientsock = ret;
+	clntinfo->dataclientpending = 1;
 
 	return 0;
 }
@@ -173,6 +177,7 @@ int activeserver(char** answer, struct clientinfo *clntinfo) {
 	}
 
 	clntinfo->dataserversock = ret;
+	clntinfo->dataserverpending = 0;
 	clntinfo->waitforconnect = &clntinfo->dataserversock;
 
 	/* tell the server about the addr + port it can connect to */
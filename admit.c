@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* admit.c - admission control of the master process
+ *
+ * Every source network may only open "acceptrate" connections per second
+ * (with bursts of up to "acceptburst"), the connections above that rate
+ * are refused before we fork. The counters are token buckets in a small
+ * set-associative table, the least recently used bucket of a set gets
+ * recycled.
+ *
+ * Clients that exceed a connection limit are not turned away at once but
+ * are held for up to "queuemaxwait" seconds. Whenever a slot becomes free,
+ * the queue is scanned in a fair order: the source IP that was served the
+ * longest time ago comes first, the clients of one IP are served in the
+ * order they arrived.
+ *
+ * The length of the queue shrinks when the machine is under pressure (load
+ * average, processes, free descriptors) so that we shed load instead of
+ * holding even more connections. */
+
+#include <sys/resource.h>
+#include "jftpgw.h"
+
+#define ADMIT_MAX		1024
+#define ADMIT_RATE_SETS		512
+#define ADMIT_RATE_WAYS		8
+
+struct admit_entry {
+	int fd;
+	unsigned long int peer_ip;
+	unsigned long int proxy_ip;
+	unsigned int proxy_port;
+	time_t queued;
+	time_t notice;		/* when we said something the last time */
+	unsigned long int seq;
+};
+
+struct admit_served {
+	unsigned long int ip;
+	unsigned long int seq;	/* when the IP was served the last time */
+};
+
+struct admit_bucket {
+	unsigned int net;
+	float tokens;
+	unsigned long int last;	/* ms after admit_rate_start, 0 if unused */
+};
+
+static struct admit_entry admit_queue[ ADMIT_MAX ];
+static struct admit_served admit_served[ ADMIT_MAX ];
+static int admit_nqueued;
+static int admit_nserved;
+static unsigned long int admit_seq;
+static struct admit_bucket admit_rate[ ADMIT_RATE_SETS ][ ADMIT_RATE_WAYS ];
+static time_t admit_rate_start;
+
+
+/* write to a queued client. The client may have gone away already, so we
+ * must not block and must not be killed by SIGPIPE */
+
+static
+void admit_say(int fd, const char* msg) {
+	int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_DONTWAIT
+	flags |= MSG_DONTWAIT;
+#endif
+	jlog(9, "Write(%d): %s", fd, msg);
+	if (send(fd, msg, strlen(msg), flags) < 0) {
+		jlog(8, "Could not write to queued client: %s",
+				strerror(errno));
+	}
+}
+
+
+static
+void admit_remove(int i) {
+	admit_nqueued--;
+	if (i < admit_nqueued) {
+		memmove(&admit_queue[i], &admit_queue[i + 1],
+			(admit_nqueued - i) * sizeof(struct admit_entry));
+	}
+}
+
+
+static
+void admit_reject(int i, const char* why) {
+	struct in_addr in;
+
+	in.s_addr = admit_queue[i].peer_ip;
+	jlog(6, "Dropping queued client %s: %s", inet_ntoa(in), why);
+	if (config_get_ioption("queuenotice", 0) > 0) {
+		/* end the multi-line 120 reply */
+		admit_say(admit_queue[i].fd, "120 Service not available\r\n");
+	}
+	admit_say(admit_queue[i].fd, "421 Too many connections, sorry\r\n");
+	close(admit_queue[i].fd);
+	admit_remove(i);
+}
+
+
+/* admit_rate_exceeded() takes a token from the bucket of the network of
+ * PEER_IP. Returns 1 if the bucket is empty and the client should be
+ * refused, 0 otherwise */
+
+int admit_rate_exceeded(int fd, unsigned long int peer_ip) {
+	float rate = config_get_foption("acceptrate", 0.0);
+	int burst = config_get_ioption("acceptburst", 10);
+	int prefix = config_get_ioption("acceptprefix", 32);
+	struct admit_bucket* set, *b = (struct admit_bucket*) 0;
+	struct timeval tv;
+	unsigned long int now;
+	unsigned int net, mask;
+	int i;
+
+	if (rate <= 0.0) {
+		return 0;
+	}
+	if (burst < 1) {
+		burst = 1;
+	}
+	if (prefix < 0 || prefix > 32) {
+		prefix = 32;
+	}
+	mask = prefix ? 0xffffffffU << (32 - prefix) : 0;
+	net = (unsigned int) ntohl(peer_ip) & mask;
+
+	gettimeofday(&tv, NULL);
+	/* relative to the first call so that it fits in 32 bits for some
+	 * weeks, the differences are right even after a wrap */
+	if (!admit_rate_start) {
+		admit_rate_start = tv.tv_sec;
+	}
+	now = (unsigned long int) (tv.tv_sec - admit_rate_start) * 1000
+		+ tv.tv_usec / 1000;
+	if (now == 0) {
+		now = 1;
+	}
+
+	set = admit_rate[ (net ^ (net >> 9) ^ (net >> 18)) % ADMIT_RATE_SETS ];
+	for (i = 0; i < ADMIT_RATE_WAYS; i++) {
+		if (set[i].last && set[i].net == net) {
+			b = &set[i];
+			break;
+		}
+	}
+	if (b) {
+		b->tokens += (float) (now - b->last) * rate / 1000.0;
+		if (b->tokens > (float) burst) {
+			b->tokens = (float) burst;
+		}
+	} else {
+		/* take a free bucket or the least recently used one */
+		b = &set[0];
+		for (i = 1; i < ADMIT_RATE_WAYS && b->last; i++) {
+			if (set[i].last < b->last) {
+				b = &set[i];
+			}
+		}
+		b->net = net;
+		b->tokens = (float) burst;
+	}
+	b->last = now;
+
+	if (b->tokens < 1.0) {
+		struct in_addr in;
+		in.s_addr = peer_ip;
+		jlog(7, "Connection rate of the /%d network of %s exceeded",
+				prefix, inet_ntoa(in));
+		admit_say(fd, "421 Too many connections from your network, try again later\r\n");
+		return 1;
+	}
+	b->tokens -= 1.0;
+	return 0;
+}
+
+
+/* admit_pressure() returns how loaded the machine is: 0 means no pressure
+ * at all, 100 or more means that no client should be queued */
+
+static
+int admit_pressure(void) {
+	int pressure = 0, p;
+	float maxload = config_get_foption("queuemaxload", 0.0);
+	int maxprocs = config_get_ioption("queuemaxprocesses", 0);
+	struct rlimit rl;
+	FILE* f;
+
+	if (maxload > 0.0 && (f = fopen("/proc/loadavg", "r"))) {
+		float load;
+		if (fscanf(f, "%f", &load) == 1) {
+			pressure = (int) (load * 100.0 / maxload);
+		}
+		fclose(f);
+	}
+	if (maxprocs > 0) {
+		p = registered_pids() * 100 / maxprocs;
+		if (p > pressure) {
+			pressure = p;
+		}
+	}
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0
+	    && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 0) {
+		/* every queued client takes a descriptor, keep some spare
+		 * ones for the listening sockets, the logfile and so on */
+		p = (admit_nqueued + 32) * 100 / (int) rl.rlim_cur;
+		if (p > pressure) {
+			pressure = p;
+		}
+	}
+	return pressure;
+}
+
+
+/* admit_capacity() returns how many clients may be queued right now. The
+ * full length is available up to a pressure of 50, it goes down to zero
+ * at a pressure of 100 */
+
+static
+int admit_capacity(void) {
+	int len = config_get_ioption("queuelength", 32);
+	int pressure;
+
+	if (config_get_ioption("queuemaxwait", 0) <= 0) {
+		return 0;
+	}
+	if (len > ADMIT_MAX) {
+		len = ADMIT_MAX;
+	}
+	pressure = admit_pressure();
+	if (pressure >= 100) {
+		return 0;
+	}
+	if (pressure > 50) {
+		len = len * (100 - pressure) / 50;
+	}
+	return len;
+}
+
+
+/* admit_enqueue() queues a client that could not be admitted. Returns 0 if
+ * the client has been queued or -1 if it should be rejected */
+
+int admit_enqueue(int fd, unsigned long int peer_ip,
+		  unsigned long int proxy_ip, unsigned int proxy_port) {
+	struct admit_entry* e;
+	time_t now = time(NULL);
+
+	if (admit_nqueued >= admit_capacity()) {
+		return -1;
+	}
+	e = &admit_queue[ admit_nqueued++ ];
+	e->fd = fd;
+	e->peer_ip = peer_ip;
+	e->proxy_ip = proxy_ip;
+	e->proxy_port = proxy_port;
+	e->queued = now;
+	e->notice = now;
+	e->seq = ++admit_seq;
+
+	jlog(8, "Queued client on fd %d, %d clients waiting",
+			fd, admit_nqueued);
+	if (config_get_ioption("queuenotice", 0) > 0) {
+		admit_say(fd, "120-All connections are in use, you have been queued\r\n");
+	}
+	return 0;
+}
+
+
+int admit_pending(void) {
+	return admit_nqueued;
+}
+
+
+static
+unsigned long int admit_served_get(unsigned long int ip) {
+	int i;
+
+	for (i = 0; i < admit_nserved; i++) {
+		if (admit_served[i].ip == ip) {
+			return admit_served[i].seq;
+		}
+	}
+	return 0;
+}
+
+
+static
+void admit_served_set(unsigned long int ip) {
+	int i, oldest = 0;
+
+	for (i = 0; i < admit_nserved; i++) {
+		if (admit_served[i].ip == ip) {
+			break;
+		}
+		if (admit_served[i].seq < admit_served[oldest].seq) {
+			oldest = i;
+		}
+	}
+	if (i == admit_nserved) {
+		if (admit_nserved < ADMIT_MAX) {
+			admit_nserved++;
+		} else {
+			i = oldest;
+		}
+	}
+	admit_served[i].ip = ip;
+	admit_served[i].seq = ++admit_seq;
+}
+
+
+/* admit_service() drops clients that have waited for too long or that have
+ * gone away, sheds clients if the queue got too long, and sends keep-alive
+ * notices */
+
+void admit_service(void) {
+	time_t now = time(NULL);
+	int maxwait = config_get_ioption("queuemaxwait", 0);
+	int notice = config_get_ioption("queuenotice", 0);
+	int capacity, i;
+	char c;
+	char buf[64];
+
+	if (admit_nqueued == 0) {
+		return;
+	}
+
+	/* shed the clients that arrived last */
+	capacity = admit_capacity();
+	while (admit_nqueued > capacity) {
+		admit_reject(admit_nqueued - 1, "shedding load");
+	}
+
+	for (i = 0; i < admit_nqueued; ) {
+		struct admit_entry* e = &admit_queue[i];
+		int ret;
+#ifdef MSG_DONTWAIT
+		ret = recv(e->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+#else
+		ret = -1;
+		errno = EAGAIN;
+#endif
+		if (ret == 0 || (ret < 0 && errno != EAGAIN
+					 && errno != EWOULDBLOCK)) {
+			jlog(8, "Queued client on fd %d went away", e->fd);
+			close(e->fd);
+			admit_remove(i);
+			continue;
+		}
+		if (now - e->queued >= maxwait) {
+			admit_reject(i, "waited too long");
+			continue;
+		}
+		if (notice > 0 && now - e->notice >= notice) {
+			snprintf(buf, sizeof(buf),
+				"120-Still waiting (%d seconds)\r\n",
+				(int) (now - e->queued));
+			admit_say(e->fd, buf);
+			e->notice = now;
+		}
+		i++;
+	}
+}
+
+
+/* admit_next() looks for a queued client that can be admitted now. The
+ * connection counters are already increased for the client that is
+ * returned. Returns the descriptor or -1 */
+
+int admit_next(unsigned long int* peer_ip,
+	       unsigned long int* proxy_ip,
+	       unsigned int* proxy_port,
+	       time_t* start_time) {
+	int tried[ ADMIT_MAX ];
+	int i, best;
+	unsigned long int best_served, served;
+	time_t now = time(NULL);
+
+	admit_service();
+
+	memset(tried, 0, sizeof(int) * admit_nqueued);
+	while (1) {
+		/* the least recently served IP first, then the oldest client */
+		best = -1;
+		best_served = 0;
+		for (i = 0; i < admit_nqueued; i++) {
+			if (tried[i]) {
+				continue;
+			}
+			served = admit_served_get(admit_queue[i].peer_ip);
+			if (best < 0 || served < best_served
+			    || (served == best_served
+				&& admit_queue[i].seq < admit_queue[best].seq)) {
+				best = i;
+				best_served = served;
+			}
+		}
+		if (best < 0) {
+			return -1;
+		}
+
+		config_counter_increase(admit_queue[best].peer_ip,
+					admit_queue[best].proxy_ip,
+					admit_queue[best].proxy_port,
+					now);
+		if (!config_check_limit_violation()) {
+			break;
+		}
+		config_counter_decrease(admit_queue[best].peer_ip,
+					admit_queue[best].proxy_ip,
+					admit_queue[best].proxy_port,
+					now);
+		/* the limit might be specific to this source, try the
+		 * others */
+		for (i = 0; i < admit_nqueued; i++) {
+			if (admit_queue[i].peer_ip == admit_queue[best].peer_ip) {
+				tried[i] = 1;
+			}
+		}
+	}
+
+	jlog(8, "Admitting queued client on fd %d after %d seconds",
+			admit_queue[best].fd,
+			(int) (now - admit_queue[best].queued));
+	if (config_get_ioption("queuenotice", 0) > 0) {
+		admit_say(admit_queue[best].fd, "120 Service ready now\r\n");
+	}
+	admit_served_set(admit_queue[best].peer_ip);
+
+	*peer_ip = admit_queue[best].peer_ip;
+	*proxy_ip = admit_queue[best].proxy_ip;
+	*proxy_port = admit_queue[best].proxy_port;
+	*start_time = now;
+	i = admit_queue[best].fd;
+	admit_remove(best);
+	return i;
+}
+
+
+/* a forked child must not keep the sockets of the queued clients open */
+
+void admit_close_all(void) {
+	int i;
+
+	for (i = 0; i < admit_nqueued; i++) {
+		close(admit_queue[i].fd);
+	}
+	admit_nqueued = 0;
+}
+
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* arena.c - a bump allocator for the control connection
+ *
+ * Every command of a session needs a couple of short lived buffers: the
+ * command line, the responses of the server that are passed on, the lines
+ * for the command log. They are taken from an arena that is reset at the
+ * beginning of each command, so that they need not be freed one by one.
+ *
+ * Memory from the arena must not be passed to free(). Code that uses the
+ * arena outside of the command loop takes a mark before and releases the
+ * memory back to the mark afterwards. */
+
+#include "jftpgw.h"
+
+#define ARENA_BLOCK_SIZE	4096
+
+/* the data of a block follows the header, the union gives it the alignment
+ * that malloc() would give */
+struct arena_block {
+	struct arena_block* prev;
+	size_t size;
+	size_t used;
+	union {
+		long l;
+		double d;
+		void* p;
+	} data[1];
+};
+
+#define ARENA_ALIGN		(sizeof(((struct arena_block*) 0)->data[0]))
+#define ARENA_DATA(b)		((char*) (b)->data)
+
+static struct arena_block* arena_current;
+/* the last allocation, it can be grown in place */
+static char* arena_last;
+static unsigned long int arena_allocs;
+static unsigned long int arena_bytes;
+
+
+/* start a new block with room for at least SIZE bytes */
+
+static
+void arena_new_block(size_t size) {
+	struct arena_block* b;
+	size_t blocksize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+	/* calloc() so that the compiler does not take the header for
+	 * uninitialized in enough_mem() */
+	b = (struct arena_block*) calloc(1, sizeof(struct arena_block)
+					    + blocksize);
+	enough_mem(b);
+	b->prev = arena_current;
+	b->size = blocksize;
+	b->used = 0;
+	arena_current = b;
+}
+
+
+void* arena_alloc(size_t size) {
+	char* p;
+
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if (size == 0) {
+		size = ARENA_ALIGN;
+	}
+	if (!arena_current
+	    || arena_current->size - arena_current->used < size) {
+		arena_new_block(size);
+	}
+	p = ARENA_DATA(arena_current) + arena_current->used;
+	arena_current->used += size;
+	arena_last = p;
+	arena_allocs++;
+	arena_bytes += size;
+	return p;
+}
+
+
+/* arena_grow() enlarges the allocation P of OLDSIZE bytes to SIZE bytes. If
+ * P was the last allocation and the block has enough room, it stays where
+ * it is. Otherwise it moves to a block with room for twice the size, so
+ * that a buffer that grows a little at a time is only copied a logarithmic
+ * number of times and the blocks left behind add up to twice its size */
+
+void* arena_grow(void* p, size_t oldsize, size_t size) {
+	size_t start, end;
+	char* n;
+
+	if (p && p == arena_last) {
+		start = (char*) p - ARENA_DATA(arena_current);
+		end = start + (size + ARENA_ALIGN - 1) / ARENA_ALIGN
+								* ARENA_ALIGN;
+		if (end <= arena_current->size) {
+			if (end > arena_current->used) {
+				arena_bytes += end - arena_current->used;
+				arena_current->used = end;
+			}
+			return p;
+		}
+	}
+	if (!arena_current
+	    || arena_current->size - arena_current->used < 2 * size) {
+		arena_new_block(2 * size);
+	}
+	n = (char*) arena_alloc(size);
+	if (p) {
+		memcpy(n, p, oldsize < size ? oldsize : size);
+	}
+	return n;
+}
+
+
+char* arena_strdup(const char* s) {
+	size_t len = strlen(s) + 1;
+	char* n = (char*) arena_alloc(len);
+
+	memcpy(n, s, len);
+	return n;
+}
+
+
+struct arena_mark arena_get_mark(void) {
+	struct arena_mark m;
+
+	m.block = arena_current;
+	m.used = arena_current ? arena_current->used : 0;
+	return m;
+}
+
+
+/* arena_release() frees everything that has been allocated since the mark M
+ * has been taken */
+
+void arena_release(struct arena_mark m) {
+	struct arena_block* b;
+
+	while (arena_current && arena_current != m.block) {
+		b = arena_current;
+		arena_current = b->prev;
+		free(b);
+	}
+	if (arena_current) {
+		arena_current->used = m.used;
+	}
+	arena_last = (char*) 0;
+}
+
+
+/* arena_reset() is called at the beginning of each command. The oldest block
+ * is kept for the next command, the others have only been needed for large
+ * responses */
+
+void arena_reset(void) {
+	struct arena_block* b;
+
+	if (arena_allocs) {
+		jlog(9, "The last command used %lu allocations (%lu bytes) "
+			"from the arena", arena_allocs, arena_bytes);
+	}
+	while (arena_current && arena_current->prev) {
+		b = arena_current;
+		arena_current = b->prev;
+		free(b);
+	}
+	if (arena_current) {
+		arena_current->used = 0;
+	}
+	arena_last = (char*) 0;
+	arena_allocs = arena_bytes = 0;
+}
+
@@ -41,6 +41,7 @@ int deny_severity  = LIBWRAP_DENY_FACILITY  | LIBWRAP_DENY_SEVERITY;
 
 extern struct hostent_list* hostcache;
 extern struct serverinfo srvinfo;
+extern struct log_cmd_st lcs;
 
 int chlds_exited;
 int should_read_config;
@@ -51,6 +52,7 @@ struct descriptor_set {
 };
 
 static int child_setup(int, struct clientinfo*);
+static int child_setup_session(int, struct clientinfo*);
 static struct descriptor_set listen_on_ifaces(const char*, struct clientinfo*);
 static int get_connecting_socket(struct descriptor_set);
 static int say_welcome(int);
@@ -166,7 +168,8 @@ int waitclient(const char* hostnames, struct clientinfo* clntinfo) {
 	int ahandle, i;
 	struct sigaction sa;
 	struct descriptor_set d_set;
-	unsigned int peer_ip;
+	unsigned long int peer_ip, proxy_ip;
+	unsigned int proxy_port;
 	struct sockaddr_in c_in;
 	time_t now;
 
@@ -236,32 +239,63 @@ int waitclient(const char* hostnames, struct clientinfo* clntinfo) {
 	atexit(sayterminating);
 
 	while(1) {
-		ahandle = get_connecting_socket(d_set);
-		if (ahandle == -1) {
-			/* either select() or accept() failed */
-			/* I don't try resume here because we are in an
-			 * endless loop. The danger of the programm falling
-			 * into an infinite loop consuming all cpu time is
-			 * too big... */
-			jlog(8, "get_connecting_socket() returned error code");
-			return -1;
-		}
+		/* the jobs in the prefetch spool directory */
+		prefetch_poll(&d_set.set, d_set.maxfd);
+		/* clients that are waiting in the admission queue come
+		 * first */
+		ahandle = admit_next(&peer_ip, &proxy_ip, &proxy_port, &now);
+		if (ahandle < 0) {
+			ahandle = get_connecting_socket(d_set);
+			if (ahandle == -2) {
+				/* nothing to accept, look at the queue again */
+				continue;
+			}
+			if (ahandle == -1) {
+				/* either select() or accept() failed */
+				/* I don't try resume here because we are in
+				 * an endless loop. The danger of the
+				 * programm falling into an infinite loop
+				 * consuming all cpu time is too big... */
+				jlog(8, "get_connecting_socket() returned error code");
+				return -1;
+			}
 
-		c_in = socketinfo_get_local_sin(ahandle);
-		peer_ip = get_uint_peer_ip(ahandle);
-		now = time(NULL);
-		config_counter_increase(peer_ip,               /* from ip */
-					c_in.sin_addr.s_addr,  /* proxy_ip */
-					ntohs(c_in.sin_port),  /* proxy_port */
-					now);               /* specific_time */
-		if (config_check_limit_violation()) {
-			say(ahandle, "500 Too many connections, sorry\r\n");
-			close(ahandle);
-			config_counter_decrease(peer_ip,       /* from ip */
-					c_in.sin_addr.s_addr,  /* proxy_ip */
-					ntohs(c_in.sin_port),  /* proxy_port */
-					now);               /* specific_time */
-			continue;
+			c_in = socketinfo_get_local_sin(ahandle);
+			peer_ip = get_uint_peer_ip(ahandle);
+			proxy_ip = c_in.sin_addr.s_addr;
+			proxy_port = ntohs(c_in.sin_port);
+			now = time(NULL);
+			JFTPGW_PROBE2(accept, ahandle, peer_ip);
+			/* too many connections from this network? Refuse
+			 * them before they cost us a fork() */
+			if (admit_rate_exceeded(ahandle, peer_ip)) {
+				close(ahandle);
+				continue;
+			}
+			/* do not overtake the clients in the queue */
+			if (admit_pending() && srvinfo.multithread
+			    && admit_enqueue(ahandle, peer_ip,
+					     proxy_ip, proxy_port) == 0) {
+				continue;
+			}
+			config_counter_increase(peer_ip,   /* from ip */
+						proxy_ip,  /* proxy_ip */
+						proxy_port,/* proxy_port */
+						now);      /* specific_time */
+			if (config_check_limit_violation()) {
+				config_counter_decrease(peer_ip,
+						proxy_ip,
+						proxy_port,
+						now);
+				if (srvinfo.multithread
+				    && admit_enqueue(ahandle, peer_ip,
+					     proxy_ip, proxy_port) == 0) {
+					continue;
+				}
+				say(ahandle, "500 Too many connections, sorry\r\n");
+				close(ahandle);
+				continue;
+			}
 		}
 		if (srvinfo.multithread) {
 			if ((chldpid = fork()) < 0) {
@@ -271,16 +305,18 @@ int waitclient(const char* hostnames, struct clientinfo* clntinfo) {
 			}
 			if (chldpid > 0) {
 				/* parent process */
+				JFTPGW_PROBE2(fork, chldpid, ahandle);
 				/* register the PID */
 				register_pid(chldpid, peer_ip,
-					c_in.sin_addr.s_addr,  /* proxy_ip */
-					ntohs(c_in.sin_port),  /* proxy_port */
+					proxy_ip,           /* proxy_ip */
+					proxy_port,         /* proxy_port */
 					now);               /* specific_time */
 				close(ahandle);
 			}
 			if (chldpid == 0) {
 				/* child process */
 				jlog(8, "forked to pid %d", getpid());
+				admit_close_all();
 			}
 		}
 		if (!srvinfo.multithread || chldpid == 0) {
@@ -290,6 +326,10 @@ int waitclient(const char* hostnames, struct clientinfo* clntinfo) {
 }
 
 
+/* get_connecting_socket() waits for a client and accepts the connection.
+ * Returns the socket, -1 on error or -2 if the admission queue should be
+ * looked at */
+
 static
 int get_connecting_socket(struct descriptor_set d_set) {
 #ifdef HAVE_SOCKLEN_T
@@ -309,12 +349,20 @@ int get_connecting_socket(struct descriptor_set d_set) {
 	/* is there no remaining ready fd from the last select() ? */
 	if (nfd == 0) {
 		while (1) {
-			/* eternal select() */
+			/* eternal select() - unless clients are queued or
+			 * there is a prefetch spool, then we have to look
+			 * after them every second */
+			struct timeval tv = { 1, 0 };
 			/* nfd returns the number of fds that are ready */
-			nfd = select(d_set.maxfd + 1, &d_set.set, 0, 0, 0);
+			nfd = select(d_set.maxfd + 1, &d_set.set, 0, 0,
+					admit_pending() || prefetch_enabled()
+						? &tv : 0);
 			if (nfd > 0) {
 				break;
 			}
+			if (nfd == 0) {
+				return -2;
+			}
 			if (errno == EINTR) {
 				memcpy(&d_set.set, &backupset, sizeof(fd_set));
 				if (chlds_exited > 0) {
@@ -324,6 +372,11 @@ int get_connecting_socket(struct descriptor_set d_set) {
 					jlog(9, "Re-reading configuration");
 					reread_config();
 				}
+				if (admit_pending()) {
+					/* a slot might have become free */
+					nfd = 0;
+					return -2;
+				}
 				continue;
 			}
 			jlog(1, "select() failed: %s, nfd: %d", strerror(errno), nfd);
@@ -367,8 +420,24 @@ int get_connecting_socket(struct descriptor_set d_set) {
 }
 
 
+/* child_setup() starts the trace of the session, the work is done by
+ * child_setup_session() */
+
 static
 int child_setup(int sock_fd, struct clientinfo *clntinfo) {
+	struct trace_span span;
+	int ret;
+
+	lcs.trace_id = trace_session();
+	trace_begin(&span, TRACE_CHILD_SETUP);
+	ret = child_setup_session(sock_fd, clntinfo);
+	trace_end(&span, VERB_UNKNOWN, ret);
+	return ret;
+}
+
+
+static
+int child_setup_session(int sock_fd, struct clientinfo *clntinfo) {
 	struct sockaddr_in t_in;
 	struct sockaddr_in c_in;
 	unsigned long int peer_ip = get_uint_peer_ip(sock_fd);
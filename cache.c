@@ -19,38 +19,80 @@
 #include "jftpgw.h"
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <utime.h>
+#include <ctype.h>
+#include <dirent.h>
 
 #define INFO_SUFFIX ".info"
+#define Z_SUFFIX ".z"
+/* the shared objects and their references, see cache_dedup() */
+#define OBJ_SUFFIX ".obj"
+#define ZOBJ_SUFFIX ".zobj"
+#define REF_SUFFIX ".ref."
+#define ZREF_SUFFIX ".zref."
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
 
 extern struct hostent_list* hostcache;
 
 /* only the user should be able to read/write the cache */
 int cache_perms = S_IRWXU;
 
-int cache_available(struct cache_filestruct);
-int cache_readinfo(struct cache_filestruct*);
-int cache_writeinfo(struct cache_filestruct);
 int cache_want(struct cache_filestruct);
-char* cache_qualifypath(const struct cache_filestruct);
-char* cache_qualifyfile(const struct cache_filestruct);
-char* cache_qualifyinfo(const struct cache_filestruct);
 int recursive_mkdir(const char* pathname, int perms);
+static char* cache_objname(const struct cache_filestruct, const char*);
+static int cache_openat(const char*, int);
+static int cache_mkdirs(int, const char*);
+static char* cache_dataname(const struct cache_filestruct,
+		const struct cache_map*);
+static void cache_dedup(struct cache_filestruct, struct cache_map*);
+static int cache_adopt(struct cache_filestruct, struct cache_map*);
+static void cache_unref(struct cache_filestruct, const struct cache_map*);
+static int cache_readmap(struct cache_filestruct, struct cache_map*);
+static int cache_map_complete(const struct cache_map*);
+static void cache_compress(struct cache_filestruct, struct cache_map*);
+static void cache_uncompressed_remove(struct cache_filestruct);
+
+
+/* is CFS an entry that all logins share (cacheshared)? */
+
+static
+int cache_shared(const struct cache_filestruct cfs) {
+	return strcmp(cfs.user, "*") == 0;
+}
+
 
+/* cache_gather_info() finds out where FILENAME is and asks the server for
+ * its size and its date. With CACHE_INFO_HASH a complete entry is checked
+ * with XMD5 instead if the server supports it, a single command that has
+ * the server read the file but saves the transfer. The server is not asked
+ * at all for an entry that it has confirmed less than "cachehardttl"
+ * seconds ago if "cachesoftttl" is set, see refresh.c. Entries shared by
+ * all logins are always checked with SIZE and MDTM, that is the check that
+ * the login may read the file */
 
 struct cache_filestruct cache_gather_info(const char* filename,
-						struct clientinfo* clntinfo) {
-	char* pwd;
+				struct clientinfo* clntinfo, int flags) {
+	const char* pwd;
 	char* complete_fname;
 	size_t size;
 	struct cache_filestruct cfs;
+	struct cache_map map;
+	struct trace_span span;
+	int soft, hard;
+	time_t age;
+
+	/* this asks the server for the directory, the size and the date */
+	trace_begin(&span, TRACE_CACHE_INFO);
 
 	if (filename[0] != '/') {
-		/* get the directory */
-		pwd = getftpwd(clntinfo);
+		/* the directory is only asked for once per directory */
+		if (!(pwd = mdcache_cwd(clntinfo))) {
+			pwd = "";
+		}
 	} else {
-		pwd = strdup("");
-		enough_mem(pwd);
+		pwd = "";
 	}
 	size = strlen(filename) + 1 + strlen(pwd) + 1;
 	complete_fname = (char*) malloc(size);
@@ -60,255 +102,761 @@ struct cache_filestruct cache_gather_info(const char* filename,
 		jlog(4, "Error in rel2abs: filename: %s, path: %s",
 				filename, pwd);
 	}
-	free(pwd);
 	cfs.filepath = extract_path(complete_fname);
 	cfs.filename = extract_file(complete_fname);
-	cfs.size = getftpsize(complete_fname, clntinfo);
-	cfs.date = getftpmdtm(complete_fname, clntinfo);
+	/* the files of a mirror are the same for all users */
+	cfs.user = config_get_bool("cacheshared") ? "*" : clntinfo->user;
+	cfs.host = clntinfo->destination;
+	cfs.port = clntinfo->destinationport;
+	cfs.checksum = (char*) 0;
+	cfs.size = 0;
+	cfs.date = (time_t) -1;
+	cfs.checked = 0;
+	cfs.stale = 0;
+
+	/* a shared entry has been confirmed for another login, this one
+	 * has to be asked whether it may read the file */
+	soft = cache_shared(cfs) ? 0 : config_get_ioption("cachesoftttl", 0);
+	if (flags & (CACHE_INFO_DATE | CACHE_INFO_HASH) && soft > 0
+	    && cache_readmap(cfs, &map) == 0 && cache_map_complete(&map)
+	    && map.checked) {
+		hard = MAX_VAL(soft, config_get_ioption("cachehardttl", 0));
+		age = time(NULL) - map.checked;
+		if (age < hard) {
+			jlog(8, "%s has been checked %ld seconds ago%s",
+					complete_fname, (long) age,
+					age >= soft ? ", checking it again" : "");
+			cfs.size = map.size;
+			cfs.date = map.date;
+			cfs.stale = age >= soft;
+			flags = CACHE_INFO_PATH;
+		}
+	}
+
+	/* a file that is not in the cache may be there under another key,
+	 * see cache_adopt() */
+	if (flags & CACHE_INFO_HASH && !clntinfo->noxmd5
+	    && cache_readmap(cfs, &map) == 0
+	    && ((cache_map_complete(&map) && map.md5[0])
+		|| (map.nranges == 0 && config_get_bool("cachededup")))
+	    && (cfs.checksum = getftpmd5(complete_fname, clntinfo))) {
+		if (map.md5[0] && strcasecmp(cfs.checksum, map.md5) == 0) {
+			jlog(8, "The MD5 sum of %s has not changed",
+					complete_fname);
+			cfs.size = map.size;
+			cfs.date = map.date;
+		}
+	}
+	if (flags & (CACHE_INFO_DATE | CACHE_INFO_HASH)
+	    && (cfs.date == (time_t) -1 || cache_shared(cfs))) {
+		cfs.size = getftpsize(complete_fname, clntinfo);
+		cfs.date = getftpmdtm(complete_fname, clntinfo);
+	}
+	if (flags & (CACHE_INFO_DATE | CACHE_INFO_HASH)) {
+		cfs.checked = time(NULL);
+	}
 	free(complete_fname);
 	/* filename is not free()ed, it points inside args and thus inside
 	 * buffer in cmds.c */
 
-	cfs.user = clntinfo->user;
-	cfs.host = clntinfo->destination;
-	cfs.port = clntinfo->destinationport;
-
+	trace_end(&span, VERB_UNKNOWN, 0);
 	return cfs;
 }
 
-int cache_available(struct cache_filestruct cfs) {
-	char* fname = cache_qualifyfile(cfs);
-	struct cache_filestruct cfs_info;
-	struct stat st;
-
-	if (stat(fname, &st) < 0) {
-		if (errno == ENOENT) {
-			return CACHE_NOTAVL_EXIST;
+/* The data file of an entry may only hold parts of the file, if a transfer
+ * has been aborted for example or if a client has resumed a download with
+ * REST. The info file next to it lists the parts that are there:
+ *
+ *	key /pub/speak.ps
+ *	login ftp@ftp.foo.com:21
+ *	size 146617
+ *	date 983017625
+ *	range 0 65536
+ *
+ * The entry is complete if a single range covers the whole file. Then
+ * the lines "md5" and "crc32" hold the sums of the file. A data file
+ * without an info file holds nothing yet. */
+
+/* add the range [FROM, TO) to MAP, the ranges that it overlaps or touches
+ * are merged with it */
+
+static
+int cache_map_add(struct cache_map* map, unsigned long from,
+		  unsigned long to) {
+	int i, j;
+
+	if (from >= to) {
+		return 0;
+	}
+	for (i = 0; i < map->nranges; ) {
+		if (map->ranges[i].to < from || map->ranges[i].from > to) {
+			i++;
+			continue;
 		}
-		/* other error */
-		jlog(2, "Could not stat %s: %s",
-				fname, strerror(errno));
+		from = MIN_VAL(from, map->ranges[i].from);
+		to = MAX_VAL(to, map->ranges[i].to);
+		for (j = i; j < map->nranges - 1; j++) {
+			map->ranges[j] = map->ranges[j + 1];
+		}
+		map->nranges--;
+	}
+	if (map->nranges == CACHE_MAX_RANGES) {
+		/* too fragmented, the data is in the file but not used */
 		return -1;
 	}
-
-	if (cfs.size != st.st_size) {
-		/* the new file seems to differ in size -> delete our copy
-		 * */
-		jlog(8, "cache copy differs in size");
-		cache_delete(cfs, 1);
-		return CACHE_NOTAVL_SIZE;
+	/* keep them sorted */
+	for (i = map->nranges; i > 0 && map->ranges[i - 1].from > from; i--) {
+		map->ranges[i] = map->ranges[i - 1];
 	}
+	map->ranges[i].from = from;
+	map->ranges[i].to = to;
+	map->nranges++;
+	return 0;
+}
 
-	if (cfs.date != st.st_mtime) {
-		/* the new file seems to differ in the date -> delete our
-		 * copy */
-		jlog(8, "cache copy differs in the date");
-		cache_delete(cfs, 1);
-		return CACHE_NOTAVL_DATE;
+
+/* the number of bytes from OFFSET on that are in the cache */
+
+static
+unsigned long cache_map_avail(const struct cache_map* map,
+			      unsigned long offset) {
+	int i;
+
+	for (i = 0; i < map->nranges; i++) {
+		if (map->ranges[i].from <= offset && offset < map->ranges[i].to) {
+			return map->ranges[i].to - offset;
+		}
 	}
+	return 0;
+}
 
-	cfs_info = cfs;
-	cache_readinfo(&cfs_info);
 
-	if (cfs.checksum != cfs_info.checksum) {
-		/* the new file seems to differ in the checksum -> delete
-		 * our copy */
-		cache_delete(cfs, 1);
-		return CACHE_NOTAVL_CHECKSUM;
+/* the number of bytes of the file that are in the cache */
+
+static
+unsigned long cache_map_bytes(const struct cache_map* map) {
+	unsigned long bytes = 0;
+	int i;
+
+	for (i = 0; i < map->nranges; i++) {
+		bytes += map->ranges[i].to - map->ranges[i].from;
 	}
+	return bytes;
+}
+
 
-	return CACHE_AVAILABLE;
+static
+int cache_map_complete(const struct cache_map* map) {
+	return map->nranges == 1 && map->ranges[0].from == 0
+		&& map->ranges[0].to >= map->size;
 }
 
 
-int cache_add(struct cache_filestruct cfs) {
+/* read the map of the entry of CFS, it is empty if there is no entry */
 
-	struct stat st;
-	char* fname = cache_qualifyfile(cfs);
-	struct utimbuf ut;
+static
+int cache_readmap(struct cache_filestruct cfs, struct cache_map* map) {
+	char* fname = cache_objname(cfs, INFO_SUFFIX);
+	char line[128];
+	unsigned long from, to;
+	long date;
+	FILE* f;
+	int fd;
 
-	/* okay, we're sure the path exists, let's try to create a file */
+	map->size = 0;
+	map->date = (time_t) -1;
+	map->nranges = 0;
+	map->md5[0] = '\0';
+	map->crc = 0;
+	map->compressed = 0;
+	map->checked = 0;
+	map->content[0] = '\0';
+
+	if ((fd = cache_openat(fname, O_RDONLY)) < 0 || !(f = fdopen(fd, "r"))) {
+		if (errno != ENOENT) {
+			jlog(3, "Could not open info file %s: %s",
+					fname, strerror(errno));
+			if (fd >= 0) {
+				close(fd);
+			}
+			return -1;
+		}
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "size %lu", &from) == 1) {
+			map->size = from;
+		} else if (sscanf(line, "date %ld", &date) == 1) {
+			map->date = (time_t) date;
+		} else if (sscanf(line, "range %lu %lu", &from, &to) == 2) {
+			cache_map_add(map, from, to);
+		} else if (sscanf(line, "md5 %32s", map->md5) == 1) {
+			;
+		} else if (sscanf(line, "crc32 %lx", &from) == 1) {
+			map->crc = from;
+		} else if (strcmp(line, "compressed zlib\n") == 0) {
+			map->compressed = 1;
+		} else if (sscanf(line, "checked %ld", &date) == 1) {
+			map->checked = (time_t) date;
+		} else if (sscanf(line, "content %32s", map->content) == 1) {
+			;
+		}
+		/* the key of the entry is only there for the tools */
+	}
+	fclose(f);
+	return 0;
+}
 
-	/* compare size, set date... */
 
-	if (stat(fname, &st) < 0) {
-		jlog(2, "Could not stat %s: %s",
-				fname, strerror(errno));
+/* the info file is replaced by a new one, a reader sees either the old or
+ * the new one but never a part of it */
+
+static
+int cache_writemap(struct cache_filestruct cfs, const struct cache_map* map) {
+	char* fname = cache_objname(cfs, INFO_SUFFIX);
+	char* tmpname = cache_objname(cfs, INFO_SUFFIX ".new");
+	FILE* f;
+	int fd, i;
+
+	fd = cache_openat(tmpname, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		jlog(2, "Could not create info file %s in cache: %s",
+				tmpname, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
 		return -1;
 	}
-	if (st.st_size != cfs.size) {
-		jlog(6, "Had to delete %s again. Size did not match", fname);
+	fprintf(f, "key %s%s\n", cfs.filepath, cfs.filename);
+	fprintf(f, "login %s@%s:%d\n", cfs.user, cfs.host, cfs.port);
+	fprintf(f, "size %lu\n", map->size);
+	fprintf(f, "date %ld\n", (long) map->date);
+	for (i = 0; i < map->nranges; i++) {
+		fprintf(f, "range %lu %lu\n", map->ranges[i].from,
+				map->ranges[i].to);
+	}
+	if (map->md5[0]) {
+		fprintf(f, "md5 %s\n", map->md5);
+		fprintf(f, "crc32 %08lx\n", map->crc);
+	}
+	if (map->compressed) {
+		fprintf(f, "compressed zlib\n");
+	}
+	if (map->checked) {
+		fprintf(f, "checked %ld\n", (long) map->checked);
+	}
+	if (map->content[0]) {
+		fprintf(f, "content %s\n", map->content);
+	}
+	if (ferror(f) | fclose(f)) {
+		jlog(2, "Could not write info file %s: %s",
+				tmpname, strerror(errno));
+		unlinkat(cacheroot_fd(tmpname), tmpname, 0);
+		return -1;
+	}
+	if (renameat(cacheroot_fd(tmpname), tmpname,
+		     cacheroot_fd(fname), fname) < 0) {
+		jlog(2, "Could not rename %s to %s: %s",
+				tmpname, fname, strerror(errno));
+		unlinkat(cacheroot_fd(tmpname), tmpname, 0);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* cache_open() opens the entry of CFS for reading and writing. It is
+ * created if the file is wanted in the cache, an entry of another version
+ * of the file is removed first. The descriptor is positioned at OFFSET and
+ * AVAIL is set to the number of bytes from there on that are in the cache.
+ * Returns -1 if the file is not cached */
+
+int cache_open(struct cache_filestruct cfs, unsigned long offset,
+	       unsigned long* avail, struct cachez** z) {
+	struct cache_map map;
+	char* fname;
+	int fd, reason = CACHE_NOTAVL_EXIST;
+
+	*avail = 0;
+	*z = (struct cachez*) 0;
+	if (!cache_want(cfs) || cfs.size == 0 || cfs.date == (time_t) -1
+	    || (cache_shared(cfs) && !cfs.checked)) {
+		/* a shared entry is only handed out after SIZE and MDTM of
+		 * the login that asks for it */
+		return -1;
+	}
+	fname = cache_objname(cfs, "");
+	if (cacheroot_fd(fname) < 0) {
+		return -1;
+	}
+	if (cache_readmap(cfs, &map) < 0) {
+		return -1;
+	}
+	if (map.nranges && map.size != cfs.size) {
+		/* the new file seems to differ in size -> delete our copy */
+		jlog(8, "cache copy differs in size");
+		reason = CACHE_NOTAVL_SIZE;
+	} else if (map.nranges && map.date != cfs.date) {
+		/* the new file seems to differ in the date -> delete our
+		 * copy */
+		jlog(8, "cache copy differs in the date");
+		reason = CACHE_NOTAVL_DATE;
+	} else if (map.md5[0] && cfs.checksum
+		   && strcasecmp(map.md5, cfs.checksum) != 0) {
+		/* the server has another MD5 sum */
+		jlog(8, "cache copy differs in the MD5 sum");
+		reason = CACHE_NOTAVL_CHECKSUM;
+	}
+	if (reason != CACHE_NOTAVL_EXIST) {
 		cache_delete(cfs, 1);
+		/* forget the old content as well, the new file must not be
+		 * written to its data */
+		if (cache_readmap(cfs, &map) < 0) {
+			return -1;
+		}
+	}
+	if (map.nranges == 0 && cfs.checksum
+	    && config_get_bool("cachededup")) {
+		/* costs no space, it does not need to be admitted */
+		cache_adopt(cfs, &map);
+	}
+	if (!cacheadm_admit(cfs, map.nranges > 0)) {
+		return -1;
+	}
+	if (reason == CACHE_NOTAVL_EXIST && cfs.checked
+	    && cache_map_complete(&map)
+	    && config_get_ioption("cachesoftttl", 0) > 0) {
+		/* the server has just confirmed it */
+		map.checked = cfs.checked;
+		cache_writemap(cfs, &map);
+	}
+	if (map.nranges == 0 && !cacheroot_room(fname, cfs.size)) {
+		return -1;
 	}
 
-	/* set the date */
-	ut.actime = ut.modtime = cfs.date;
-	if (utime(fname, &ut) < 0) {
-		jlog(6, "Could net set date/time information to %s: %s",
+	/* nothing is written to a complete entry */
+	fname = cache_dataname(cfs, &map);
+	if (cache_map_complete(&map)) {
+		fd = cache_openat(fname, O_RDONLY);
+	} else {
+		fd = cache_openat(fname, O_RDWR | O_CREAT);
+	}
+	if (fd < 0) {
+		jlog(2, "Could not open data file %s in cache: %s",
 				fname, strerror(errno));
+		return -1;
+	}
+	if (map.compressed) {
+		if (!(*z = cachez_open(fd, offset))) {
+			jlog(2, "Could not read compressed file %s: %s",
+					fname, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	} else if (lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1) {
+		jlog(2, "Could not seek to %lu in %s: %s",
+				offset, fname, strerror(errno));
+		close(fd);
+		return -1;
 	}
 
-	return cache_writeinfo(cfs);
+	*avail = cache_map_avail(&map, offset);
+	if (*avail && cache_map_complete(&map)) {
+		cachemem_hit(cache_objname(cfs, ""), fd, map.size, map.date,
+				map.md5[0] ? map.md5 : (char*) 0,
+				map.compressed);
+	}
+	if (*avail) {
+		JFTPGW_PROBE2(cache__hit, fname, *avail);
+	} else {
+		JFTPGW_PROBE2(cache__miss, fname, reason);
+	}
+	return fd;
+}
 
+
+/* cache_mem() returns a copy of the file from OFFSET on if it is in the
+ * memory tier, see cachemem.c. LEN is set to the number of bytes */
+
+char* cache_mem(struct cache_filestruct cfs, unsigned long offset,
+		unsigned long* len) {
+	*len = 0;
+	if (!cache_want(cfs) || cfs.size == 0 || cfs.date == (time_t) -1
+	    || (cache_shared(cfs) && !cfs.checked)) {
+		return (char*) 0;
+	}
+	return cachemem_get(cache_objname(cfs, ""), cfs.size, cfs.date,
+				cfs.checksum, offset, len);
 }
 
-int cache_writefd(struct cache_filestruct cfs) {
-/*
-	Add a file to the cache.
 
-	The directory structure is like
+/* cache_record() notes that the bytes [FROM, TO) of the file are in the data
+ * file of the entry now. DIGEST holds the sums of the file from its
+ * beginning if the transfer has passed all of it, otherwise they are
+ * computed from the data file once the entry is complete */
 
-	<cache_prefix> / <user>@<host>:<port> / <filepath> / <filename>
-*/
-	char* path;
-	char* filefn;
+int cache_record(struct cache_filestruct cfs, unsigned long from,
+		 unsigned long to, struct digest* digest) {
+	struct cache_map map;
+	struct timespec ts[2];
+	unsigned long before;
+	char* fname;
 	int fd;
 
-	if (!cache_want(cfs)) {
+	if (from >= to) {
+		return 0;
+	}
+	if (cache_readmap(cfs, &map) < 0) {
 		return -1;
 	}
-
-	/* just delete for sure, don't care about the return value */
-	cache_delete(cfs, 0);
-
-	path = cache_qualifypath(cfs);
-	if (recursive_mkdir(path, cache_perms) < 0 && errno != EEXIST) {
-		jlog(2, "Could not create directory %s: %s",
-			path, strerror(errno));
+	if (map.size != cfs.size || map.date != cfs.date) {
+		/* the parts that have been there before are from another
+		 * version of the file, cache_open() has removed them */
+		map.size = cfs.size;
+		map.date = cfs.date;
+		map.nranges = 0;
+		map.md5[0] = '\0';
+		map.content[0] = '\0';
+	}
+	if (to > cfs.size) {
+		jlog(6, "Got more data than expected for %s, deleting it",
+				cfs.filename);
+		cache_delete(cfs, 1);
+		return -1;
+	}
+	before = cache_map_bytes(&map);
+	cache_map_add(&map, from, to);
+
+	/* the data has to be on the disk before the info file says that it
+	 * is there */
+	fname = cache_objname(cfs, "");
+	if ((fd = cache_openat(fname, O_RDONLY)) < 0 || fsync(fd) < 0) {
+		jlog(2, "Could not sync data file %s: %s",
+				fname, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
 		return -1;
 	}
+	if (cache_map_complete(&map)) {
+		if (!map.md5[0] && digest && digest->length == map.size) {
+			map.crc = digest_final(digest, map.md5);
+		} else if (!map.md5[0]
+			   && digest_file(fd, map.md5, &map.crc) < 0) {
+			jlog(6, "Could not read %s: %s",
+					fname, strerror(errno));
+			map.md5[0] = '\0';
+		}
+		map.checked = cfs.checked;
+		/* the data file gets the date of the file */
+		ts[0].tv_sec = ts[1].tv_sec = cfs.date;
+		ts[0].tv_nsec = ts[1].tv_nsec = 0;
+		if (futimens(fd, ts) < 0) {
+			jlog(6, "Could net set date/time information to %s: %s",
+					fname, strerror(errno));
+		}
+	}
+	close(fd);
+	if (cache_map_complete(&map)
+	    && config_compare_option("cachecompress", "zlib")) {
+		cache_compress(cfs, &map);
+	}
+	if (cache_writemap(cfs, &map) < 0) {
+		if (map.compressed) {
+			fname = cache_objname(cfs, Z_SUFFIX);
+			unlinkat(cacheroot_fd(fname), fname, 0);
+		}
+		return -1;
+	}
+	cacheroot_account(fname, (long) (cache_map_bytes(&map) - before));
+	if (map.compressed) {
+		/* the readers of the new info file use the compressed file */
+		cache_uncompressed_remove(cfs);
+	}
+	if (cache_map_complete(&map)) {
+		jlog(8, "%s%s is complete in the cache as %s, MD5 %s",
+				cfs.filepath, cfs.filename, fname,
+				map.md5[0] ? map.md5 : "unknown");
+		if (map.md5[0] && config_get_bool("cachededup")) {
+			cache_dedup(cfs, &map);
+		}
+	}
+	return 0;
+}
 
-	filefn = cache_qualifyfile(cfs);
-	fd = creat(filefn, cache_perms);
-	if (fd < 0) {
-		jlog(2, "Could not create data file %s in cache: %s",
-				filefn, strerror(errno));
+
+/* write the complete data file of CFS compressed next to it, see cachez.c.
+ * MAP says so afterwards if it has been done */
+
+static
+void cache_compress(struct cache_filestruct cfs, struct cache_map* map) {
+	char* fname = cache_objname(cfs, "");
+	char* zname = cache_objname(cfs, Z_SUFFIX);
+	struct timespec ts[2];
+	int in, out, ret;
+
+	if ((in = cache_openat(fname, O_RDONLY)) < 0) {
+		return;
+	}
+	if ((out = cache_openat(zname, O_WRONLY | O_CREAT | O_TRUNC)) < 0) {
+		jlog(2, "Could not create %s in cache: %s",
+				zname, strerror(errno));
+		close(in);
+		return;
+	}
+	ret = cachez_compress(in, out, map->size);
+	if (ret == 0) {
+		ts[0].tv_sec = ts[1].tv_sec = map->date;
+		ts[0].tv_nsec = ts[1].tv_nsec = 0;
+		futimens(out, ts);
+		map->compressed = 1;
+	}
+	close(in);
+	close(out);
+	if (ret < 0) {
+		jlog(2, "Could not compress %s: %s", fname, strerror(errno));
+	}
+	if (ret != 0) {
+		unlinkat(cacheroot_fd(zname), zname, 0);
+	} else {
+		jlog(8, "Compressed %s", fname);
 	}
-	return fd;
 }
 
-int cache_delete(struct cache_filestruct cfs, int warn) {
-	char* infofile, *datafile;
-	int err = 0;
 
-	infofile = cache_qualifyinfo(cfs);
-	datafile = cache_qualifyfile(cfs);
+/* the data file of CFS is not used any more since its info file says that
+ * the entry is compressed */
 
-	/*if (unlink(infofile) < 0) {
-		jlog(2, "Could not unlink file %s: %s",
-				infofile, strerror(errno));
-		* do not return immediately, try to delete the other entry,
-		 * too *
-		err = -1;
-	}*/
-	if (unlink(datafile) < 0 && warn) {
+static
+void cache_uncompressed_remove(struct cache_filestruct cfs) {
+	char* fname = cache_objname(cfs, "");
+	char* zname = cache_objname(cfs, Z_SUFFIX);
+	int root = cacheroot_fd(fname);
+	struct stat st, zst;
+
+	if (fstatat(root, fname, &st, 0) < 0
+	    || fstatat(root, zname, &zst, 0) < 0) {
+		return;
+	}
+	if (unlinkat(root, fname, 0) < 0) {
 		jlog(2, "Could not unlink file %s: %s",
-				datafile, strerror(errno));
-		err = -1;
+				fname, strerror(errno));
+		return;
 	}
-	return err;
+	cacheroot_account(fname, ((long) zst.st_blocks - st.st_blocks) * 512);
 }
 
-int cache_readfd(struct cache_filestruct cfs) {
-	char* fname = cache_qualifyfile(cfs);
-	int fd;
 
-	if (cache_available(cfs) != CACHE_AVAILABLE) {
+/* cache_sums() looks up the sums of a complete entry. The server is asked
+ * for the size and the date of the file to see if the entry is still
+ * valid. Returns -1 if the sums are not known */
+
+int cache_sums(struct cache_filestruct* cfs, struct clientinfo* clntinfo,
+	       char* md5, unsigned long* crc) {
+	struct cache_map map;
+	char* fname;
+
+	if (cache_readmap(*cfs, &map) < 0
+	    || !cache_map_complete(&map) || !map.md5[0]) {
 		return -1;
 	}
-
-	fd = open(fname, O_RDONLY);
-	return fd;
+	fname = (char*) arena_alloc(strlen(cfs->filepath)
+				+ strlen(cfs->filename) + 1);
+	sprintf(fname, "%s%s", cfs->filepath, cfs->filename);
+	cfs->size = getftpsize(fname, clntinfo);
+	cfs->date = getftpmdtm(fname, clntinfo);
+	if (map.size != cfs->size || map.date != cfs->date) {
+		/* the next download replaces the entry */
+		return -1;
+	}
+	strcpy(md5, map.md5);
+	*crc = map.crc;
+	return 0;
 }
 
-int cache_want(struct cache_filestruct cfs) {
-/*
-	See if we want a file to be added to the cache.
-*/
-	unsigned long int minsize = config_get_size("cacheminsize", 0);
-	unsigned long int maxsize = config_get_size("cachemaxsize", ULONG_MAX);
+/* cache_refresh() checks the entry of FILENAME, an absolute path, against
+ * the server again. It is marked as checked if the file has not changed and
+ * removed if the server reports another size or date. If the server does
+ * not answer, the entry stays and the connection is dropped. Used by the
+ * refresher */
 
-	return (cfs.size <= maxsize && cfs.size >= minsize);
+int cache_refresh(const char* filename, struct clientinfo* clntinfo) {
+	struct cache_filestruct cfs;
+	struct cache_map map;
+	int ret = 0;
+
+	cfs = cache_gather_info(filename, clntinfo, CACHE_INFO_PATH);
+	if (cache_readmap(cfs, &map) < 0 || !cache_map_complete(&map)
+	    || time(NULL) - map.checked
+			< config_get_ioption("cachesoftttl", 0)) {
+		/* gone or checked by another session in the meantime */
+		free(cfs.filepath);
+		free(cfs.filename);
+		return 0;
+	}
+	if (getftpstat(filename, clntinfo, &cfs.size, &cfs.date) < 0) {
+		/* no answer is not a change. The connection may have died
+		 * while it was idle, the next file logs in again */
+		jlog(6, "Could not check %s, leaving it in the cache",
+				filename);
+		close(clntinfo->serversocket);
+		clntinfo->serversocket = -1;
+		free(cfs.filepath);
+		free(cfs.filename);
+		return -1;
+	}
+	if (cfs.size == map.size && cfs.date == map.date) {
+		jlog(8, "%s has not changed", filename);
+		map.checked = time(NULL);
+		ret = cache_writemap(cfs, &map);
+	} else {
+		jlog(8, "%s has changed, removing it from the cache",
+				filename);
+		ret = cache_delete(cfs, 0);
+	}
+	free(cfs.filepath);
+	free(cfs.filename);
+	return ret;
 }
 
-int cache_readinfo(struct cache_filestruct *cfs) {
-	char* fname = cache_qualifyinfo(*cfs);
-	char checksumbuf[128];
-	int fdinfo;
-	int i;
-
-	return 0; /* not yet implemented */
 
-	if (cfs->checksum) {
-		free(cfs->checksum);
-		cfs->checksum = (char*) 0;
-	}
+/* cache_upload() is called before a file is uploaded through the proxy.
+ * The entry of the file is removed, it is out of date once the upload has
+ * begun. If the upload may go to the cache, an empty data file is returned
+ * that gets the data on the way, otherwise -1. Until cache_uploaded() has
+ * been called there is no info file, so the entry holds nothing */
 
-	fdinfo = open(fname, O_RDONLY);
+int cache_upload(struct cache_filestruct cfs, int keep) {
+	char* fname;
+	int fd;
 
-	if (fdinfo < 0) {
-		jlog(2, "Could not open file %s in cache: %s",
-				fname, strerror(errno));
+	cache_delete(cfs, 0);
+	if (!keep) {
 		return -1;
 	}
-
-	/* file is opened */
-	i = read(fdinfo, checksumbuf, sizeof(checksumbuf) - 1);
-	if (i < 0) {
-		jlog(3, "Could not read info from file %s: %s",
-				fname, strerror(errno));
-		close(fdinfo);
+	fname = cache_objname(cfs, "");
+	if (!cacheroot_room(fname, 0)) {
 		return -1;
 	}
-
-	if (i > 0 && i < sizeof(checksumbuf)) {
-		checksumbuf[i] = '\0';
+	if ((fd = cache_openat(fname, O_RDWR | O_CREAT | O_TRUNC)) < 0) {
+		jlog(2, "Could not create data file %s in cache: %s",
+				fname, strerror(errno));
 	}
-	cfs->checksum = strdup(checksumbuf);
-	close(fdinfo);
-	return 0;
+	return fd;
 }
 
 
-int cache_writeinfo(struct cache_filestruct cfs) {
-	char* fname = cache_qualifyinfo(cfs);
-	int fdinfo;
-	int i;
+/* cache_uploaded() records the upload that has put STORED bytes into the
+ * data file from cache_upload(). It is only kept if the server has
+ * confirmed the upload (COMPLETE) and reports the same size, its date is
+ * the one that the server reports */
 
-	return 0; /* not yet implemented */
+int cache_uploaded(struct cache_filestruct cfs, struct clientinfo* clntinfo,
+		   unsigned long stored, struct digest* digest,
+		   int complete) {
+	char* complete_fname;
+	size_t size;
 
-	fdinfo = creat(fname, cache_perms);
-	if (fdinfo < 0) {
-		jlog(2, "Could not create info file %s in cache: %s",
-				fname, strerror(errno));
-		return -1;
+	if (complete) {
+		size = strlen(cfs.filepath) + strlen(cfs.filename) + 1;
+		complete_fname = (char*) calloc(1, size);
+		enough_mem(complete_fname);
+		snprintf(complete_fname, size, "%s%s",
+				cfs.filepath, cfs.filename);
+		cfs.size = getftpsize(complete_fname, clntinfo);
+		cfs.date = getftpmdtm(complete_fname, clntinfo);
+		cfs.checked = time(NULL);
+		free(complete_fname);
+	}
+	if (!complete || cfs.size != stored || cfs.size == 0
+	    || cfs.date == (time_t) -1 || !cache_want(cfs)) {
+		jlog(8, "Not keeping the upload of %s%s in the cache",
+				cfs.filepath, cfs.filename);
+		return cache_delete(cfs, 0);
 	}
+	jlog(8, "Keeping the upload of %s%s in the cache",
+			cfs.filepath, cfs.filename);
+	return cache_record(cfs, 0, stored, digest);
+}
 
-	/* file is created and opened */
-	/* write the info */
-	i = write(fdinfo, cfs.checksum, strlen(cfs.checksum));
-	i += write(fdinfo, "\n", 1);
 
-	close(fdinfo);
+int cache_delete(struct cache_filestruct cfs, int warn) {
+	char* infofile, *datafile, *zfile;
+	struct cache_map map;
+	struct stat st;
+	int root, err = 0;
 
-	if (i == strlen(cfs.checksum) + 1) {
-		return 0;
-	} else {
+	datafile = cache_objname(cfs, "");
+	if ((root = cacheroot_fd(datafile)) < 0) {
 		return -1;
 	}
+	if (cache_readmap(cfs, &map) == 0 && map.content[0]) {
+		/* there is no data file of its own */
+		cache_unref(cfs, &map);
+		warn = 0;
+	}
+	infofile = cache_objname(cfs, INFO_SUFFIX);
+	if (unlinkat(root, infofile, 0) < 0 && errno != ENOENT) {
+		jlog(2, "Could not unlink file %s: %s",
+				infofile, strerror(errno));
+		/* do not return immediately, try to delete the other entry,
+		 * too */
+		err = -1;
+	}
+	JFTPGW_PROBE2(cache__evict, datafile, cfs.size);
+	cachemem_drop(datafile);
+	zfile = cache_objname(cfs, Z_SUFFIX);
+	if (fstatat(root, zfile, &st, 0) == 0
+	    && unlinkat(root, zfile, 0) == 0) {
+		/* then the data file is usually gone already */
+		cacheroot_account(zfile, -(long) st.st_blocks * 512);
+		warn = 0;
+	}
+	if (fstatat(root, datafile, &st, 0) < 0) {
+		st.st_blocks = 0;
+	}
+	if (unlinkat(root, datafile, 0) < 0) {
+		if (warn) {
+			jlog(2, "Could not unlink file %s: %s",
+					datafile, strerror(errno));
+			err = -1;
+		}
+	} else {
+		cacheroot_account(datafile, -(long) st.st_blocks * 512);
+	}
+	return err;
 }
 
+int cache_want(struct cache_filestruct cfs) {
+/*
+	See if we want a file to be added to the cache.
+*/
+	unsigned long int minsize = config_get_size("cacheminsize", 0);
+	unsigned long int maxsize = config_get_size("cachemaxsize", ULONG_MAX);
 
-char* cache_qualifypath(const struct cache_filestruct cfs) {
-	size_t size;
-	static char* path;
+	return (cfs.size <= maxsize && cfs.size >= minsize);
+}
+
+
+/* The entries are not stored under the path of the file but under the MD5
+ * sum of their key, the login "user@host:port" and the path on the server:
+ *
+ *	<cacheroot>/3f/a2/3fa2...c1		the data
+ *	<cacheroot>/3f/a2/3fa2...c1.info	the info file
+ *
+ * Two levels of 256 directories keep the directories small however deep the
+ * trees on the servers are. The files are opened relative to a descriptor
+ * of the cache directory that is kept open, so only three names have to be
+ * looked up. The sum also chooses the cache directory if there are several
+ * of them, see cacheroot.c. The info file has the key for the tools. */
+
+/* the name of the server of CFS in the keys */
+
+static
+const char* cache_hostname(const struct cache_filestruct cfs) {
 	const char* hostname;
 	unsigned long iaddr;
-	const char* cache_prefix = config_get_option("cacheprefix");
 
-	if (!cache_prefix || config_get_bool("cache") == 0) {
-		return (char*) 0;
-	}
 	iaddr = inet_addr(cfs.host);
 	if (iaddr == (unsigned long int) UINT_MAX) {
 		/* cfs.host was not a valid IP */
@@ -319,65 +867,401 @@ char* cache_qualifypath(const struct cache_filestruct cfs) {
 			hostname = cfs.host;
 		}
 	}
+	return hostname;
+}
+
+
+/* the name of an entry relative to the cache directory, SUFFIX is appended.
+ * The name is allocated from the arena */
+
+static
+char* cache_objname(const struct cache_filestruct cfs, const char* suffix) {
+	struct digest d;
+	char md5[ DIGEST_MD5LEN ];
+	const char* hostname = cache_hostname(cfs);
+	char* key, *name;
+	size_t size;
 
-	size =  	  strlen(cache_prefix) + 1
-			+ strlen(cfs.user)     + 1
+	size =  	  strlen(cfs.user)     + 1
 			+ strlen(hostname)     + 1
 			+ 20
-			+ strlen(cfs.filepath) + 1
-			+ 1;
+			+ strlen(cfs.filepath)
+			+ strlen(cfs.filename) + 1;
+	key = (char*) arena_alloc(size);
+	snprintf(key, size, "%s@%s:%d%s%s", cfs.user, hostname, cfs.port,
+			cfs.filepath, cfs.filename);
+
+	digest_init(&d);
+	digest_update(&d, key, strlen(key));
+	digest_final(&d, md5);
+
+	size = 6 + DIGEST_MD5LEN + strlen(suffix);
+	name = (char*) arena_alloc(size);
+	snprintf(name, size, "%.2s/%.2s/%s%s", md5, md5 + 2, md5, suffix);
+	return name;
+}
 
-	if (path) {
-		path = (char*) realloc(path, size);
-	} else {
-		path = (char*) malloc(size);
+
+/* Entries with the same content share their data. Once an entry is
+ * complete its data file becomes the object of its MD5 sum, or is replaced
+ * by the object if there is one already:
+ *
+ *	<cacheroot>/9e/10/9e10...7b.obj			the object
+ *	<cacheroot>/9e/10/9e10...7b.ref.3fa2...c1	a reference
+ *
+ * The info file of the entry names the object in a "content" line. Every
+ * entry has a hard link of its own to the object and reads it through that
+ * link, so the number of links is the reference count and an entry keeps
+ * its data even if the object is removed under it. The object is placed by
+ * its own sum, so an entry and its object may be in different cache
+ * directories. Compressed objects end in ".zobj" and ".zref.".
+ *
+ * A file that is not in the cache at all is looked up by the MD5 sum that
+ * the server reports with XMD5 (cachevalidate md5) and is then not fetched
+ * at all. The server could claim any sum, so this only happens if an entry
+ * of the same login and server refers to the object already, or of the
+ * same server if "cacheshared" is set. The references carry the sum of
+ * that scope in their name for this:
+ *
+ *	<cacheroot>/9e/10/9e10...7b.ref.<sum of u@host:port>.<sum of key> */
+
+/* the name of the object of MD5 or of the reference of the entry KEY to
+ * it, relative to the cache directory */
+
+static
+char* cache_contentname(const char* md5, const char* suffix,
+			const char* key) {
+	size_t size = 6 + DIGEST_MD5LEN + strlen(suffix)
+				+ (key ? strlen(key) : 0);
+	char* name = (char*) arena_alloc(size);
+
+	snprintf(name, size, "%.2s/%.2s/%s%s%s", md5, md5 + 2, md5, suffix,
+			key ? key : "");
+	return name;
+}
+
+
+/* the sum of the scope of CFS, the login and the server without the path.
+ * With "cacheshared" the user is "*" for all logins */
+
+static
+char* cache_scope(const struct cache_filestruct cfs) {
+	const char* hostname = cache_hostname(cfs);
+	struct digest d;
+	size_t size = strlen(cfs.user) + 1 + strlen(hostname) + 20;
+	char* key = (char*) arena_alloc(size);
+	char* md5 = (char*) arena_alloc(DIGEST_MD5LEN);
+
+	snprintf(key, size, "%s@%s:%d", cfs.user, hostname, cfs.port);
+	digest_init(&d);
+	digest_update(&d, key, strlen(key));
+	digest_final(&d, md5);
+	return md5;
+}
+
+
+/* the name of the file that has the data of the entry of CFS */
+
+static
+char* cache_dataname(const struct cache_filestruct cfs,
+		     const struct cache_map* map) {
+	char* key;
+
+	if (map->content[0]) {
+		/* the sums of the scope and of the key, the latter after the
+		 * directories */
+		key = (char*) arena_alloc(2 * DIGEST_MD5LEN);
+		snprintf(key, 2 * DIGEST_MD5LEN, "%s.%s", cache_scope(cfs),
+				cache_objname(cfs, "") + 6);
+		return cache_contentname(map->content,
+				map->compressed ? ZREF_SUFFIX : REF_SUFFIX,
+				key);
 	}
-	enough_mem(path);
+	return cache_objname(cfs, map->compressed ? Z_SUFFIX : "");
+}
+
 
-	snprintf(path, size, "%s/%s@%s:%d/%s",
-			cache_prefix,
-			cfs.user,
-			hostname,
-			cfs.port,
-			cfs.filepath);
+/* does an entry of the scope of CFS refer to the object of MD5 already?
+ * REFSUFFIX tells if the object is compressed. ROOT is its directory */
 
-	return path;
+static
+int cache_scope_refers(const struct cache_filestruct cfs, int root,
+		       const char* md5, const char* refsuffix) {
+	/* the name without the directories, up to the sum of the key */
+	char* prefix = cache_contentname(md5, refsuffix, cache_scope(cfs)) + 6;
+	size_t len = strlen(prefix);
+	char dir[6];
+	DIR* d;
+	struct dirent* e;
+	int fd, found = 0;
+
+	snprintf(dir, sizeof(dir), "%.2s/%.2s", md5, md5 + 2);
+	if ((fd = openat(root, dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		return 0;
+	}
+	if (!(d = fdopendir(fd))) {
+		close(fd);
+		return 0;
+	}
+	while (!found && (e = readdir(d))) {
+		found = strncmp(e->d_name, prefix, len) == 0
+			&& e->d_name[ len ] == '.';
+	}
+	closedir(d);
+	return found;
 }
 
 
-char* cache_qualifyfile(const struct cache_filestruct cfs) {
-	char* path = cache_qualifypath(cfs);
-	size_t size = strlen(path) + 1 + strlen(cfs.filename) + 1;
-	static char* filename;
+/* copy the file FROM to TO in another cache directory, TO is replaced
+ * atomically */
 
-	if (filename) {
-		filename = (char*) realloc(filename, size);
-	} else {
-		filename = (char*) malloc(size);
+static
+int cache_copy(const char* from, const char* to) {
+	char* tmpname = (char*) arena_alloc(strlen(to) + 5);
+	char buffer[ 16384 ];
+	ssize_t n;
+	int in, out, err = 0;
+
+	sprintf(tmpname, "%s.new", to);
+	if ((in = cache_openat(from, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if ((out = cache_openat(tmpname, O_WRONLY | O_CREAT | O_TRUNC)) < 0) {
+		close(in);
+		return -1;
 	}
-	enough_mem(filename);
+	while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+		if (write(out, buffer, n) != n) {
+			err = -1;
+			break;
+		}
+	}
+	if (n < 0 || fsync(out) < 0) {
+		err = -1;
+	}
+	close(in);
+	close(out);
+	if (err == 0 && renameat(cacheroot_fd(tmpname), tmpname,
+				 cacheroot_fd(to), to) < 0) {
+		err = -1;
+	}
+	if (err < 0) {
+		unlinkat(cacheroot_fd(tmpname), tmpname, 0);
+	}
+	return err;
+}
+
 
-	snprintf(filename, size, "%s/%s", path, cfs.filename);
+/* the complete entry of CFS gives its data file to the object of its MD5
+ * sum or uses the object that is there already. MAP is written with the
+ * content line */
 
-	return filename;
+static
+void cache_dedup(struct cache_filestruct cfs, struct cache_map* map) {
+	char* own = cache_objname(cfs, map->compressed ? Z_SUFFIX : "");
+	char* obj = cache_contentname(map->md5,
+			map->compressed ? ZOBJ_SUFFIX : OBJ_SUFFIX, (char*) 0);
+	char* ref;
+	int ownroot = cacheroot_fd(own), objroot = cacheroot_fd(obj);
+	struct stat st, ost;
+
+	if (ownroot < 0 || objroot < 0 || fstatat(ownroot, own, &st, 0) < 0
+	    || cache_mkdirs(objroot, obj) < 0) {
+		return;
+	}
+	if (fstatat(objroot, obj, &ost, 0) < 0) {
+		/* the first copy of the content becomes the object */
+		if (linkat(ownroot, own, objroot, obj, 0) == 0
+		    || (errno == EXDEV && cache_copy(own, obj) == 0)) {
+			cacheroot_account(obj, (long) st.st_blocks * 512);
+		} else if (errno != EEXIST) {
+			jlog(3, "Could not create the object %s: %s",
+					obj, strerror(errno));
+			return;
+		}
+	}
+	strcpy(map->content, map->md5);
+	ref = cache_dataname(cfs, map);
+	if (linkat(objroot, obj, objroot, ref, 0) < 0 && errno != EEXIST) {
+		jlog(3, "Could not link %s to %s: %s",
+				ref, obj, strerror(errno));
+		map->content[0] = '\0';
+		return;
+	}
+	if (cache_writemap(cfs, map) < 0) {
+		unlinkat(objroot, ref, 0);
+		map->content[0] = '\0';
+		return;
+	}
+	/* the readers of the new info file use the object */
+	if (unlinkat(ownroot, own, 0) == 0) {
+		cacheroot_account(own, -(long) st.st_blocks * 512);
+	}
+	if (fstatat(objroot, obj, &ost, 0) == 0) {
+		jlog(8, "%s%s shares %s with %ld other entries",
+				cfs.filepath, cfs.filename, obj,
+				(long) ost.st_nlink - 2);
+	}
 }
 
 
-char* cache_qualifyinfo(const struct cache_filestruct cfs) {
-	char* filename = cache_qualifyfile(cfs);
-	size_t size = strlen(filename) + strlen(INFO_SUFFIX) + 1;
-	static char* infoname;
+/* the entry of CFS, that is not in the cache, gets the object of the MD5
+ * sum that the server has reported if there is one. MAP is the complete
+ * entry then, returns -1 if there is no object */
+
+static
+int cache_adopt(struct cache_filestruct cfs, struct cache_map* map) {
+	struct cache_map m = *map;
+	struct cachez* z;
+	struct digest d;
+	char buffer[ 16384 ];
+	char md5[ DIGEST_MD5LEN ];
+	char* obj, *ref;
+	int objroot, fd, n;
+
+	snprintf(md5, sizeof(md5), "%s", cfs.checksum);
+	for (n = 0; md5[n]; n++) {
+		md5[n] = tolower((int) md5[n]);
+	}
+	if (strlen(md5) != DIGEST_MD5LEN - 1) {
+		return -1;
+	}
+	/* a compressed object or a plain one */
+	m.compressed = 1;
+	obj = cache_contentname(md5, ZOBJ_SUFFIX, (char*) 0);
+	if ((objroot = cacheroot_fd(obj)) < 0) {
+		return -1;
+	}
+	if ((fd = openat(objroot, obj, O_RDONLY)) < 0) {
+		m.compressed = 0;
+		obj = cache_contentname(md5, OBJ_SUFFIX, (char*) 0);
+		if ((fd = openat(objroot, obj, O_RDONLY)) < 0) {
+			return -1;
+		}
+	}
+
+	/* the server's word for the sum is not enough to hand out the data
+	 * of another login or server */
+	if (!cache_scope_refers(cfs, objroot, md5,
+				m.compressed ? ZREF_SUFFIX : REF_SUFFIX)) {
+		jlog(8, "%s is in the cache, but not for this login and server",
+				obj);
+		close(fd);
+		return -1;
+	}
 
-	if (infoname) {
-		infoname = (char*) realloc(infoname, size);
+	/* the CRC-32 is not in the name, the object is read once */
+	digest_init(&d);
+	if (m.compressed) {
+		if (!(z = cachez_open(fd, 0))) {
+			close(fd);
+			return -1;
+		}
+		while ((n = cachez_read(z, buffer, sizeof(buffer))) > 0) {
+			digest_update(&d, buffer, n);
+		}
+		cachez_close(z);
 	} else {
-		infoname = (char*) malloc(size);
+		while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+			digest_update(&d, buffer, n);
+		}
+	}
+	close(fd);
+	if (n < 0 || d.length != cfs.size) {
+		return -1;
+	}
+	m.crc = digest_final(&d, m.md5);
+	if (strcmp(m.md5, md5) != 0) {
+		jlog(3, "The object %s has the MD5 sum %s", obj, m.md5);
+		return -1;
+	}
+
+	strcpy(m.content, md5);
+	ref = cache_dataname(cfs, &m);
+	if (linkat(objroot, obj, objroot, ref, 0) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	m.size = cfs.size;
+	m.date = cfs.date;
+	m.checked = cfs.checked;
+	m.nranges = 0;
+	cache_map_add(&m, 0, cfs.size);
+	if (cache_writemap(cfs, &m) < 0) {
+		unlinkat(objroot, ref, 0);
+		return -1;
+	}
+	*map = m;
+	jlog(8, "%s%s is in the cache as %s already", cfs.filepath,
+			cfs.filename, obj);
+	return 0;
+}
+
+
+/* the entry of CFS drops its reference to its object, the object is
+ * removed with the last one */
+
+static
+void cache_unref(struct cache_filestruct cfs, const struct cache_map* map) {
+	char* ref = cache_dataname(cfs, map);
+	char* obj = cache_contentname(map->content,
+			map->compressed ? ZOBJ_SUFFIX : OBJ_SUFFIX, (char*) 0);
+	int root = cacheroot_fd(obj);
+	struct stat st;
+
+	if (root < 0) {
+		return;
 	}
-	enough_mem(infoname);
+	if (unlinkat(root, ref, 0) < 0 && errno != ENOENT) {
+		jlog(2, "Could not unlink file %s: %s", ref, strerror(errno));
+		return;
+	}
+	/* an entry that links to the object right now still has its own
+	 * link, only the object name is gone then */
+	if (fstatat(root, obj, &st, 0) == 0 && st.st_nlink == 1
+	    && unlinkat(root, obj, 0) == 0) {
+		jlog(8, "Removed the object %s", obj);
+		cacheroot_account(obj, -(long) st.st_blocks * 512);
+	}
+}
+
+
+/* create the two directories of NAME below ROOT */
+
+static
+int cache_mkdirs(int root, const char* name) {
+	char dir[6];
+
+	snprintf(dir, sizeof(dir), "%.2s", name);
+	if (mkdirat(root, dir, cache_perms) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%.5s", name);
+	if (mkdirat(root, dir, cache_perms) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/* open NAME relative to the cache directory, the directories of the name
+ * are created if the file is */
 
-	snprintf(infoname, size, "%s/%s", filename, INFO_SUFFIX);
+static
+int cache_openat(const char* name, int flags) {
+	int root = cacheroot_fd(name), fd;
 
-	return infoname;
+	if (root < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	fd = openat(root, name, flags, cache_perms);
+	if (fd < 0 && errno == ENOENT && flags & O_CREAT) {
+		if (cache_mkdirs(root, name) < 0) {
+			return -1;
+		}
+		fd = openat(root, name, flags, cache_perms);
+	}
+	return fd;
 }
 
 
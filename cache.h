@@ -32,20 +32,75 @@ struct cache_filestruct {
 	char* filepath;
 	char* filename;
 	unsigned long size;
+	/* the MD5 sum of the file as the server has reported it, or NULL */
 	char* checksum;
 	time_t date;
+	/* when the server has reported the size and the date, 0 if they are
+	 * taken from the cache */
+	time_t checked;
+	/* the entry is sent without asking the server but should be checked
+	 * in the background, see refresh.c */
+	int stale;
 };
 
+/* the running MD5 and CRC-32 of a file, see digest.c */
+#define DIGEST_MD5LEN		33
 
-int cache_add(struct cache_filestruct);
+struct digest {
+	unsigned int state[4];
+	unsigned char buffer[64];
+	unsigned long crc;
+	unsigned long length;
+};
+
+#define CACHE_MAX_RANGES		16
+
+/* the parts of a file that are in the cache */
+struct cache_map {
+	unsigned long size;
+	time_t date;
+	int nranges;
+	struct {
+		unsigned long from;
+		unsigned long to;
+	} ranges[ CACHE_MAX_RANGES ];
+	/* the sums of a complete file, md5 is empty if they are unknown */
+	char md5[ DIGEST_MD5LEN ];
+	unsigned long crc;
+	/* the file is in "<name>.z", see cachez.c */
+	int compressed;
+	/* when the server has last confirmed the size and the date */
+	time_t checked;
+	/* the MD5 sum of the shared object that has the data, empty if the
+	 * entry has a data file of its own */
+	char content[ DIGEST_MD5LEN ];
+};
+
+/* what cache_gather_info() asks the server for */
+#define CACHE_INFO_PATH			0
+#define CACHE_INFO_DATE			1
+#define CACHE_INFO_HASH			2
+
+
+struct cachez;
+int cache_open(struct cache_filestruct, unsigned long offset,
+		unsigned long* avail, struct cachez**);
+char* cache_mem(struct cache_filestruct, unsigned long offset,
+		unsigned long* len);
+int cache_record(struct cache_filestruct, unsigned long from,
+		unsigned long to, struct digest*);
 int cache_delete(struct cache_filestruct, int warn);
-int cache_readfd(struct cache_filestruct);
-int cache_writefd(struct cache_filestruct);
+int cache_upload(struct cache_filestruct, int keep);
 int cache_want(struct cache_filestruct);
 
 struct clientinfo;
 int cache_init(struct clientinfo*);
 int cache_shutdown(struct clientinfo*);
 struct cache_filestruct cache_gather_info(const char* filename,
-		struct clientinfo*);
+		struct clientinfo*, int flags);
+int cache_sums(struct cache_filestruct*, struct clientinfo*, char* md5,
+		unsigned long* crc);
+int cache_refresh(const char* filename, struct clientinfo*);
+int cache_uploaded(struct cache_filestruct, struct clientinfo*,
+		unsigned long stored, struct digest*, int complete);
 
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* cacheadm.c - the admission of files to the cache
+ *
+ * Every file within "cacheminsize" and "cachemaxsize" used to go to the
+ * cache on its first download. A single download of a large image then
+ * costs a full write to the cache and pushes out the files that are asked
+ * for again and again. "cacheadmission" chooses who gets in:
+ *
+ *	all	every file, as before
+ *	second	a file that has been asked for before within
+ *		"cacheadmitwindow" seconds
+ *	tinylfu	a file whose estimated number of recent requests is at
+ *		least "cacheadmitcount". The requests are counted in a
+ *		count-min sketch that is halved every now and then, so old
+ *		popularity fades away
+ *
+ * Only files that are not in the cache at all are subject to the filter,
+ * the rest of a partly cached file is always added. Both tables are in
+ * shared memory, so the requests of all sessions count.
+ *
+ * The outcome of every download is counted per policy. If "cachestatsfile"
+ * is set, the counters are written to that file whenever a session ends,
+ * so the hit ratios of the policies can be compared.
+ *
+ * Files that are prefetched (see prefetch.c) have not been asked for, they
+ * are admitted without being counted. */
+
+#include <fcntl.h>
+#include "jftpgw.h"
+
+#define CACHEADM_ROWS		4
+#define CACHEADM_WIDTH		8192
+#define CACHEADM_MAXCOUNT	15
+/* the sketch is halved after this many requests */
+#define CACHEADM_SAMPLE		(10 * CACHEADM_WIDTH)
+#define CACHEADM_SEEN		8192
+
+#define CACHEADM_ALL		0
+#define CACHEADM_SECOND		1
+#define CACHEADM_TINYLFU	2
+#define CACHEADM_POLICIES	3
+
+static const char* cacheadm_names[ CACHEADM_POLICIES ] = {
+	"all", "second", "tinylfu"
+};
+
+/* set while files are prefetched */
+static int cacheadm_bypassed;
+
+struct cacheadm_seen {
+	unsigned int hash;
+	time_t when;
+};
+
+struct cacheadm_stats {
+	unsigned long requests;
+	unsigned long hits;		/* all of it from the cache */
+	unsigned long partial;		/* a part of it from the cache */
+	unsigned long misses;		/* admitted, nothing in the cache */
+	unsigned long rejected;		/* not admitted */
+	unsigned long bytes_cache;
+	unsigned long bytes_server;
+};
+
+struct cacheadm_shared {
+	unsigned char sketch[ CACHEADM_ROWS ][ CACHEADM_WIDTH ];
+	unsigned long additions;
+	struct cacheadm_seen seen[ CACHEADM_SEEN ];
+	struct cacheadm_stats stats[ CACHEADM_POLICIES ];
+};
+
+static struct cacheadm_shared* cacheadm;
+
+
+int cacheadm_init(void) {
+	cacheadm = (struct cacheadm_shared*)
+			shmem_alloc(sizeof(struct cacheadm_shared));
+	if (!cacheadm) {
+		return -1;
+	}
+	return 0;
+}
+
+
+static
+int cacheadm_policy(void) {
+	int i;
+
+	for (i = 0; i < CACHEADM_POLICIES; i++) {
+		if (config_compare_option("cacheadmission",
+					cacheadm_names[i])) {
+			return i;
+		}
+	}
+	return CACHEADM_ALL;
+}
+
+
+static
+unsigned int cacheadm_hash(const char* s, unsigned int h) {
+	/* FNV-1a */
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+/* count a request for the file with the hash H1 and return the estimated
+ * number of recent requests. Has to be called with the lock held */
+
+static
+int cacheadm_sketch_add(unsigned int h1, unsigned int h2) {
+	unsigned char* c;
+	int i, j, min = CACHEADM_MAXCOUNT;
+
+	for (i = 0; i < CACHEADM_ROWS; i++) {
+		c = &cacheadm->sketch[i][ (h1 + i * h2) % CACHEADM_WIDTH ];
+		if (*c < CACHEADM_MAXCOUNT) {
+			(*c)++;
+		}
+		min = MIN_VAL(min, *c);
+	}
+	if (++cacheadm->additions >= CACHEADM_SAMPLE) {
+		/* age the counts */
+		for (i = 0; i < CACHEADM_ROWS; i++) {
+			for (j = 0; j < CACHEADM_WIDTH; j++) {
+				cacheadm->sketch[i][j] >>= 1;
+			}
+		}
+		cacheadm->additions /= 2;
+	}
+	return min;
+}
+
+
+/* note the request and return 1 if the file has been asked for within
+ * WINDOW seconds before. Has to be called with the lock held */
+
+static
+int cacheadm_seen_add(unsigned int h, int window) {
+	struct cacheadm_seen* s = &cacheadm->seen[ h % CACHEADM_SEEN ];
+	time_t now = time(NULL);
+	int again = s->hash == h && s->when && now - s->when <= window;
+
+	s->hash = h;
+	s->when = now;
+	return again;
+}
+
+
+/* cacheadm_bypass() admits all files without counting them while ON is
+ * set */
+
+void cacheadm_bypass(int on) {
+	cacheadm_bypassed = on;
+}
+
+
+/* cacheadm_admit() is called for every download that could go to the
+ * cache. It counts the request and returns 1 if the file may be added,
+ * CACHED is 1 if a part of it is in the cache already */
+
+int cacheadm_admit(struct cache_filestruct cfs, int cached) {
+	unsigned int h1, h2;
+	int policy, estimate, again, admit = 1;
+
+	if (!cacheadm || cacheadm_bypassed) {
+		return 1;
+	}
+	policy = cacheadm_policy();
+	/* the directory, the name and the login of the file */
+	h1 = cacheadm_hash(cfs.filepath, 2166136261U);
+	h1 = cacheadm_hash(cfs.filename, h1);
+	h1 = cacheadm_hash(cfs.user, h1);
+	h1 = cacheadm_hash(cfs.host, h1);
+	h2 = (h1 >> 17 | h1 << 15) | 1;
+
+	shmem_lock(cacheadm);
+	/* both are kept up to date, the policy may be changed */
+	estimate = cacheadm_sketch_add(h1, h2);
+	again = cacheadm_seen_add(h1,
+			config_get_ioption("cacheadmitwindow", 3600));
+	if (!cached) {
+		if (policy == CACHEADM_SECOND) {
+			admit = again;
+		} else if (policy == CACHEADM_TINYLFU) {
+			admit = estimate
+				>= config_get_ioption("cacheadmitcount", 2);
+		}
+		if (!admit) {
+			cacheadm->stats[ policy ].rejected++;
+		}
+	}
+	shmem_unlock(cacheadm);
+
+	if (!admit) {
+		jlog(8, "Not admitting %s to the cache (%s)", cfs.filename,
+				cacheadm_names[ policy ]);
+	}
+	return admit;
+}
+
+
+/* cacheadm_count() counts the outcome of a download. FROMCACHE bytes came
+ * from the cache and FROMSERVER from the server. A rejected download has
+ * been counted by cacheadm_admit() already, only its bytes are added */
+
+void cacheadm_count(unsigned long fromcache, unsigned long fromserver,
+		    int rejected) {
+	struct cacheadm_stats* st;
+
+	if (!cacheadm) {
+		return;
+	}
+	shmem_lock(cacheadm);
+	st = &cacheadm->stats[ cacheadm_policy() ];
+	st->requests++;
+	if (!rejected) {
+		if (fromserver == 0) {
+			st->hits++;
+		} else if (fromcache > 0) {
+			st->partial++;
+		} else {
+			st->misses++;
+		}
+	}
+	st->bytes_cache += fromcache;
+	st->bytes_server += fromserver;
+	shmem_unlock(cacheadm);
+}
+
+
+/* cacheadm_report() writes the counters to the "cachestatsfile" */
+
+void cacheadm_report(void) {
+	struct cacheadm_stats stats[ CACHEADM_POLICIES ];
+	const char* fname = config_get_option("cachestatsfile");
+	char* path, *tmpname;
+	double ratio, byteratio;
+	FILE* f;
+	int i, fd;
+
+	if (!cacheadm || !fname) {
+		return;
+	}
+	shmem_lock(cacheadm);
+	memcpy(stats, cacheadm->stats, sizeof(stats));
+	shmem_unlock(cacheadm);
+
+	path = chrooted_path(fname);
+	tmpname = (char*) malloc(strlen(path) + 16);
+	enough_mem(tmpname);
+	sprintf(tmpname, "%s.%d", path, (int) getpid());
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		jlog(4, "Could not write the cache statistics to %s: %s",
+				tmpname, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(tmpname);
+		free(path);
+		return;
+	}
+	fprintf(f, "%-8s %10s %10s %10s %10s %10s %8s %8s\n",
+			"policy", "requests", "hits", "partial", "misses",
+			"rejected", "hits%", "bytes%");
+	for (i = 0; i < CACHEADM_POLICIES; i++) {
+		ratio = stats[i].requests
+			? 100.0 * stats[i].hits / stats[i].requests : 0;
+		byteratio = stats[i].bytes_cache + stats[i].bytes_server
+			? 100.0 * stats[i].bytes_cache
+			  / (stats[i].bytes_cache + stats[i].bytes_server)
+			: 0;
+		fprintf(f, "%-8s %10lu %10lu %10lu %10lu %10lu %8.2f %8.2f\n",
+				cacheadm_names[i], stats[i].requests,
+				stats[i].hits, stats[i].partial,
+				stats[i].misses, stats[i].rejected,
+				ratio, byteratio);
+	}
+	if ((ferror(f) | fclose(f)) || rename(tmpname, path) < 0) {
+		jlog(4, "Could not write the cache statistics to %s: %s",
+				path, strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+	free(path);
+}
+
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* cachemem.c - the memory tier of the cache
+ *
+ * Small files that are asked for all the time, indexes and lists of
+ * checksums, would otherwise be read from the disk for every hit together
+ * with their info files. With "cachememory" a shared memory area of that
+ * size holds copies of them: a complete entry of the disk cache of at most
+ * "cachememmaxsize" bytes is copied to memory when it has been hit
+ * "cachememhits" times and from then on is sent to the client from there.
+ *
+ * The area is filled like a ring: a new copy is put behind the last one,
+ * at the end it starts over at the beginning and the oldest copies are
+ * overwritten. A copy is found through a table of CACHEMEM_ENTRIES slots
+ * indexed by the MD5 sum of the entry name, the slot also counts the hits
+ * of an entry that is not in memory yet. A copy is only used if the size,
+ * the date and if known the MD5 sum that the server reports match, and it
+ * is dropped whenever the entry on the disk is replaced or removed. */
+
+#include "jftpgw.h"
+
+#define CACHEMEM_ENTRIES	4096
+
+struct cachemem_entry {
+	char name[ DIGEST_MD5LEN ];	/* empty if the slot is unused */
+	unsigned long size;
+	time_t date;
+	char md5[ DIGEST_MD5LEN ];
+	int hits;
+	int resident;
+	/* where the copy starts in the ring, counted from the start of the
+	 * program */
+	unsigned long long pos;
+};
+
+struct cachemem_shared {
+	/* the end of the newest copy, counted like pos */
+	unsigned long long head;
+	unsigned long datasize;
+	struct cachemem_entry entries[ CACHEMEM_ENTRIES ];
+	char data[1];
+};
+
+static struct cachemem_shared* cachemem;
+
+
+int cachemem_init(void) {
+	unsigned long size = config_get_size("cachememory", 0);
+
+	if (size == 0 || size == ULONG_MAX) {
+		return 0;
+	}
+	cachemem = (struct cachemem_shared*)
+			shmem_alloc(sizeof(struct cachemem_shared) + size);
+	if (!cachemem) {
+		return -1;
+	}
+	cachemem->datasize = size;
+	return 0;
+}
+
+
+/* NAME is "3f/a2/3fa2...c1", the slot is chosen by its MD5 sum. Has to be
+ * called with the lock held */
+
+static
+struct cachemem_entry* cachemem_slot(const char* name) {
+	unsigned long h;
+	char hex[9];
+
+	name += 6;
+	strncpy(hex, name, 8);
+	hex[8] = '\0';
+	h = strtoul(hex, (char**) 0, 16);
+	return &cachemem->entries[ h % CACHEMEM_ENTRIES ];
+}
+
+
+/* has the copy of E been overwritten by newer ones? Has to be called with
+ * the lock held */
+
+static
+int cachemem_valid(const struct cachemem_entry* e) {
+	return e->resident
+		&& cachemem->head <= e->pos + cachemem->datasize;
+}
+
+
+/* cachemem_get() returns a copy of the bytes from OFFSET on of the entry
+ * NAME if the memory holds that version of the file. LEN is set to their
+ * number. The copy has to be free()d */
+
+char* cachemem_get(const char* name, unsigned long size, time_t date,
+		   const char* md5, unsigned long offset, unsigned long* len) {
+	struct cachemem_entry* e;
+	char* copy = (char*) 0;
+
+	*len = 0;
+	if (!cachemem || offset >= size) {
+		return (char*) 0;
+	}
+	shmem_lock(cachemem);
+	e = cachemem_slot(name);
+	if (strcmp(e->name, name + 6) == 0 && cachemem_valid(e)
+	    && e->size == size && e->date == date
+	    && (!md5 || !e->md5[0] || strcasecmp(md5, e->md5) == 0)) {
+		*len = size - offset;
+		copy = (char*) malloc(*len);
+		enough_mem(copy);
+		memcpy(copy, cachemem->data
+			+ (e->pos + offset) % cachemem->datasize, *len);
+	}
+	shmem_unlock(cachemem);
+
+	if (copy) {
+		jlog(8, "%lu bytes of %s are served from memory", *len, name);
+	}
+	return copy;
+}
+
+
+/* cachemem_hit() counts a hit of the complete entry NAME on the disk,
+ * FD is its data file, COMPRESSED if it is compressed. Once it has been hit
+ * often enough, it is copied to memory */
+
+void cachemem_hit(const char* name, int fd, unsigned long size, time_t date,
+		  const char* md5, int compressed) {
+	struct cachemem_entry* e;
+	unsigned long long pos;
+	char* buffer;
+	ssize_t n;
+	int promote = 0;
+
+	if (!cachemem || size == 0
+	    || size > config_get_size("cachememmaxsize", 65536)
+	    || size > cachemem->datasize) {
+		return;
+	}
+	shmem_lock(cachemem);
+	e = cachemem_slot(name);
+	if (strcmp(e->name, name + 6) != 0 || e->size != size
+	    || e->date != date) {
+		/* another entry or another version, start over */
+		memset(e, 0, sizeof(struct cachemem_entry));
+		strncpy(e->name, name + 6, DIGEST_MD5LEN - 1);
+		e->size = size;
+		e->date = date;
+	}
+	if (!cachemem_valid(e)
+	    && ++e->hits >= config_get_ioption("cachememhits", 2)) {
+		promote = 1;
+	}
+	shmem_unlock(cachemem);
+
+	if (!promote) {
+		return;
+	}
+	/* read it before the lock is taken again */
+	buffer = (char*) malloc(size);
+	enough_mem(buffer);
+	if (compressed) {
+		n = cachez_readall(fd, buffer, size) < 0 ? -1 : size;
+	} else {
+		n = pread(fd, buffer, size, 0);
+	}
+	if (n < 0 || (unsigned long) n != size) {
+		jlog(6, "Could not read %s to copy it to memory", name);
+		free(buffer);
+		return;
+	}
+
+	shmem_lock(cachemem);
+	/* a copy does not wrap around the end of the area */
+	pos = cachemem->head;
+	if (pos % cachemem->datasize + size > cachemem->datasize) {
+		pos += cachemem->datasize - pos % cachemem->datasize;
+	}
+	memcpy(cachemem->data + pos % cachemem->datasize, buffer, size);
+	cachemem->head = pos + size;
+	e = cachemem_slot(name);
+	if (strcmp(e->name, name + 6) == 0 && e->size == size
+	    && e->date == date) {
+		e->resident = 1;
+		e->pos = pos;
+		e->md5[0] = '\0';
+		if (md5) {
+			strncpy(e->md5, md5, DIGEST_MD5LEN - 1);
+		}
+	}
+	shmem_unlock(cachemem);
+	free(buffer);
+
+	jlog(8, "Copied %s (%lu bytes) to memory", name, size);
+}
+
+
+/* cachemem_drop() forgets the copy of the entry NAME */
+
+void cachemem_drop(const char* name) {
+	struct cachemem_entry* e;
+
+	if (!cachemem) {
+		return;
+	}
+	shmem_lock(cachemem);
+	e = cachemem_slot(name);
+	if (strcmp(e->name, name + 6) == 0) {
+		memset(e, 0, sizeof(struct cachemem_entry));
+	}
+	shmem_unlock(cachemem);
+}
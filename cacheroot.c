@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* cacheroot.c - the directories of the cache
+ *
+ * The cache may be spread over several directories, one per disk:
+ *
+ *     cacheroot  /nvme0/jftpgw  200G  4
+ *     cacheroot  /nvme1/jftpgw  200G  4
+ *     cacheroot  /array/jftpgw  4000G 1
+ *
+ * The fields are the directory, the capacity ("unlimited" is allowed) and
+ * the weight (1 if omitted). Without "cacheroot" the "cacheprefix" is the
+ * only directory, without a capacity.
+ *
+ * An entry goes to the directory that follows the MD5 sum of its key on a
+ * ring. Every directory has 64 points per weight on the ring, each one the
+ * MD5 sum of the name of the directory and a number. So if a directory is
+ * added or removed only the entries next to its points move, about the
+ * share of its weight, and if a disk is lost only its entries are gone.
+ *
+ * The bytes in every directory are counted in shared memory: a scanner
+ * process adds up the files every CACHEROOT_RESCAN seconds, in between the
+ * cache adds and subtracts what it writes and removes. A new entry is not
+ * added to a directory that has reached its capacity. Until the first scan
+ * is done the directory is assumed to have room. */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include "jftpgw.h"
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+#define CACHEROOT_MAX		16
+#define CACHEROOT_MAXWEIGHT	16
+#define CACHEROOT_POINTS	64
+#define CACHEROOT_PATHLEN	256
+#define CACHEROOT_RESCAN	600
+
+extern int cache_perms;
+int recursive_mkdir(const char* pathname, int perms);
+
+struct cacheroot {
+	char* path;
+	unsigned long capacity;		/* ULONG_MAX if unlimited */
+	int weight;
+	int fd;				/* -1 if not opened yet */
+};
+
+struct cacheroot_point {
+	unsigned long hash;
+	int root;
+};
+
+struct cacheroot_usage {
+	char path[ CACHEROOT_PATHLEN ];
+	unsigned long used;
+	time_t scanned;			/* end of the last scan, 0 if none */
+	pid_t scanner;			/* pid of a running scan, 0 if none */
+};
+
+struct cacheroot_shared {
+	struct cacheroot_usage usage[ CACHEROOT_MAX ];
+};
+
+static struct cacheroot_shared* cacheroot_shm;
+
+/* the directories of this process and the configuration they are from */
+static struct cacheroot cacheroot_roots[ CACHEROOT_MAX ];
+static int cacheroot_n;
+static char* cacheroot_conf;
+static struct cacheroot_point* cacheroot_ring;
+static int cacheroot_npoints;
+/* the generation of the configuration that has been looked at last */
+static unsigned long int cacheroot_generation;
+static int cacheroot_used = -1;
+
+
+int cacheroot_init(void) {
+	cacheroot_shm = (struct cacheroot_shared*)
+			shmem_alloc(sizeof(struct cacheroot_shared));
+	if (!cacheroot_shm) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/* the first 32 bits of the MD5 sum in hex in S */
+
+static
+unsigned long cacheroot_hash(const char* s) {
+	char hex[9];
+
+	strncpy(hex, s, 8);
+	hex[8] = '\0';
+	return strtoul(hex, (char**) 0, 16);
+}
+
+
+static
+int cacheroot_point_cmp(const void* a, const void* b) {
+	const struct cacheroot_point* pa = (const struct cacheroot_point*) a;
+	const struct cacheroot_point* pb = (const struct cacheroot_point*) b;
+
+	if (pa->hash != pb->hash) {
+		return pa->hash < pb->hash ? -1 : 1;
+	}
+	return pa->root - pb->root;
+}
+
+
+/* parse "path [capacity [weight]]" into R, returns -1 on error */
+
+static
+int cacheroot_parse(const char* spec, struct cacheroot* r) {
+	struct slist_t* line = config_split_line(spec, WHITESPACES);
+	int ret = 0;
+
+	if (!line) {
+		return -1;
+	}
+	r->path = strdup(line->value);
+	enough_mem(r->path);
+	r->capacity = ULONG_MAX;
+	r->weight = 1;
+	r->fd = -1;
+	if (line->next) {
+		r->capacity = config_parse_size(line->next->value, 0);
+		if (r->capacity == 0) {
+			ret = -1;
+		}
+		if (line->next->next) {
+			r->weight = atoi(line->next->next->value);
+			if (r->weight < 1 || r->weight > CACHEROOT_MAXWEIGHT) {
+				ret = -1;
+			}
+		}
+	}
+	if (strlen(r->path) >= CACHEROOT_PATHLEN) {
+		ret = -1;
+	}
+	slist_destroy(line);
+	if (ret < 0) {
+		free(r->path);
+	}
+	return ret;
+}
+
+
+static
+void cacheroot_clear(void) {
+	int i;
+
+	for (i = 0; i < cacheroot_n; i++) {
+		if (cacheroot_roots[i].fd >= 0) {
+			close(cacheroot_roots[i].fd);
+		}
+		free(cacheroot_roots[i].path);
+	}
+	cacheroot_n = 0;
+	free(cacheroot_ring);
+	cacheroot_ring = (struct cacheroot_point*) 0;
+	cacheroot_npoints = 0;
+	free(cacheroot_conf);
+	cacheroot_conf = (char*) 0;
+}
+
+
+/* build the ring from the configuration unless it is the one that has been
+ * built last time. Returns the number of directories, 0 if the cache is not
+ * used */
+
+static
+int cacheroot_build(void) {
+	struct slist_t* list, *l;
+	const char* prefix = config_get_option("cacheprefix");
+	struct digest d;
+	char md5[ DIGEST_MD5LEN ];
+	char* conf, *point;
+	size_t size;
+	int i, j;
+
+	if (config_get_bool("cache") == 0) {
+		return 0;
+	}
+	list = config_get_option_array("cacheroot");
+	if (!list && !prefix) {
+		return 0;
+	}
+	/* the configuration in one string */
+	size = 1;
+	for (l = list; l; l = l->next) {
+		size += strlen(l->value) + 1;
+	}
+	if (!list) {
+		size += strlen(prefix);
+	}
+	conf = (char*) arena_alloc(size);
+	conf[0] = '\0';
+	for (l = list; l; l = l->next) {
+		strcat(conf, l->value);
+		strcat(conf, "\n");
+	}
+	if (!list) {
+		strcat(conf, prefix);
+	}
+	if (cacheroot_conf && strcmp(cacheroot_conf, conf) == 0) {
+		slist_destroy(list);
+		return cacheroot_n;
+	}
+
+	cacheroot_clear();
+	cacheroot_conf = strdup(conf);
+	enough_mem(cacheroot_conf);
+	if (!list) {
+		cacheroot_roots[0].path = strdup(prefix);
+		enough_mem(cacheroot_roots[0].path);
+		cacheroot_roots[0].capacity = ULONG_MAX;
+		cacheroot_roots[0].weight = 1;
+		cacheroot_roots[0].fd = -1;
+		cacheroot_n = 1;
+	}
+	for (l = list; l; l = l->next) {
+		if (cacheroot_n == CACHEROOT_MAX) {
+			jlog(5, "Too many cache directories, ignoring %s",
+					l->value);
+			continue;
+		}
+		if (cacheroot_parse(l->value,
+				&cacheroot_roots[ cacheroot_n ]) < 0) {
+			jlog(5, "Incorrect cacheroot specification: %s",
+					l->value);
+			continue;
+		}
+		cacheroot_n++;
+	}
+	slist_destroy(list);
+
+	for (i = 0; i < cacheroot_n; i++) {
+		cacheroot_npoints += cacheroot_roots[i].weight
+						* CACHEROOT_POINTS;
+	}
+	cacheroot_ring = (struct cacheroot_point*)
+		malloc(cacheroot_npoints * sizeof(struct cacheroot_point) + 1);
+	enough_mem(cacheroot_ring);
+	point = (char*) arena_alloc(CACHEROOT_PATHLEN + 16);
+	cacheroot_npoints = 0;
+	for (i = 0; i < cacheroot_n; i++) {
+		for (j = 0; j < cacheroot_roots[i].weight * CACHEROOT_POINTS;
+				j++) {
+			snprintf(point, CACHEROOT_PATHLEN + 16, "%s#%d",
+					cacheroot_roots[i].path, j);
+			digest_init(&d);
+			digest_update(&d, point, strlen(point));
+			digest_final(&d, md5);
+			cacheroot_ring[ cacheroot_npoints ].hash
+						= cacheroot_hash(md5);
+			cacheroot_ring[ cacheroot_npoints ].root = i;
+			cacheroot_npoints++;
+		}
+	}
+	qsort(cacheroot_ring, cacheroot_npoints,
+			sizeof(struct cacheroot_point), cacheroot_point_cmp);
+	jlog(8, "The cache uses %d directories", cacheroot_n);
+	return cacheroot_n;
+}
+
+
+/* cacheroot_setup() only looks at the configuration again if it has
+ * changed since the last call, after a reload or a section has matched */
+
+static
+int cacheroot_setup(void) {
+	if (cacheroot_used < 0
+	    || cacheroot_generation != config_get_generation()) {
+		cacheroot_used = cacheroot_build();
+		cacheroot_generation = config_get_generation();
+	}
+	return cacheroot_used;
+}
+
+
+/* the directory of the entry NAME, the name relative to the directory
+ * "3f/a2/3fa2...c1". NULL if the cache is not used */
+
+static
+struct cacheroot* cacheroot_of(const char* name) {
+	unsigned long h;
+	int lo, hi, mid;
+
+	if (cacheroot_setup() == 0) {
+		return (struct cacheroot*) 0;
+	}
+	if (cacheroot_n == 1) {
+		return &cacheroot_roots[0];
+	}
+	h = cacheroot_hash(name + 6);
+	/* the first point at or after h, the ring wraps around */
+	lo = 0;
+	hi = cacheroot_npoints;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cacheroot_ring[ mid ].hash < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == cacheroot_npoints) {
+		lo = 0;
+	}
+	return &cacheroot_roots[ cacheroot_ring[ lo ].root ];
+}
+
+
+/* cacheroot_fd() returns a descriptor of the directory of the entry NAME,
+ * -1 if the cache is not used or the directory is not there. The
+ * descriptors are kept open */
+
+int cacheroot_fd(const char* name) {
+	struct cacheroot* r = cacheroot_of(name);
+
+	if (!r) {
+		return -1;
+	}
+	if (r->fd >= 0) {
+		return r->fd;
+	}
+	if ((r->fd = open(r->path, O_RDONLY | O_DIRECTORY)) < 0
+	    && errno == ENOENT && recursive_mkdir(r->path, cache_perms) == 0) {
+		r->fd = open(r->path, O_RDONLY | O_DIRECTORY);
+	}
+	if (r->fd < 0) {
+		jlog(2, "Could not open the cache directory %s: %s",
+				r->path, strerror(errno));
+		return -1;
+	}
+	return r->fd;
+}
+
+
+/* the shared counter of R, one is taken over if there is none yet. Has to
+ * be called with the lock held */
+
+static
+struct cacheroot_usage* cacheroot_usage_get(const struct cacheroot* r) {
+	struct cacheroot_usage* u;
+	int i, unused = -1;
+
+	for (i = 0; i < CACHEROOT_MAX; i++) {
+		u = &cacheroot_shm->usage[i];
+		if (strcmp(u->path, r->path) == 0) {
+			return u;
+		}
+		if (u->scanner == 0 && (unused < 0 || u->scanned
+				< cacheroot_shm->usage[ unused ].scanned)) {
+			/* the empty one or the one that has not been
+			 * looked at for the longest time */
+			unused = i;
+		}
+	}
+	if (unused < 0) {
+		return (struct cacheroot_usage*) 0;
+	}
+	u = &cacheroot_shm->usage[ unused ];
+	memset(u, 0, sizeof(struct cacheroot_usage));
+	strncpy(u->path, r->path, CACHEROOT_PATHLEN - 1);
+	return u;
+}
+
+
+/* the bytes on the disk of the entries in the directory PATH */
+
+static
+unsigned long cacheroot_sum(const char* path) {
+	DIR* top, *sub, *leaf;
+	struct dirent* d1, *d2, *d3;
+	struct stat st;
+	const char* dot;
+	unsigned long sum = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0
+	    || !(top = fdopendir(fd))) {
+		return 0;
+	}
+	while ((d1 = readdir(top))) {
+		if (strlen(d1->d_name) != 2 || d1->d_name[0] == '.'
+		    || (fd = openat(dirfd(top), d1->d_name,
+				    O_RDONLY | O_DIRECTORY)) < 0) {
+			continue;
+		}
+		if (!(sub = fdopendir(fd))) {
+			close(fd);
+			continue;
+		}
+		while ((d2 = readdir(sub))) {
+			if (strlen(d2->d_name) != 2 || d2->d_name[0] == '.'
+			    || (fd = openat(dirfd(sub), d2->d_name,
+					    O_RDONLY | O_DIRECTORY)) < 0) {
+				continue;
+			}
+			if (!(leaf = fdopendir(fd))) {
+				close(fd);
+				continue;
+			}
+			while ((d3 = readdir(leaf))) {
+				/* the data files and the shared objects, the
+				 * info files are small and the references
+				 * are links to the objects */
+				if ((dot = strchr(d3->d_name, '.'))
+				    && strcmp(dot, ".z") && strcmp(dot, ".obj")
+				    && strcmp(dot, ".zobj")) {
+					continue;
+				}
+				if (fstatat(dirfd(leaf), d3->d_name, &st,
+					       AT_SYMLINK_NOFOLLOW) < 0
+				    || !S_ISREG(st.st_mode)) {
+					continue;
+				}
+				sum += (unsigned long) st.st_blocks * 512;
+			}
+			closedir(leaf);
+		}
+		closedir(sub);
+	}
+	closedir(top);
+	return sum;
+}
+
+
+/* fork a process that adds up the files of R and stores the sum in U */
+
+static
+void cacheroot_scan(const struct cacheroot* r, struct cacheroot_usage* u) {
+	unsigned long sum;
+	pid_t pid;
+	int fd, maxfd;
+
+	if ((pid = fork()) < 0) {
+		jlog(3, "Could not fork to scan the cache directory %s: %s",
+				r->path, strerror(errno));
+		shmem_lock(cacheroot_shm);
+		u->scanner = 0;
+		shmem_unlock(cacheroot_shm);
+		return;
+	}
+	if (pid > 0) {
+		jlog(8, "Scanning the cache directory %s in process %d",
+				r->path, (int) pid);
+		shmem_lock(cacheroot_shm);
+		if (u->scanner == -1) {
+			u->scanner = pid;
+		}
+		shmem_unlock(cacheroot_shm);
+		return;
+	}
+
+	/* the connections of the session must close when it closes them,
+	 * the lock of the shared memory is still needed */
+	maxfd = (int) sysconf(_SC_OPEN_MAX);
+	for (fd = 3; fd < maxfd; fd++) {
+		if (!shmem_is_lockfd(fd)) {
+			close(fd);
+		}
+	}
+	sum = cacheroot_sum(r->path);
+
+	shmem_lock(cacheroot_shm);
+	if (strcmp(u->path, r->path) == 0) {
+		u->used = sum;
+		u->scanned = time(NULL);
+		u->scanner = 0;
+	}
+	shmem_unlock(cacheroot_shm);
+	_exit(0);
+}
+
+
+/* cacheroot_room() returns 1 if SIZE more bytes fit into the directory of
+ * the entry NAME */
+
+int cacheroot_room(const char* name, unsigned long size) {
+	struct cacheroot* r = cacheroot_of(name);
+	struct cacheroot_usage* u;
+	unsigned long used = 0;
+	time_t now = time(NULL);
+	int known = 0, scan = 0;
+
+	if (!r) {
+		return 0;
+	}
+	if (r->capacity == ULONG_MAX || !cacheroot_shm) {
+		return 1;
+	}
+	shmem_lock(cacheroot_shm);
+	if ((u = cacheroot_usage_get(r))) {
+		if (u->scanner > 0 && kill(u->scanner, 0) < 0
+		    && errno == ESRCH) {
+			/* it has died before it was done */
+			u->scanner = 0;
+		}
+		if (u->scanner == 0 && (u->scanned == 0
+			     || now - u->scanned >= CACHEROOT_RESCAN)) {
+			u->scanner = -1;
+			scan = 1;
+		}
+		known = u->scanned != 0;
+		used = u->used;
+	}
+	shmem_unlock(cacheroot_shm);
+
+	if (scan) {
+		cacheroot_scan(r, u);
+	}
+	if (!known) {
+		return 1;
+	}
+	if (size > r->capacity || used > r->capacity - size) {
+		jlog(7, "The cache directory %s is full (%lu of %lu bytes)",
+				r->path, used, r->capacity);
+		return 0;
+	}
+	return 1;
+}
+
+
+/* cacheroot_account() adds DELTA bytes to the count of the directory of
+ * the entry NAME */
+
+void cacheroot_account(const char* name, long delta) {
+	struct cacheroot* r = cacheroot_of(name);
+	struct cacheroot_usage* u;
+
+	if (!r || r->capacity == ULONG_MAX || !cacheroot_shm || delta == 0) {
+		return;
+	}
+	shmem_lock(cacheroot_shm);
+	if ((u = cacheroot_usage_get(r))) {
+		if (delta < 0 && (unsigned long) -delta > u->used) {
+			u->used = 0;
+		} else {
+			u->used += delta;
+		}
+	}
+	shmem_unlock(cacheroot_shm);
+}
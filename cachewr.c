@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* cachewr.c - writing to the cache behind the transfer
+ *
+ * Usually the data of a download is written to the cache before it is sent
+ * on to the client, so a slow disk slows down the client as well. With
+ * "cachewritebehind" a writer process is forked for every download that
+ * goes to the cache and the data is handed to it through a socket pair. The
+ * send buffer of the pair, "cachewritebehind" bytes, is the queue. If it is
+ * full, "cachewritepolicy" decides: "drop" stops caching the rest of the
+ * file, "wait" waits for the writer and slows the client down to the speed
+ * of the disk.
+ *
+ * The writer syncs the data to the disk before it records the part of the
+ * file that it has written, other sessions never see data that is not
+ * there. */
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include "jftpgw.h"
+
+#define CACHEWR_BUFSIZE		(64*1024)
+
+
+/* the writer process, it never returns */
+
+static
+void cachewr_run(int fd, int cachefd, struct cache_filestruct cfs,
+		 unsigned long start) {
+	struct digest digest;
+	char* buffer = (char*) malloc(CACHEWR_BUFSIZE);
+	unsigned long stored = 0;
+	ssize_t n, written;
+	int off;
+
+	enough_mem(buffer);
+	digest_init(&digest);
+
+	while ((n = read(fd, buffer, CACHEWR_BUFSIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			jlog(3, "Error reading from the session: %s",
+					strerror(errno));
+			break;
+		}
+		for (off = 0; off < n; off += written) {
+			written = pwrite(cachefd, buffer + off, n - off,
+					 (off_t) (start + stored + off));
+			if (written < 0) {
+				break;
+			}
+		}
+		if (off < n) {
+			jlog(3, "Error writing to the cache: %s",
+					strerror(errno));
+			break;
+		}
+		digest_update(&digest, buffer, n);
+		stored += n;
+	}
+	/* the session sees the socket closed if it sends more */
+	close(fd);
+	free(buffer);
+
+	if (stored && fsync(cachefd) < 0) {
+		jlog(3, "Could not sync the cache file: %s", strerror(errno));
+		stored = 0;
+	}
+	close(cachefd);
+	jlog(8, "Wrote %lu bytes of %s to the cache", stored, cfs.filename);
+	cache_record(cfs, start, start + stored,
+			start == 0 ? &digest : (struct digest*) 0);
+	_exit(0);
+}
+
+
+/* cachewr_start() forks the writer for the data that the transfer writes
+ * to the cache from START on. Returns -1 if the data has to be written by
+ * the session itself */
+
+int cachewr_start(struct clientinfo* clntinfo, struct cache_filestruct cfs,
+		  unsigned long start) {
+	unsigned long queue = config_get_size("cachewritebehind", 0);
+	int sv[2], size;
+	pid_t pid;
+
+	clntinfo->cachewrfd = -1;
+	if (queue == 0) {
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		jlog(3, "Could not create the queue to the cache writer: %s",
+				strerror(errno));
+		return -1;
+	}
+	size = queue > INT_MAX ? INT_MAX : (int) queue;
+	if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+		jlog(6, "Could not set the size of the cache queue: %s",
+				strerror(errno));
+	}
+
+	if ((pid = fork()) < 0) {
+		jlog(3, "Could not fork the cache writer: %s",
+				strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		/* the connections must close when the session closes them */
+		close(sv[0]);
+		close(clntinfo->clientsocket);
+		close(clntinfo->serversocket);
+		if (clntinfo->dataclientsock >= 0) {
+			close(clntinfo->dataclientsock);
+		}
+		if (clntinfo->dataserversock >= 0) {
+			close(clntinfo->dataserversock);
+		}
+		if (clntinfo->refreshfd >= 0) {
+			close(clntinfo->refreshfd);
+		}
+		cachewr_run(sv[1], clntinfo->cachefd, cfs, start);
+	}
+	close(sv[1]);
+	if (fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) < 0) {
+		jlog(3, "Could not make the cache queue non-blocking: %s",
+				strerror(errno));
+	}
+	clntinfo->cachewrfd = sv[0];
+	jlog(8, "Forked cache writer %d", (int) pid);
+	return 0;
+}
+
+
+/* cachewr_write() writes COUNT bytes to the cache, either directly or
+ * through the writer. Returns -1 if nothing more of this file goes to the
+ * cache */
+
+int cachewr_write(struct clientinfo* clntinfo, const char* buf, int count) {
+	int flags = 0, sent = 0, n;
+	int wait = config_compare_option("cachewritepolicy", "wait");
+	fd_set writeset;
+	struct timeval tv;
+
+	if (clntinfo->cachewrfd < 0) {
+		if (write(clntinfo->cachefd, buf, count) != count) {
+			jlog(3, "Error writing to the cache: %s",
+					strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	while (sent < count) {
+		n = send(clntinfo->cachewrfd, buf + sent, count - sent, flags);
+		if (n >= 0) {
+			sent += n;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			jlog(3, "The cache writer has gone away: %s",
+					strerror(errno));
+			return -1;
+		}
+		if (!wait) {
+			/* the writer keeps what it has got so far */
+			jlog(6, "The cache queue is full, not caching the "
+				"rest of the file");
+			return -1;
+		}
+		FD_ZERO(&writeset);
+		FD_SET(clntinfo->cachewrfd, &writeset);
+		tv.tv_sec = config_get_ioption("transfertimeout", 300);
+		tv.tv_usec = 0;
+		if (select(clntinfo->cachewrfd + 1, NULL, &writeset, NULL,
+							&tv) == 0) {
+			jlog(3, "Timeout writing to the cache");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* cachewr_finish() is called after the transfer. The writer records what
+ * it has written when it sees the end of the queue, otherwise the range
+ * [START, START + cachestored) is recorded here */
+
+void cachewr_finish(struct clientinfo* clntinfo, struct cache_filestruct cfs,
+		    unsigned long start) {
+	if (clntinfo->cachewrfd >= 0) {
+		close(clntinfo->cachewrfd);
+		clntinfo->cachewrfd = -1;
+		return;
+	}
+	cache_record(cfs, start, start + clntinfo->cachestored,
+			clntinfo->cachedigest);
+}
+
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* cachez.c - compressed files in the cache
+ *
+ * With "cachecompress zlib" a file that is complete in the cache is
+ * compressed if the first frame of it shrinks to at most 7/8 of its size,
+ * so text like listings, exports and logs takes less space while images
+ * and archives are left alone. The file is cut into frames of
+ * CACHEZ_FRAME bytes that are compressed independently, an offset of a
+ * REST command only costs the decompression of one frame:
+ *
+ *	frame 0 ... frame n-1		zlib streams
+ *	length 0 ... length n-1		compressed length of every frame
+ *	n				number of frames
+ *	"JZF1"				magic
+ *
+ * all numbers are 4 bytes in network byte order. The compressed file is
+ * next to the data file as "<name>.z", the info file says "compressed zlib".
+ * The data is decompressed in transfer_transmit() while it is sent. */
+
+#include <sys/stat.h>
+#include "jftpgw.h"
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#define CACHEZ_FRAME		(64*1024)
+#define CACHEZ_MAGIC		"JZF1"
+
+struct cachez {
+	int fd;
+	unsigned long nframes;
+	/* where every frame starts, nframes + 1 entries */
+	unsigned long* offsets;
+	/* the next frame to decompress */
+	unsigned long frame;
+	char* raw;
+	unsigned long rawlen, rawpos;
+	char* zbuf;
+};
+
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+
+static
+void cachez_put32(unsigned char* p, unsigned long v) {
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static
+unsigned long cachez_get32(const unsigned char* p) {
+	return (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16
+		| (unsigned long) p[2] << 8 | (unsigned long) p[3];
+}
+
+
+/* read COUNT bytes at OFFSET, a short read is an error */
+
+static
+int cachez_pread(int fd, char* buf, unsigned long count, unsigned long offset) {
+	ssize_t n;
+
+	while (count > 0) {
+		n = pread(fd, buf, count, (off_t) offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		buf += n;
+		count -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+/* cachez_compress() compresses the SIZE bytes of the data file IN into the
+ * file OUT. Returns 0 if it has done so, 1 if the file does not compress
+ * well and -1 on error */
+
+int cachez_compress(int in, int out, unsigned long size) {
+	unsigned long nframes = (size + CACHEZ_FRAME - 1) / CACHEZ_FRAME;
+	unsigned char* index;
+	char* raw, *zbuf;
+	unsigned long i, rawlen;
+	uLongf zlen;
+	int ret = 0;
+
+	if (size == 0) {
+		return 1;
+	}
+	raw = (char*) malloc(CACHEZ_FRAME);
+	zbuf = (char*) malloc(compressBound(CACHEZ_FRAME));
+	index = (unsigned char*) malloc(nframes * 4 + 8);
+	enough_mem(raw);
+	enough_mem(zbuf);
+	enough_mem(index);
+
+	for (i = 0; i < nframes && ret == 0; i++) {
+		rawlen = MIN_VAL(CACHEZ_FRAME, size - i * CACHEZ_FRAME);
+		if (cachez_pread(in, raw, rawlen, i * CACHEZ_FRAME) < 0) {
+			ret = -1;
+			break;
+		}
+		zlen = compressBound(CACHEZ_FRAME);
+		if (compress2((Bytef*) zbuf, &zlen, (Bytef*) raw, rawlen,
+					Z_DEFAULT_COMPRESSION) != Z_OK) {
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+		if (i == 0 && zlen > rawlen / 8 * 7) {
+			/* the sample says that it is not worth it */
+			ret = 1;
+			break;
+		}
+		if (write(out, zbuf, zlen) != (ssize_t) zlen) {
+			ret = -1;
+			break;
+		}
+		cachez_put32(index + i * 4, zlen);
+	}
+	if (ret == 0) {
+		cachez_put32(index + nframes * 4, nframes);
+		memcpy(index + nframes * 4 + 4, CACHEZ_MAGIC, 4);
+		if (write(out, index, nframes * 4 + 8)
+				!= (ssize_t) (nframes * 4 + 8)
+		    || fsync(out) < 0) {
+			ret = -1;
+		}
+	}
+	free(raw);
+	free(zbuf);
+	free(index);
+	return ret;
+}
+
+
+/* decompress frame FRAME into the buffer of Z */
+
+static
+int cachez_load(struct cachez* z, unsigned long frame) {
+	unsigned long zlen = z->offsets[ frame + 1 ] - z->offsets[ frame ];
+	uLongf rawlen = CACHEZ_FRAME;
+
+	if (zlen > compressBound(CACHEZ_FRAME)
+	    || cachez_pread(z->fd, z->zbuf, zlen, z->offsets[ frame ]) < 0) {
+		return -1;
+	}
+	if (uncompress((Bytef*) z->raw, &rawlen, (Bytef*) z->zbuf, zlen)
+			!= Z_OK) {
+		errno = EIO;
+		return -1;
+	}
+	z->frame = frame + 1;
+	z->rawlen = rawlen;
+	z->rawpos = 0;
+	return 0;
+}
+
+
+/* cachez_open() reads the index of the compressed file FD and positions
+ * it at OFFSET of the original file. FD is not closed by cachez_close().
+ * Returns NULL on error */
+
+struct cachez* cachez_open(int fd, unsigned long offset) {
+	struct cachez* z;
+	unsigned char trailer[8], *index;
+	struct stat st;
+	unsigned long i, nframes, indexpos;
+
+	if (fstat(fd, &st) < 0 || st.st_size < 8
+	    || cachez_pread(fd, (char*) trailer, 8, st.st_size - 8) < 0) {
+		return (struct cachez*) 0;
+	}
+	nframes = cachez_get32(trailer);
+	if (memcmp(trailer + 4, CACHEZ_MAGIC, 4) != 0
+	    || nframes * 4 + 8 > (unsigned long) st.st_size) {
+		errno = EINVAL;
+		return (struct cachez*) 0;
+	}
+	indexpos = st.st_size - 8 - nframes * 4;
+	index = (unsigned char*) malloc(nframes * 4 + 1);
+	enough_mem(index);
+	if (cachez_pread(fd, (char*) index, nframes * 4, indexpos) < 0) {
+		free(index);
+		return (struct cachez*) 0;
+	}
+
+	z = (struct cachez*) malloc(sizeof(struct cachez));
+	enough_mem(z);
+	z->fd = fd;
+	z->nframes = nframes;
+	z->offsets = (unsigned long*) malloc((nframes + 1)
+						* sizeof(unsigned long));
+	enough_mem(z->offsets);
+	z->offsets[0] = 0;
+	for (i = 0; i < nframes; i++) {
+		z->offsets[i + 1] = z->offsets[i] + cachez_get32(index + i * 4);
+	}
+	free(index);
+	z->raw = (char*) malloc(CACHEZ_FRAME);
+	z->zbuf = (char*) malloc(compressBound(CACHEZ_FRAME));
+	enough_mem(z->raw);
+	enough_mem(z->zbuf);
+	z->frame = nframes;
+	z->rawlen = z->rawpos = 0;
+
+	if (z->offsets[ nframes ] != indexpos) {
+		errno = EINVAL;
+		cachez_close(z);
+		return (struct cachez*) 0;
+	}
+	if (offset / CACHEZ_FRAME < nframes) {
+		if (cachez_load(z, offset / CACHEZ_FRAME) < 0) {
+			cachez_close(z);
+			return (struct cachez*) 0;
+		}
+		z->rawpos = MIN_VAL(offset % CACHEZ_FRAME, z->rawlen);
+	}
+	return z;
+}
+
+
+/* cachez_read() reads up to COUNT bytes of the original file, it returns
+ * 0 at the end and -1 on error */
+
+int cachez_read(struct cachez* z, char* buf, int count) {
+	int n;
+
+	if (z->rawpos == z->rawlen) {
+		if (z->frame >= z->nframes) {
+			return 0;
+		}
+		if (cachez_load(z, z->frame) < 0) {
+			return -1;
+		}
+	}
+	n = MIN_VAL((unsigned long) count, z->rawlen - z->rawpos);
+	memcpy(buf, z->raw + z->rawpos, n);
+	z->rawpos += n;
+	return n;
+}
+
+
+void cachez_close(struct cachez* z) {
+	if (!z) {
+		return;
+	}
+	free(z->offsets);
+	free(z->raw);
+	free(z->zbuf);
+	free(z);
+}
+
+#else /* no zlib */
+
+int cachez_compress(int in, int out, unsigned long size) {
+	return 1;
+}
+
+struct cachez* cachez_open(int fd, unsigned long offset) {
+	errno = ENOSYS;
+	return (struct cachez*) 0;
+}
+
+int cachez_read(struct cachez* z, char* buf, int count) {
+	errno = ENOSYS;
+	return -1;
+}
+
+void cachez_close(struct cachez* z) {
+}
+
+#endif
+
+
+/* cachez_readall() decompresses all of the SIZE bytes of the file FD into
+ * BUF */
+
+int cachez_readall(int fd, char* buf, unsigned long size) {
+	struct cachez* z;
+	unsigned long got = 0;
+	int n;
+
+	if (!(z = cachez_open(fd, 0))) {
+		return -1;
+	}
+	while (got < size
+	       && (n = cachez_read(z, buf + got, MIN_VAL(size - got,
+						CACHEZ_FRAME))) > 0) {
+		got += n;
+	}
+	cachez_close(z);
+	return got == size ? 0 : -1;
+}
@@ -35,18 +35,55 @@ struct log_cmd_st lcs = { NULL, NULL, NULL, 0, 0 };
 struct cmdhandlerstruct *cmdhandler;
 struct conn_info_st conn_info = { 0, 0 };
 
+/* the position of the handler of a verb in std_cmdhandler, -1 if there is
+ * none */
+static int std_cmdindex[ VERB_MAX ];
+static int std_cmdindex_built;
+
 int checkforabort(struct clientinfo*);
 
+
+static
+void cmd_index_build(const struct cmdhandlerstruct* handlers, int* index) {
+	size_t len;
+	int i, verb;
+
+	for (verb = 0; verb < VERB_MAX; verb++) {
+		index[verb] = -1;
+	}
+	for (i = 0; handlers[i].cmd; i++) {
+		verb = verb_parse(handlers[i].cmd, &len);
+		if (verb == VERB_UNKNOWN) {
+			jlog(3, "Handler for unknown verb %s", handlers[i].cmd);
+			continue;
+		}
+		/* the first one wins like before */
+		if (index[verb] < 0) {
+			index[verb] = i;
+		}
+	}
+}
+
 int handle_cmds(struct clientinfo *clntinfo) {
 	char *buffer = 0;
 	int ss, cs;
-	int i;
+	int i, verb = VERB_UNKNOWN;
+	size_t verblen;
+	struct trace_span span;
 
 	conn_info.lcs = &lcs;
 	conn_info.clntinfo = clntinfo;
 	clntinfo->cachefd = -1;
+	clntinfo->cachewrfd = -1;
+	clntinfo->refreshfd = -1;
+	clntinfo->cachebuf = (char*) 0;
+	clntinfo->cachebuflen = 0;
+	clntinfo->cachez = (struct cachez*) 0;
+	clntinfo->cachedigest = (struct digest*) 0;
+	clntinfo->restoffset = 0;
 	jlog(9, "setting dataclientsock to -1 (initial)");
 	clntinfo->dataclientsock = clntinfo->dataserversock = -1;
+	clntinfo->dataclientpending = clntinfo->dataserverpending = 0;
 	clntinfo->dataport = socketinfo_get_local_port(clntinfo->clientsocket) - 1;
 	jlog(9, "dataport is set to %d", clntinfo->dataport);
 	clntinfo->portcmd = (char*) 0;
@@ -73,6 +110,11 @@ int handle_cmds(struct clientinfo *clntinfo) {
 
 	lcs.filename = (char*) 0;
 
+	if (!std_cmdindex_built) {
+		cmd_index_build(std_cmdhandler, std_cmdindex);
+		std_cmdindex_built = 1;
+	}
+
 	while (1) {
 contin:
 		lcs.service = "ftp";
@@ -85,17 +127,22 @@ contin:
 			return -1;
 		}
 		if (buffer) {
+			/* REST only applies to the command that follows */
+			if (verb != VERB_REST) {
+				clntinfo->restoffset = 0;
+			}
+			trace_end(&span, verb, lcs.respcode);
 			/* log the command */
 			log_cmd(&lcs);
-			free(buffer);
-			free(lcs.method);
 			buffer = 0;
 			lcs.respcode = 0;
 			lcs.transferred = 0;
 		}
+		/* the buffers of the last command are not needed anymore */
+		arena_reset();
 
 		errno = 0;
-		buffer = readline(cs);
+		buffer = readline_arena(cs);
 
 		if (!buffer && timeout) {
 			jlog(2, "Timeout in %s line %d\n", __FILE__ ,__LINE__);
@@ -114,18 +161,20 @@ contin:
 
 		if (buffer[0] == '\0') {
 			/* empty line. Prevent logging of the command */
-			free(buffer);
 			buffer = 0;
 			goto contin;
 		}
 
 		lcs.cmd = buffer;
+		trace_begin(&span, TRACE_COMMAND);
 
-		i = 0;
-		lcs.method = quotstrtok(lcs.cmd, WHITESPACES, &i);
+		verb = verb_parse(buffer, &verblen);
+		log_cmd_set_method(&lcs, buffer, verblen);
+		JFTPGW_PROBE3(command, verb, lcs.method,
+				clntinfo->clientsocket);
 
 		/* check for passcmds and dontpasscmds options */
-		if (passcmd_check(lcs.method) == 0) {
+		if (passcmd_check(buffer, verb, verblen) == 0) {
 			say(clntinfo->clientsocket,
 				"500 Command not implemented\r\n");
 			jlog(8, "rejected command %s", lcs.method);
@@ -140,55 +189,48 @@ contin:
 
 		/* Retrieve a file */
 		clntinfo->mode = RETR;
-		i = 0;
-
-		while (cmdhandler[i].cmd) {
-			if (checkbegin(buffer, cmdhandler[i].cmd)) {
-				int ret = (cmdhandler[i].func)
-						(buffer, &conn_info);
-				if (checkbegin(buffer, "PASS")) {
-					memset(buffer, 0, strlen(buffer));
-				}
-				switch (ret) {
-					case CMD_PASS:
-						if (passcmd(buffer, clntinfo)
-								< 0) {
-							free(lcs.method);
-							free(buffer);
-							return -1;
-						}
-						break;
-					case CMD_HANDLED:
-						break;
-					case CMD_QUIT:
-						transfer_cleanup(
-							conn_info.clntinfo);
-						free(lcs.method);
-						free(buffer);
-						return 0;
-					case CMD_ABORT:
-						transfer_cleanup(
-							conn_info.clntinfo);
-						free(lcs.method);
-						free(buffer);
+
+		/* the handler is found by the verb, it still has to match
+		 * completely, "USER " for example requires an argument */
+		i = verb != VERB_UNKNOWN ? std_cmdindex[verb] : -1;
+
+		if (i >= 0 && checkbegin(buffer, cmdhandler[i].cmd)) {
+			int ret = (cmdhandler[i].func)
+					(buffer, &conn_info);
+			if (verb == VERB_PASS) {
+				memset(buffer, 0, strlen(buffer));
+			}
+			switch (ret) {
+				case CMD_PASS:
+					if (passcmd(buffer, clntinfo) < 0) {
+						trace_end(&span, verb,
+							  lcs.respcode);
 						return -1;
-					case CMD_ERROR:
-						transfer_cleanup(
-							conn_info.clntinfo);
-						break;
-				}
-				/* found and called proper function */
-				goto contin;
+					}
+					break;
+				case CMD_HANDLED:
+					break;
+				case CMD_QUIT:
+					transfer_cleanup(conn_info.clntinfo);
+					trace_end(&span, verb, lcs.respcode);
+					return 0;
+				case CMD_ABORT:
+					transfer_cleanup(conn_info.clntinfo);
+					trace_end(&span, verb, lcs.respcode);
+					return -1;
+				case CMD_ERROR:
+					transfer_cleanup(conn_info.clntinfo);
+					break;
 			}
-			i++;
+			/* found and called proper function */
+			goto contin;
 		}
 		/* we didn't find a handler function for the command */
 		/* pass it, if we are using the standard command set */
 
 		if (cmdhandler == &std_cmdhandler[0]) {
 			if (passcmd(buffer, clntinfo) < 0) {
-				free(lcs.method);
-				free(buffer);
+				trace_end(&span, verb, lcs.respcode);
 				return -1;
 			}
 		} else {
@@ -241,25 +283,42 @@ char* getftpwd(struct clientinfo *clntinfo) {
 	return dir;
 }
 
+/* getftpmeta() sends "VERB FILENAME" to the server and returns the answer.
+ * The answer may come from the metadata cache */
+
+static
+char* getftpmeta(int verb, const char* filename,
+		 struct clientinfo *clntinfo) {
+	char* answer, *reply;
+
+	if ((reply = mdcache_lookup(clntinfo, verb, filename))) {
+		answer = strdup(reply);
+		enough_mem(answer);
+		answer[ strcspn(answer, "\r\n") ] = '\0';
+		return answer;
+	}
+	sayf(clntinfo->serversocket, "%s %s\r\n", verb_name(verb), filename);
+	answer = ftp_readline(clntinfo->serversocket);
+	if (answer) {
+		reply = (char*) arena_alloc(strlen(answer) + 3);
+		sprintf(reply, "%s\r\n", answer);
+		mdcache_store(clntinfo, verb, filename, reply);
+	}
+	return answer;
+}
+
 time_t getftpmdtm(const char* filename, struct clientinfo *clntinfo) {
 /*
  *	ftp> quote mdtm bla
  *	213 20010224102705
  */
-	size_t cmdsize = strlen("MDTM ") + strlen(filename) + 2 + 1;
 	struct tm tms;
 	int i;
 	char* answer;
-	char* cmd = (char*) malloc(cmdsize);
-
-	enough_mem(cmd);
-	snprintf(cmd, cmdsize, "MDTM %s\r\n", filename);
 
 	memset(&tms, 0, sizeof(tms));
 
-	say(clntinfo->serversocket, cmd);
-	free(cmd);
-	answer = ftp_readline(clntinfo->serversocket);
+	answer = getftpmeta(VERB_MDTM, filename, clntinfo);
 	if ( ! checkdigits(answer, 213)) {
 		jlog(4, "Error reading MDTM answer: %s", answer);
 		free(answer);
@@ -284,55 +343,127 @@ time_t getftpmdtm(const char* filename, struct clientinfo *clntinfo) {
 	return mktime( &tms );
 }
 
-unsigned long int getftpsize(char* filename, struct clientinfo *clntinfo) {
+/* ask for the size of FILENAME, returns -1 unless the server has answered
+ * with 213 */
+
+static
+int getftpsize_answer(const char* filename, struct clientinfo *clntinfo,
+		      unsigned long int* size) {
 /*
  * ftp> quote size speak.ps
  * 213 146617
  */
-	size_t cmdsize = strlen("SIZE ") + strlen(filename) + 2 + 1;
-	unsigned long int size;
 	int i;
 	char* answer;
-	char* cmd = (char*) malloc(cmdsize);
-
-	enough_mem(cmd);
-	snprintf(cmd, cmdsize, "SIZE %s\r\n", filename);
 
-	say(clntinfo->serversocket, cmd);
-	free(cmd);
-	answer = ftp_readline(clntinfo->serversocket);
+	answer = getftpmeta(VERB_SIZE, filename, clntinfo);
 	if ( ! checkdigits(answer, 213)) {
 		jlog(4, "Error reading SIZE answer: %s", answer);
 		free(answer);
-		return 0;
+		return -1;
 	}
 
-	i = sscanf(answer, "213 %lu", &size);
+	i = sscanf(answer, "213 %lu", size);
 	if (i != 1) {
 		jlog(4, "Error parsing SIZE answer: %s", answer);
 		free(answer);
-		return 0;
+		return -1;
 	}
 
 	free(answer);
+	return 0;
+}
+
+unsigned long int getftpsize(char* filename, struct clientinfo *clntinfo) {
+	unsigned long int size;
+
+	if (getftpsize_answer(filename, clntinfo, &size) < 0) {
+		return 0;
+	}
 	return size;
 }
 
+/* getftpstat() asks for the size and the date of FILENAME. Returns -1 if
+ * the server has not answered both, unlike getftpsize() and getftpmdtm()
+ * this tells a failure from a size of 0 */
+
+int getftpstat(const char* filename, struct clientinfo *clntinfo,
+	       unsigned long int* size, time_t* date) {
+	if (getftpsize_answer(filename, clntinfo, size) < 0) {
+		return -1;
+	}
+	*date = getftpmdtm(filename, clntinfo);
+	return *date == (time_t) -1 ? -1 : 0;
+}
+
+/* getftpmd5() asks the server for the MD5 sum of FILENAME with XMD5 and
+ * returns it in lower case hex. Returns NULL if the server does not know it,
+ * clntinfo->noxmd5 is set if it does not support the command at all */
+
+char* getftpmd5(const char* filename, struct clientinfo *clntinfo) {
+/*
+ * ftp> quote xmd5 speak.ps
+ * 250 A3C1B6F0F0C2B4B2DD4D12A6D4B2C1F0
+ */
+	struct message answer;
+	char* p, *md5 = (char*) 0;
+	size_t len;
+	int code, i;
+
+	sayf(clntinfo->serversocket, "XMD5 %s\r\n", filename);
+	/* a multiline answer has to be read completely */
+	answer = readall(clntinfo->serversocket);
+	if (!answer.fullmsg) {
+		jlog(7, "No answer to XMD5 %s", filename);
+		return (char*) 0;
+	}
+	answer.lastmsg[ strcspn(answer.lastmsg, "\r\n") ] = '\0';
+	code = respcode(answer.lastmsg);
+	if (code == 500 || code == 502 || code == 504) {
+		jlog(7, "The server does not support XMD5: %s",
+				answer.lastmsg);
+		clntinfo->noxmd5 = 1;
+	} else if (code == 250 || code == 213) {
+		/* some servers append the filename */
+		for (p = answer.lastmsg + 3; *p; p += len) {
+			p += strspn(p, " ");
+			len = strcspn(p, " ");
+			if (len == DIGEST_MD5LEN - 1
+			    && strspn(p, "0123456789abcdefABCDEF") >= len) {
+				md5 = (char*) malloc(DIGEST_MD5LEN);
+				enough_mem(md5);
+				for (i = 0; i < DIGEST_MD5LEN - 1; i++) {
+					md5[i] = tolower((int) p[i]);
+				}
+				md5[i] = '\0';
+				break;
+			}
+		}
+	}
+	if (!md5) {
+		jlog(7, "No MD5 sum for %s: %s", filename, answer.lastmsg);
+	}
+	free(answer.fullmsg);
+	return md5;
+}
+
 int passcmd(const char* buffer, struct clientinfo *clntinfo) {
 	int cs = clntinfo->clientsocket;
 	int ss = clntinfo->serversocket;
 	char* sendbuf =0;
 	char *last = 0;
-	size_t sendbufsize;
+	size_t sendbufsize, len;
+	struct trace_span span;
 
+	trace_begin(&span, TRACE_PASSCMD);
 	sendbufsize = strlen(buffer) + 3;
-	sendbuf = (char*) malloc(sendbufsize);
+	sendbuf = (char*) arena_alloc(sendbufsize);
 	snprintf(sendbuf, sendbufsize, "%s\r\n", buffer);
 	jlog(9, "Send (server - %d): %s", ss, sendbuf);
 	say(ss, sendbuf);
-	free(sendbuf);
 	lcs.complete = 0;
 	last = passall(ss, cs);
+	trace_end(&span, verb_parse(buffer, &len), last ? getcode(last) : -1);
 	if (last) {
 		lcs.respcode = getcode(last);
 		jlog(9, "Send (client - %d): %s", cs, last);
@@ -346,8 +477,6 @@ int passcmd(const char* buffer, struct clientinfo *clntinfo) {
 		}
 		return -1;
 	}
-	free(/*at*/ last);  /*  ;-)  */
-	last                     =  (char*) 0;
 	lcs.complete = lcs.respcode == 226;
 	return 0;
 }
@@ -363,35 +492,113 @@ int transfer_cleanup(struct clientinfo *clntinfo) {
 	if (clntinfo->dataclientsock != -1) {
 		close(clntinfo->dataclientsock);
 	}
+	clntinfo->dataserverpending = 0;
+	clntinfo->dataclientpending = 0;
 	return 0;
 }
 
 
 /* transfer_negotiate:
+ *
+ * Establishes both data connections. Each of them is either a socket that
+ * we listen on and where we wait for the peer to connect, a socket with a
+ * non-blocking connect() in progress or an already established one. A
+ * single select() waits for both sides so that the handshakes overlap.
  *
  * return values:
  *
  * 	-1    dramatic error that should cause the program to terminate
  * 	-2    non dramatic error
  */
-int transfer_negotiate(struct clientinfo *clntinfo) {
-	int cs = clntinfo->clientsocket;
-	int ret;
+
+#define DATALEG_READY		0
+#define DATALEG_ACCEPT		1
+#define DATALEG_CONNECT		2
+
+static
+int transfer_leg_state(struct clientinfo *clntinfo, int* sock, int pending) {
+	if (*sock < 0) {
+		return DATALEG_READY;
+	}
+	if (pending) {
+		return DATALEG_CONNECT;
+	}
+	if (clntinfo->waitforconnect == sock) {
+		return DATALEG_ACCEPT;
+	}
+	/* if we're talking to the server in active ftp mode, the server
+	 * connects to us. Since we're talking to the client in passive
+	 * mode, the client connects to us, too! */
+	if (clntinfo->servermode == ACTIVE
+	    && clntinfo->clientmode == PASSIVE) {
+		return DATALEG_ACCEPT;
+	}
+	return DATALEG_READY;
+}
+
+/* transfer_leg_done() finishes one side after select() reported activity
+ * on it. Returns -1 on error, 0 on success */
+
+static
+int transfer_leg_done(int* sock, int state, const char* side) {
 #ifdef HAVE_SOCKLEN_T
 	socklen_t count;
 #else
 	int count;
 #endif
-	fd_set acc_set;
-	int servacc = 0, clntacc = 0;
-	struct timeval tmo;
 	struct sockaddr_in sin;
+	int ret;
 
+	if (state == DATALEG_CONNECT) {
+		if (openport_complete(*sock) < 0) {
+			jlog(2, "Could not connect to the %s", side);
+			return -1;
+		}
+		return 0;
+	}
 	count = sizeof(sin);
+	ret = accept(*sock, (struct sockaddr*) &sin, &count);
+	if (ret < 0) {
+		jlog(2, "Error in accept() (%s): %s", side, strerror(errno));
+		return -1;
+	}
+	close(*sock);
+	*sock = ret;
+	return 0;
+}
+
+/* one side could not be connected - give up on both of them, the server
+ * notices it and sends its error reply */
+
+static
+int transfer_negotiate_fail(struct clientinfo *clntinfo) {
+	if (clntinfo->dataserversock >= 0
+	    && clntinfo->dataserversock != clntinfo->cachefd) {
+		close(clntinfo->dataserversock);
+	}
+	if (clntinfo->dataclientsock >= 0) {
+		close(clntinfo->dataclientsock);
+	}
+	clntinfo->dataserversock = -1;
+	clntinfo->dataclientsock = -1;
+	clntinfo->dataserverpending = 0;
+	clntinfo->dataclientpending = 0;
+	return -2;
+}
+
+int transfer_negotiate(struct clientinfo *clntinfo) {
+	int cs = clntinfo->clientsocket;
+	int ret;
+	int servstate, clntstate;
+	int maxfd;
+	fd_set acc_set, con_set;
+	struct timeval tmo;
+
 	tmo.tv_sec = config_get_ioption("transfertimeout", 300);
 	tmo.tv_usec = 0;
 
 	if (clntinfo->portcmd) {
+		/* this only starts the connect() */
 		ret = activeclient(clntinfo->portcmd, clntinfo);
 		free(clntinfo->portcmd);
 		clntinfo->portcmd = (char*) 0;
@@ -402,89 +609,57 @@ int transfer_negotiate(struct clientinfo *clntinfo) {
 
 	if (clntinfo->mode == RETR && clntinfo->fromcache == 1) {
 		/* the data comes from the cache */
-		close(clntinfo->dataserversock);
-		clntinfo->dataserversock = clntinfo->cachefd;
-		servacc = 1;
-	}
-
-	/* if we're talking to the server in active ftp mode, the server
-	 * connects to us. Since we're talking to the client in passive
-	 * mode, the client connects to us, too! */
-	if (clntinfo->servermode == ACTIVE 
-	    && clntinfo->clientmode == PASSIVE) {
-		/* accept connections from both sides */
-		clntinfo->waitforconnect = (int*) 0;
-		/* loop until both have connected */
-		while (servacc == 0 || clntacc == 0) {
-			FD_ZERO(&acc_set);
-			if ( ! servacc ) {
-				FD_SET(clntinfo->dataserversock, &acc_set);
-			}
-			if ( ! clntacc ) {
-				FD_SET(clntinfo->dataclientsock, &acc_set);
-			}
-			/* select() and wait for both */
-			ret = select(MAX_VAL(clntinfo->dataserversock,
-					 clntinfo->dataclientsock) + 1,
-					&acc_set, NULL, NULL, &tmo);
-			if (ret < 0) {
-				jlog(2, "Select() error1: %s", strerror(errno));
-				return -1;
-			}
-			if (ret == 0) {
-				jlog(2, "Connection timed out");
-				lcs.respcode = 500;
-				say(cs, "500 Connection timed out\r\n");
-				return -1;
-			}
-			/* no timeout, no error, one of them must have
-			 * connected, check if it was the server. */
-			if (FD_ISSET(clntinfo->dataserversock, &acc_set)) {
-				ret = accept(clntinfo->dataserversock,
-					(struct sockaddr*) &sin, &count);
-				if (ret < 0) {
-					jlog(2, "Error in accept() #1: %s",
-							strerror(errno));
-					return -1;
-				}
-				close(clntinfo->dataserversock);
-				clntinfo->dataserversock = ret;
-				servacc = 1;
-			}
-			/* check if the client connected */
-			if (FD_ISSET(clntinfo->dataclientsock, &acc_set)) {
-				ret = accept(clntinfo->dataclientsock,
-					(struct sockaddr*) &sin, &count);
-				if (ret < 0) {
-					jlog(2, "Error in accept() #2: %s",
-							strerror(errno));
-					return -1;
-				}
-				close(clntinfo->dataclientsock);
-				clntinfo->dataclientsock = ret;
-				clntacc = 1;
-			}
+		if (clntinfo->waitforconnect == &clntinfo->dataserversock) {
+			clntinfo->waitforconnect = (int*) 0;
+		}
+		if (clntinfo->dataserversock >= 0) {
+			close(clntinfo->dataserversock);
 		}
-	}
-	if (clntinfo->mode == RETR
-		    && clntinfo->fromcache == 1
-		    && clntinfo->waitforconnect == &clntinfo->dataserversock) {
-		/* the data comes from the cache */
-		clntinfo->waitforconnect = (int*) 0;
-/*		close(clntinfo->dataserversock);
 		clntinfo->dataserversock = clntinfo->cachefd;
-*/
+		clntinfo->dataserverpending = 0;
+		servstate = DATALEG_READY;
+	} else {
+		servstate = transfer_leg_state(clntinfo,
+					       &clntinfo->dataserversock,
+					       clntinfo->dataserverpending);
+	}
+	clntstate = transfer_leg_state(clntinfo,
+				       &clntinfo->dataclientsock,
+				       clntinfo->dataclientpending);
+	clntinfo->waitforconnect = (int*) 0;
+
+	if ((clntinfo->dataserversock < 0 && !clntinfo->cachebuf)
+	    || clntinfo->dataclientsock < 0) {
+		return transfer_negotiate_fail(clntinfo);
 	}
-	if (clntinfo->waitforconnect) {
+
+	/* loop until both sides are connected */
+	while (servstate != DATALEG_READY || clntstate != DATALEG_READY) {
 		FD_ZERO(&acc_set);
-		if (*clntinfo->waitforconnect < 0) {
-			return -2;
+		FD_ZERO(&con_set);
+		maxfd = -1;
+		if (servstate == DATALEG_ACCEPT) {
+			FD_SET(clntinfo->dataserversock, &acc_set);
+		}
+		if (servstate == DATALEG_CONNECT) {
+			FD_SET(clntinfo->dataserversock, &con_set);
+		}
+		if (servstate != DATALEG_READY) {
+			maxfd = clntinfo->dataserversock;
 		}
-		FD_SET(*clntinfo->waitforconnect, &acc_set);
-		ret = select(*clntinfo->waitforconnect + 1, &acc_set,
-				NULL, NULL, &tmo);
+		if (clntstate == DATALEG_ACCEPT) {
+			FD_SET(clntinfo->dataclientsock, &acc_set);
+		}
+		if (clntstate == DATALEG_CONNECT) {
+			FD_SET(clntinfo->dataclientsock, &con_set);
+		}
+		if (clntstate != DATALEG_READY) {
+			maxfd = MAX_VAL(maxfd, clntinfo->dataclientsock);
+		}
+
+		ret = select(maxfd + 1, &acc_set, &con_set, NULL, &tmo);
 		if (ret < 0) {
-			jlog(2, "Select() error2: %s", strerror(errno));
+			jlog(2, "Select() error: %s", strerror(errno));
 			return -1;
 		}
 		if (ret == 0) {
@@ -493,16 +668,26 @@ int transfer_negotiate(struct clientinfo *clntinfo) {
 			say(cs, "500 Connection timed out\r\n");
 			return -1;
 		}
-		/* accept connection from one side */
-		ret = accept(*clntinfo->waitforconnect,
-				(struct sockaddr*) &sin, &count);
-		if (ret < 0) {
-			jlog(2, "Error in accept() #3: %s",
-					strerror(errno));
-			return -1;
+		if (servstate != DATALEG_READY
+		    && (FD_ISSET(clntinfo->dataserversock, &acc_set)
+			|| FD_ISSET(clntinfo->dataserversock, &con_set))) {
+			if (transfer_leg_done(&clntinfo->dataserversock,
+					servstate, "server") < 0) {
+				return transfer_negotiate_fail(clntinfo);
+			}
+			clntinfo->dataserverpending = 0;
+			servstate = DATALEG_READY;
+		}
+		if (clntstate != DATALEG_READY
+		    && (FD_ISSET(clntinfo->dataclientsock, &acc_set)
+			|| FD_ISSET(clntinfo->dataclientsock, &con_set))) {
+			if (transfer_leg_done(&clntinfo->dataclientsock,
+					clntstate, "client") < 0) {
+				return transfer_negotiate_fail(clntinfo);
+			}
+			clntinfo->dataclientpending = 0;
+			clntstate = DATALEG_READY;
 		}
-		close(*clntinfo->waitforconnect);
-		*clntinfo->waitforconnect = ret;
 	}
 
 	if (clntinfo->mode == STOR) {
@@ -511,6 +696,8 @@ int transfer_negotiate(struct clientinfo *clntinfo) {
 		clntinfo->dataserversock = clntinfo->dataclientsock;
 		clntinfo->dataclientsock = ret;
 	}
+	JFTPGW_PROBE3(data__established, clntinfo->dataserversock,
+			clntinfo->dataclientsock, clntinfo->mode);
 	return 0;
 }
 
@@ -523,8 +710,13 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 	char* buffer = (char*) malloc(TRANSMITBUFSIZE);
 	char* pbuf = 0;
 	int count = 0;
-	int nwritten = 0, cachewritten, totwritten, sret = 0, scret = 0;
+	int nwritten = 0, totwritten, sret = 0, scret = 0;
 	int cachefail = 0;
+	/* the bytes that still come from the cache before the server */
+	unsigned long prefix = clntinfo->cacheprefix;
+	/* the bytes of cachebuf that have been sent */
+	unsigned long bufpos = 0;
+	int fromcache, srcfd;
 	int cs = clntinfo->clientsocket;
 	int n, ret, error = 0, aborted = 0;
 	int maxfd;
@@ -591,7 +783,10 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 		count = -1; /* choose a number != 0 for the check below the
 			       while loop */
 
-		if (clntinfo->fromcache) {
+		fromcache = clntinfo->fromcache || prefix > 0;
+		srcfd = prefix > 0 ? clntinfo->cachefd
+				   : clntinfo->dataserversock;
+		if (fromcache) {
 			readtime.tv_sec = 0;
 			readtime.tv_usec = 0;
 			maxfd = cs;
@@ -612,16 +807,36 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 		if (sret < 0) {
 			break;
 		}
-		if (sret == 0 && !clntinfo->fromcache) {
+		if (sret == 0 && !fromcache) {
 			break;
 		}
 
 		/* Can we read data from the client ? */
-		if (clntinfo->fromcache
+		if (fromcache
 			|| FD_ISSET(clntinfo->dataserversock, &readset)) {
 
-			count = read(clntinfo->dataserversock,
-				buffer, TRANSMITBUFSIZE);
+			if (clntinfo->cachebuf) {
+				/* a file from the memory tier */
+				count = MIN_VAL(clntinfo->cachebuflen - bufpos,
+						TRANSMITBUFSIZE);
+				memcpy(buffer, clntinfo->cachebuf + bufpos,
+						count);
+				bufpos += count;
+			} else if (clntinfo->cachez) {
+				/* a compressed file of the cache */
+				count = cachez_read(clntinfo->cachez, buffer,
+						TRANSMITBUFSIZE);
+			} else {
+				count = read(srcfd, buffer, prefix > 0
+					? MIN_VAL(prefix, TRANSMITBUFSIZE)
+					: TRANSMITBUFSIZE);
+			}
+			if (count == 0 && prefix > 0) {
+				jlog(3, "Cache file ended %lu bytes early",
+						prefix);
+				error = TRNSMT_ERROR;
+				break;
+			}
 			if (count == 0) {
 				jlog(8, "Read 0 bytes at %s (%d)", __FILE__, __LINE__);
 				break;
@@ -636,6 +851,54 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 				break;
 			}
 
+			if (prefix > 0) {
+				prefix -= count;
+				if (clntinfo->cachedigest) {
+					digest_update(clntinfo->cachedigest,
+						buffer, count);
+				}
+			} else if (clntinfo->tocache && !cachefail) {
+				/* write to the cache first */
+				if (cachewr_write(clntinfo, buffer, count)
+									< 0) {
+					cachefail = 1;
+				} else {
+					clntinfo->cachestored += count;
+					if (clntinfo->cachedigest) {
+						digest_update(
+							clntinfo->cachedigest,
+							buffer, count);
+					}
+				}
+			}
+
+			/* convert if we have to, the cache gets the
+			 * binary data */
+			if (clntinfo->transfermode_havetoconvert
+						!= CONV_NOTCONVERT
+			    && clntinfo->serverlisting != 1) {
+				char* tmp;
+				if (clntinfo->transfermode_havetoconvert
+						== CONV_TOASCII) {
+					jlog(9, "Converting to ASCII");
+					tmp = to_ascii(buffer, &count,
+						strictasciiconversion);
+					if (count > TRANSMITBUFSIZE) {
+						buffer =
+						realloc(buffer, count);
+					}
+					memcpy((void*) buffer,
+						(void*) tmp, count);
+					free(tmp);
+				}
+				if (clntinfo->transfermode_havetoconvert
+						== CONV_FRMASCII) {
+					/* we don't convert from
+					 * ascii, this case does not
+					 * occur, jftpgw always
+					 * reads in binary mode */
+				}
+			}
 			/* comm */
 			pbuf = buffer;
 			do {
@@ -671,44 +934,6 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 					break;
 				}
 				/* otherwise the descriptor must be ready */
-				/* write to the cache first */
-				if ( clntinfo->tocache &&  ! cachefail ) {
-					cachewritten = write(clntinfo->cachefd,
-						pbuf, count);
-					if (cachewritten != count) {
-						jlog(3, "Error writing to the "
-							"cache: %s",
-							strerror(errno));
-						cachefail = 1;
-					}
-				}
-				/* convert if we have to */
-				if (clntinfo->transfermode_havetoconvert
-							!= CONV_NOTCONVERT
-				    && clntinfo->serverlisting != 1) {
-					char* tmp;
-					if (clntinfo->transfermode_havetoconvert
-							== CONV_TOASCII) {
-						jlog(9, "Converting to ASCII");
-						tmp = to_ascii(buffer, &count,
-							strictasciiconversion);
-						if (count > TRANSMITBUFSIZE) {
-							buffer =
-							realloc(buffer, count);
-						}
-						memcpy((void*) buffer,
-							(void*) tmp, count);
-						free(tmp);
-					}
-					if (clntinfo->transfermode_havetoconvert
-							== CONV_FRMASCII) {
-						/* we don't convert from
-						 * ascii, this case does not
-						 * occur, jftpgw always
-						 * reads in binary mode */
-					}
-					pbuf = buffer;
-				}
 				nwritten = write(clntinfo->dataclientsock,
 						pbuf, count);
 				if (nwritten < 0) {
@@ -722,6 +947,8 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 							__FILE__, __LINE__);
 				}
 				totwritten += nwritten;
+				JFTPGW_PROBE3(relay__chunk, nwritten, srcfd,
+						clntinfo->dataclientsock);
 				/* calculate the delay time */
 				if (clntinfo->throughput >= 0) {
 					done = time(NULL);
@@ -762,7 +989,9 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 		FD_ZERO(&readset);
 		FD_ZERO(&writeset);
 		FD_ZERO(&exceptset);
-		FD_SET(clntinfo->dataserversock, &readset);
+		if (clntinfo->dataserversock >= 0) {
+			FD_SET(clntinfo->dataserversock, &readset);
+		}
 		FD_SET(clntinfo->dataclientsock, &writeset);
 		FD_SET(cs, &exceptset);
 		FD_SET(cs, &readset);
@@ -810,13 +1039,22 @@ int transfer_transmit(struct clientinfo *clntinfo)  {
 	free(buffer);
 
 	close(clntinfo->dataclientsock);
-	close(clntinfo->dataserversock);
+	if (clntinfo->dataserversock >= 0) {
+		close(clntinfo->dataserversock);
+	}
 	if (clntinfo->cachefd >= 0) {
 		close(clntinfo->cachefd);
 	}
+	free(clntinfo->cachebuf);
+	clntinfo->cachebuf = (char*) 0;
+	clntinfo->cachebuflen = 0;
+	cachez_close(clntinfo->cachez);
+	clntinfo->cachez = (struct cachez*) 0;
 	clntinfo->dataclientsock = -1;
 	clntinfo->dataserversock = -1;
 	clntinfo->cachefd        = -1;
+	clntinfo->dataclientpending = 0;
+	clntinfo->dataserverpending = 0;
 
 	if (aborted) {
 		error = TRNSMT_ABORTED;
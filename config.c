@@ -41,6 +41,8 @@ int save_runasuser_uid(void);
 static struct section_t* base_section;
 static struct section_t* backup_base_section;
 static struct option_t* option_list;
+/* changes whenever option_list does, see config_get_generation() */
+static unsigned long int config_generation;
 
 static int debug;
 static int config_error;
@@ -133,6 +135,46 @@ struct conf_dat configuration_data[] = {
 	{"dnslookups",			TAG_ALL, "yes", EM, WSP },
 						/* 8 hours */
 	{"hostcachetimeout",		TAG_ALL, "28800", EM, WSP },
+	{"connectstagger",		TAG_ALL, "250", EM, WSP },
+	{"connectfailuretimeout",	TAG_ALL, "300", EM, WSP },
+	{"upstreampool",		TAG_ALL, (char*) 0, EM, FL },
+	{"configsnapshot",		TAG_GLOBAL, "off", EM, WSP },
+	{"accountfile",			TAG_GLOBAL, (char*) 0, EM, WSP },
+	{"authcachetime",		TAG_ALL, "0", EM, WSP },
+	{"poolmaxfails",		TAG_ALL, "3", EM, WSP },
+	{"poolretrytime",		TAG_ALL, "30", EM, WSP },
+	{"queuemaxwait",		TAG_ALL, "0", EM, WSP },
+	{"queuelength",			TAG_ALL, "32", EM, WSP },
+	{"queuenotice",			TAG_ALL, "0", EM, WSP },
+	{"queuemaxload",		TAG_ALL, "0", EM, WSP },
+	{"queuemaxprocesses",		TAG_ALL, "0", EM, WSP },
+	{"acceptrate",			TAG_ALL, "0", EM, WSP },
+	{"acceptburst",			TAG_ALL, "10", EM, WSP },
+	{"acceptprefix",		TAG_ALL, "32", EM, WSP },
+	{"tracefile",			TAG_GLOBAL, (char*) 0, EM, WSP },
+	{"metacachetime",		TAG_ALL, "0", EM, WSP },
+	{"negcachetime",		TAG_ALL, "0", EM, WSP },
+	{"cachevalidate",		TAG_ALL, "date", EM, WSP },
+	{"cachewritebehind",		TAG_ALL, "0", EM, WSP },
+	{"cachewritepolicy",		TAG_ALL, "drop", EM, WSP },
+	{"cacheadmission",		TAG_ALL, "all", EM, WSP },
+	{"cacheadmitwindow",		TAG_ALL, "3600", EM, WSP },
+	{"cacheadmitcount",		TAG_ALL, "2", EM, WSP },
+	{"cachestatsfile",		TAG_GLOBAL, (char*) 0, EM, WSP },
+	{"cacheroot",			TAG_ALL, (char*) 0, EM, FL },
+	{"cachememory",			TAG_GLOBAL, "0", EM, WSP },
+	{"cachememmaxsize",		TAG_ALL, "64k", EM, WSP },
+	{"cachememhits",		TAG_ALL, "2", EM, WSP },
+	{"cachecompress",		TAG_ALL, "none", EM, WSP },
+	{"cachesoftttl",		TAG_ALL, "0", EM, WSP },
+	{"cachehardttl",		TAG_ALL, "0", EM, WSP },
+	{"cachewritethrough",		TAG_ALL, "off", EM, WSP },
+	{"cachededup",			TAG_ALL, "off", EM, WSP },
+	{"cacheshared",			TAG_ALL, "off", EM, WSP },
+	{"prefetchspool",		TAG_GLOBAL, (char*) 0, EM, WSP },
+	{"prefetchworkers",		TAG_GLOBAL, "2", EM, WSP },
+	{"prefetchrate",		TAG_GLOBAL, "0", EM, WSP },
+	{"prefetchsiblings",		TAG_ALL, "0", EM, WSP },
 	{ (char*) 0,                  0, (char*) 0, 0, 0 }
 
 };
@@ -159,6 +201,13 @@ struct conf_opt configuration_options[] = {
 	{"getinternalip",       {"udp", "icmp", "configuration", TERM} },
 	{"transparent-proxy",   { TRUEFALSE, TERM } },
 	{"cache",               { TRUEFALSE, TERM } },
+	{"cachevalidate",       {"date", "md5", TERM} },
+	{"cachewritepolicy",    {"drop", "wait", TERM} },
+	{"cacheadmission",      {"all", "second", "tinylfu", TERM} },
+	{"cachecompress",       {"none", "zlib", TERM} },
+	{"cachewritethrough",   { TRUEFALSE, TERM } },
+	{"cachededup",          { TRUEFALSE, TERM } },
+	{"cacheshared",         { TRUEFALSE, TERM } },
 	{"allowreservedports",  { TRUEFALSE, TERM } },
 	{"allowforeignaddress", { TRUEFALSE, TERM } },
 	{"reverselookups",      { TRUEFALSE, TERM } },
@@ -2569,22 +2618,33 @@ int config_read_sections(FILE* file) {
 
 int read_config(const char* fname) {
 	int ret;
+	int from_text = 1;
 	char* filename = chrooted_path(fname);
-	FILE* conffile = open_file(filename);
-	if (!conffile) {
-		free(filename);
-		return -1;
-	}
-	jlog(9, "opened file %s", filename);
-	free(filename);
+	FILE* conffile;
 
-	ret = config_read_sections(conffile);
-	fclose(conffile);
+	/* a valid compiled snapshot saves us the parsing */
+	base_section = confsnap_read(filename);
+	if (base_section) {
+		config_set_limits(base_section);
+		from_text = 0;
+		ret = 0;
+	} else {
+		conffile = open_file(filename);
+		if (!conffile) {
+			free(filename);
+			return -1;
+		}
+		jlog(9, "opened file %s", filename);
+
+		ret = config_read_sections(conffile);
+		fclose(conffile);
+	}
 
 	if (ret == -1) {
 		/* an error - try to activate backup */
 		if (config_activate_backup() < 0) {
 			/* failed */
+			free(filename);
 			return -1;
 		}
 		/* backup successfully activated */
@@ -2598,6 +2658,7 @@ int read_config(const char* fname) {
 
 	optionlist_destroy( option_list );
 	option_list = (struct option_t*) 0;
+	config_generation++;
 	if (base_section) {
 		ret = config_shrink_config(-1,	/* source IP */
 				-1,		/* dest IP */
@@ -2616,6 +2677,21 @@ int read_config(const char* fname) {
 				TAG_GLOBAL | TAG_SERVERTYPE);
 	}
 
+	/* compile the configuration we have just parsed. The backup still
+	 * holds the complete tree, base_section has been shrunk already */
+	if (from_text && ret == 0 && backup_base_section) {
+		if (config_get_bool("configsnapshot") == 1) {
+			confsnap_write(filename, backup_base_section);
+		} else {
+			confsnap_remove(filename);
+		}
+	}
+	free(filename);
+
+	if (ret == 0) {
+		acct_index_build();
+	}
+
 	/* switch debug on if there is just one process but leave it if
 	 * we are running from inetd */
 	debug = srvinfo.servertype == SERVERTYPE_STANDALONE 
@@ -3394,9 +3470,19 @@ const struct option_t* config_get_option_list() {
 	return option_list;
 }
 
+/* config_get_generation() returns a number that changes whenever the
+ * options change, after reading or shrinking the configuration. Code that
+ * derives state from options can keep it as long as the number stays the
+ * same */
+
+unsigned long int config_get_generation(void) {
+	return config_generation;
+}
+
 void config_option_list_delete(const char* key) {
 	if ( option_list ) {
 		optionlist_delete_key(option_list, key);
+		config_generation++;
 	}
 }
 
@@ -3431,6 +3517,9 @@ int config_shrink_config(unsigned long int from_ip,
 
 				struct hostent_list** hostc_list,
 				int config_state) {
+	struct trace_span span;
+
+	trace_begin(&span, TRACE_CONFIG);
 
 		/* transparent proxy, TO and PORT have been read with
 		 * getsockname */
@@ -3450,6 +3539,7 @@ int config_shrink_config(unsigned long int from_ip,
 	optionlist_destroy( option_list );
 	option_list = (struct option_t*) 0;
 	option_list = config_generate_option_list(base_section, config_state);
+	config_generation++;
 
 	/* dump configuration */
 	if (debug) {
@@ -3464,6 +3554,7 @@ int config_shrink_config(unsigned long int from_ip,
 		log_detect_log_change();
 	}
 
+	trace_end(&span, VERB_UNKNOWN, 0);
 	return 0;
 }
 
@@ -3718,9 +3809,7 @@ int config_get_bool(const char* key) {
 unsigned long int config_get_size(const char* key,
 					unsigned long int err_return) {
 	const char* optstr = config_get_option(key);
-	unsigned long int size;
 	int i, nondigits;
-	char multiplier;
 
 	if (strcasecmp(optstr, "unlimited") == 0) {
 		return ULONG_MAX;
@@ -3738,7 +3827,26 @@ unsigned long int config_get_size(const char* key,
 		return config_get_uloption(key, err_return);
 	}
 
+	return config_parse_size(optstr, err_return);
+}
+
+/* parses a size like "512", "64k" or "unlimited" that is not the value of
+ * an option of its own but a part of one */
+
+unsigned long int config_parse_size(const char* optstr,
+					unsigned long int err_return) {
+	unsigned long int size;
+	char multiplier;
+	int i;
+
+	if (strcasecmp(optstr, "unlimited") == 0) {
+		return ULONG_MAX;
+	}
+
 	i = sscanf(optstr, "%lu%c", &size, &multiplier);
+	if (i == 1) {
+		return size;
+	}
 	if (i != 2) {
 		jlog(5, "%s not a valid size", optstr);
 		return err_return;
@@ -3772,6 +3880,7 @@ void config_delete_config() {
 	base_section = (struct section_t*) 0;
 	optionlist_destroy( option_list );
 	option_list = (struct option_t*) 0;
+	config_generation++;
 	hostent_destroy(hostcache);
 	hostcache = (struct hostent_list*) 0;
 }
@@ -3781,6 +3890,47 @@ void config_delete_master() {
 	base_section = (struct section_t*) 0;
 }
 
+/* returns 1 if KEY is set in SECTION or in one of its nested sections.
+ * With SIBLINGS the following sections are searched as well */
+
+static
+int config_section_has_option(const struct section_t* section,
+				const char* key, int siblings) {
+	const struct option_t* o;
+
+	for (; section; section = siblings ? section->next : 0) {
+		for (o = section->options; o; o = o->next) {
+			if (strcasecmp(o->key, key) == 0) {
+				return 1;
+			}
+		}
+		if (config_section_has_option(section->nested, key, 1)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* config_option_is_conditional() returns 1 if KEY is set in a section whose
+ * evaluation depends on the client, i.e. anywhere except in the top level
+ * global and servertype sections */
+
+int config_option_is_conditional(const char* key) {
+	const struct section_t* section;
+
+	for (section = backup_base_section; section; section = section->next) {
+		if (section->tag_name == TAG_GLOBAL
+		    || section->tag_name == TAG_SERVERTYPE) {
+			if (config_section_has_option(section->nested, key, 1)) {
+				return 1;
+			}
+		} else if (config_section_has_option(section, key, 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void config_create_backup() {
 	if (backup_base_section) {
 		config_destroy_section(backup_base_section);
@@ -160,7 +160,10 @@ int config_check_limit_violation(void);
 void config_counter_add_connected(struct connliststruct*);
 const char* config_get_option(const char* key);
 struct slist_t* config_get_option_array(const char* key);
+unsigned long int config_get_generation(void);
 struct slist_t* config_split_line(const char* line, const char* pattern);
+struct slist_t* slist_init(char* val);
+struct slist_t* slist_append(struct slist_t* a, struct slist_t* b);
 struct slist_t* slist_reverse(struct slist_t* sl);
 int slist_case_contains(const struct slist_t*, const char*);
 void slist_destroy(struct slist_t* sl);
@@ -173,6 +176,7 @@ unsigned long int config_get_addroption(const char* key, unsigned long int);
 int config_get_bool(const char* key);
 float config_get_foption(const char* key, float err_return);
 unsigned long int config_get_size(const char* key, unsigned long int err);
+unsigned long int config_parse_size(const char* s, unsigned long int err);
 void config_option_list_delete(const char* key);
 void config_option_list_add(const char* key, const char* value);
 int config_compare_option(const char* key, const char* compare);
@@ -182,9 +186,16 @@ void config_delete_master();
 void config_create_backup();
 int config_activate_backup();
 void config_destroy_sectionconfig();
+void config_section_init(struct section_t*);
+void config_destroy_section(struct section_t*);
+void config_set_limits(struct section_t*);
+int config_option_is_conditional(const char* key);
+char* config_read_line(FILE* file);
 
 const char* hostent_get_name(struct hostent_list** h, unsigned long int ip);
 unsigned long int hostent_get_ip(struct hostent_list** h, const char* name);
+const struct ullist_t* hostent_get_addr(struct hostent_list** h,
+					const char* name);
 
 long conv_char2long(const char*, long);
 
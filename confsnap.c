@@ -0,0 +1,599 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* confsnap.c - compiled snapshots of the configuration
+ *
+ * If "configsnapshot" is switched on, the parsed section tree is written
+ * to <configfile>.snap in a flat binary form. The next process that reads
+ * the configuration (in inetd mode: every connection) maps the snapshot
+ * and rebuilds the tree from it instead of tokenizing and parsing the
+ * text again.
+ *
+ * The snapshot records the size and a hash of the text it was compiled
+ * from, a snapshot that does not match the current text is ignored. It is
+ * written to a temporary file first and renamed, so readers never see a
+ * half written one. The format is specific to the machine it was written
+ * on. */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "jftpgw.h"
+
+#define CONFSNAP_MAGIC		"JFTPGWS1"
+#define CONFSNAP_SUFFIX		".snap"
+
+struct confsnap_header {
+	char magic[8];
+	unsigned int longsize;		/* sizeof(long) of the writer */
+	unsigned int text_size;
+	unsigned int text_hash;
+	unsigned int body_size;
+	unsigned int body_hash;
+};
+
+struct confsnap_buf {
+	char* data;
+	size_t len;
+	size_t size;
+};
+
+
+static
+unsigned int confsnap_hash(const char* p, size_t len) {
+	/* FNV-1a */
+	unsigned int h = 2166136261U;
+
+	while (len--) {
+		h ^= (unsigned char) *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+static
+char* confsnap_name(const char* conffile) {
+	char* name = (char*) calloc(1, strlen(conffile)
+					+ strlen(CONFSNAP_SUFFIX) + 1);
+	enough_mem(name);
+	strcpy(name, conffile);
+	strcat(name, CONFSNAP_SUFFIX);
+	return name;
+}
+
+
+/* read the text of the configuration file to get its size and hash */
+
+static
+int confsnap_text_hash(const char* conffile,
+		       unsigned int* size, unsigned int* hash) {
+	int fd;
+	struct stat st;
+	char* text;
+	ssize_t n;
+	size_t got = 0;
+
+	if ((fd = open(conffile, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	text = (char*) malloc(st.st_size + 1);
+	enough_mem(text);
+	while (got < (size_t) st.st_size) {
+		n = read(fd, text + got, st.st_size - got);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		got += n;
+	}
+	close(fd);
+	*size = got;
+	*hash = confsnap_hash(text, got);
+	free(text);
+	return 0;
+}
+
+
+/* ------------------------ writing a snapshot ------------------------ */
+
+static
+void put(struct confsnap_buf* b, const void* p, size_t len) {
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = (char*) realloc(b->data, b->size);
+		enough_mem(b->data);
+	}
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+}
+
+static
+void put_int(struct confsnap_buf* b, int i) {
+	put(b, &i, sizeof(i));
+}
+
+static
+void put_ulong(struct confsnap_buf* b, unsigned long int ul) {
+	put(b, &ul, sizeof(ul));
+}
+
+/* strings are stored with their length plus one, 0 is the null pointer */
+static
+void put_str(struct confsnap_buf* b, const char* s) {
+	if (!s) {
+		put_int(b, 0);
+		return;
+	}
+	put_int(b, strlen(s) + 1);
+	put(b, s, strlen(s) + 1);
+}
+
+static
+void put_hostlist(struct confsnap_buf* b, const struct hostlist_t* hl) {
+	const struct hostlist_t* h;
+	int n = 0;
+
+	for (h = hl; h; h = h->next) { n++; }
+	put_int(b, n);
+	for (h = hl; h; h = h->next) {
+		put_ulong(b, h->host.ip.ip);
+		put_ulong(b, h->host.ip.netmask);
+		put_str(b, h->host.name);
+	}
+}
+
+static
+void put_slist(struct confsnap_buf* b, const struct slist_t* sl) {
+	const struct slist_t* s;
+	int n = 0;
+
+	for (s = sl; s; s = s->next) { n++; }
+	put_int(b, n);
+	for (s = sl; s; s = s->next) {
+		put_str(b, s->value);
+	}
+}
+
+static
+void put_ports(struct confsnap_buf* b, const struct portrangestruct* prs) {
+	const struct portrangestruct* p;
+	int n = 0;
+
+	for (p = prs; p; p = p->next) { n++; }
+	put_int(b, n);
+	for (p = prs; p; p = p->next) {
+		put_int(b, p->startport);
+		put_int(b, p->endport);
+	}
+}
+
+static
+void put_time(struct confsnap_buf* b, const struct timestruct* ts) {
+	const struct timestruct* t;
+	const struct ilist_t* il;
+	int n = 0;
+
+	for (t = ts; t; t = t->next) { n++; }
+	put_int(b, n);
+	for (t = ts; t; t = t->next) {
+		n = 0;
+		for (il = t->days; il; il = il->next) { n++; }
+		put_int(b, n);
+		for (il = t->days; il; il = il->next) {
+			put_int(b, il->value);
+		}
+		put_int(b, t->start_day);
+		put_int(b, t->start_hour);
+		put_int(b, t->start_minute);
+		put_int(b, t->end_day);
+		put_int(b, t->end_hour);
+		put_int(b, t->end_minute);
+	}
+}
+
+static
+void put_options(struct confsnap_buf* b, const struct option_t* ol) {
+	const struct option_t* o;
+	int n = 0;
+
+	for (o = ol; o; o = o->next) { n++; }
+	put_int(b, n);
+	for (o = ol; o; o = o->next) {
+		put_str(b, o->key);
+		put_str(b, o->value);
+	}
+}
+
+static
+void put_sections(struct confsnap_buf* b, const struct section_t* sl) {
+	const struct section_t* s;
+	int n = 0;
+
+	for (s = sl; s; s = s->next) { n++; }
+	put_int(b, n);
+	for (s = sl; s; s = s->next) {
+		put_int(b, s->tag_name);
+		put_int(b, s->id);
+		put_int(b, s->servertype);
+		put_hostlist(b, s->hosts);
+		put_hostlist(b, s->hosts_exclude);
+		put_slist(b, s->users);
+		put_slist(b, s->users_exclude);
+		put_slist(b, s->forwarded);
+		put_slist(b, s->forwarded_exclude);
+		put_ports(b, s->ports);
+		put_ports(b, s->ports_exclude);
+		put_time(b, s->time);
+		put_time(b, s->time_exclude);
+		put_options(b, s->options);
+		put_sections(b, s->nested);
+	}
+}
+
+
+int confsnap_write(const char* conffile, const struct section_t* base) {
+	struct confsnap_header hdr;
+	struct confsnap_buf b;
+	struct stat st;
+	char* snapname, *tmpname;
+	int fd, ret = -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (stat(conffile, &st) < 0
+	    || confsnap_text_hash(conffile, &hdr.text_size, &hdr.text_hash) < 0) {
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	put_sections(&b, base);
+
+	memcpy(hdr.magic, CONFSNAP_MAGIC, sizeof(hdr.magic));
+	hdr.longsize = sizeof(long);
+	hdr.body_size = b.len;
+	hdr.body_hash = confsnap_hash(b.data, b.len);
+
+	snapname = confsnap_name(conffile);
+	tmpname = (char*) malloc(strlen(snapname) + 16);
+	enough_mem(tmpname);
+	sprintf(tmpname, "%s.%ld", snapname, (long) getpid());
+
+	/* the snapshot has the passwords of the configuration, it gets the
+	 * owner and the permissions of the file */
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		jlog(5, "Could not create the configuration snapshot %s: %s",
+				tmpname, strerror(errno));
+	} else {
+		if ((fchown(fd, st.st_uid, st.st_gid) < 0 && errno != EPERM)
+		    || fchmod(fd, st.st_mode & 0777) < 0) {
+			jlog(5, "Could not set the permissions of the "
+				"configuration snapshot %s: %s",
+					tmpname, strerror(errno));
+			close(fd);
+			unlink(tmpname);
+		} else if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+		    || write(fd, b.data, b.len) != (ssize_t) b.len) {
+			jlog(5, "Could not write the configuration snapshot %s: %s",
+					tmpname, strerror(errno));
+			close(fd);
+			unlink(tmpname);
+		} else if (close(fd) < 0 || rename(tmpname, snapname) < 0) {
+			jlog(5, "Could not install the configuration snapshot %s: %s",
+					snapname, strerror(errno));
+			unlink(tmpname);
+		} else {
+			jlog(8, "Wrote the configuration snapshot %s", snapname);
+			ret = 0;
+		}
+	}
+
+	free(b.data);
+	free(tmpname);
+	free(snapname);
+	return ret;
+}
+
+
+void confsnap_remove(const char* conffile) {
+	char* snapname = confsnap_name(conffile);
+
+	if (unlink(snapname) == 0) {
+		jlog(8, "Removed the configuration snapshot %s", snapname);
+	}
+	free(snapname);
+}
+
+
+/* ------------------------ reading a snapshot ------------------------ */
+
+struct confsnap_in {
+	const char* p;
+	const char* end;
+	int error;
+};
+
+static
+void get(struct confsnap_in* in, void* p, size_t len) {
+	if (in->error || (size_t) (in->end - in->p) < len) {
+		in->error = 1;
+		memset(p, 0, len);
+		return;
+	}
+	memcpy(p, in->p, len);
+	in->p += len;
+}
+
+static
+int get_int(struct confsnap_in* in) {
+	int i;
+	get(in, &i, sizeof(i));
+	return i;
+}
+
+static
+unsigned long int get_ulong(struct confsnap_in* in) {
+	unsigned long int ul;
+	get(in, &ul, sizeof(ul));
+	return ul;
+}
+
+/* get_count() returns a number of elements that can be followed by at
+ * least as many bytes */
+static
+int get_count(struct confsnap_in* in) {
+	int n = get_int(in);
+
+	if (n < 0 || n > in->end - in->p) {
+		in->error = 1;
+		return 0;
+	}
+	return n;
+}
+
+static
+char* get_str(struct confsnap_in* in) {
+	int len = get_count(in);
+	char* s;
+
+	if (len == 0 || in->error) {
+		return (char*) 0;
+	}
+	if (in->p[len - 1] != '\0') {
+		in->error = 1;
+		return (char*) 0;
+	}
+	s = (char*) calloc(1, len);
+	enough_mem(s);
+	get(in, s, len);
+	return s;
+}
+
+static
+struct hostlist_t* get_hostlist(struct confsnap_in* in) {
+	struct hostlist_t* first = (struct hostlist_t*) 0;
+	struct hostlist_t** next = &first;
+	int n = get_count(in);
+
+	while (n-- > 0 && !in->error) {
+		*next = (struct hostlist_t*) malloc(sizeof(struct hostlist_t));
+		enough_mem(*next);
+		(*next)->host.ip.ip = get_ulong(in);
+		(*next)->host.ip.netmask = get_ulong(in);
+		(*next)->host.name = get_str(in);
+		(*next)->next = (struct hostlist_t*) 0;
+		next = &(*next)->next;
+	}
+	return first;
+}
+
+static
+struct slist_t* get_slist(struct confsnap_in* in) {
+	struct slist_t* first = (struct slist_t*) 0;
+	struct slist_t** next = &first;
+	int n = get_count(in);
+
+	while (n-- > 0 && !in->error) {
+		*next = (struct slist_t*) malloc(sizeof(struct slist_t));
+		enough_mem(*next);
+		(*next)->value = get_str(in);
+		(*next)->next = (struct slist_t*) 0;
+		next = &(*next)->next;
+	}
+	return first;
+}
+
+static
+struct portrangestruct* get_ports(struct confsnap_in* in) {
+	struct portrangestruct* first = (struct portrangestruct*) 0;
+	struct portrangestruct** next = &first;
+	int n = get_count(in);
+
+	while (n-- > 0 && !in->error) {
+		*next = (struct portrangestruct*)
+				malloc(sizeof(struct portrangestruct));
+		enough_mem(*next);
+		(*next)->startport = get_int(in);
+		(*next)->endport = get_int(in);
+		(*next)->next = (struct portrangestruct*) 0;
+		next = &(*next)->next;
+	}
+	return first;
+}
+
+static
+struct timestruct* get_time(struct confsnap_in* in) {
+	struct timestruct* first = (struct timestruct*) 0;
+	struct timestruct** next = &first;
+	struct ilist_t** day;
+	int n = get_count(in), ndays;
+
+	while (n-- > 0 && !in->error) {
+		*next = (struct timestruct*) malloc(sizeof(struct timestruct));
+		enough_mem(*next);
+		(*next)->days = (struct ilist_t*) 0;
+		day = &(*next)->days;
+		ndays = get_count(in);
+		while (ndays-- > 0 && !in->error) {
+			*day = (struct ilist_t*) malloc(sizeof(struct ilist_t));
+			enough_mem(*day);
+			(*day)->value = get_int(in);
+			(*day)->next = (struct ilist_t*) 0;
+			day = &(*day)->next;
+		}
+		(*next)->start_day = get_int(in);
+		(*next)->start_hour = get_int(in);
+		(*next)->start_minute = get_int(in);
+		(*next)->end_day = get_int(in);
+		(*next)->end_hour = get_int(in);
+		(*next)->end_minute = get_int(in);
+		(*next)->next = (struct timestruct*) 0;
+		next = &(*next)->next;
+	}
+	return first;
+}
+
+static
+struct option_t* get_options(struct confsnap_in* in) {
+	struct option_t* first = (struct option_t*) 0;
+	struct option_t** next = &first;
+	int n = get_count(in);
+
+	while (n-- > 0 && !in->error) {
+		*next = (struct option_t*) malloc(sizeof(struct option_t));
+		enough_mem(*next);
+		(*next)->key = get_str(in);
+		(*next)->value = get_str(in);
+		(*next)->next = (struct option_t*) 0;
+		next = &(*next)->next;
+	}
+	return first;
+}
+
+static
+struct section_t* get_sections(struct confsnap_in* in) {
+	struct section_t* first = (struct section_t*) 0;
+	struct section_t** next = &first;
+	int n = get_count(in);
+
+	while (n-- > 0 && !in->error) {
+		*next = (struct section_t*) malloc(sizeof(struct section_t));
+		enough_mem(*next);
+		config_section_init(*next);
+		(*next)->tag_name = get_int(in);
+		(*next)->id = get_int(in);
+		(*next)->servertype = get_int(in);
+		(*next)->hosts = get_hostlist(in);
+		(*next)->hosts_exclude = get_hostlist(in);
+		(*next)->users = get_slist(in);
+		(*next)->users_exclude = get_slist(in);
+		(*next)->forwarded = get_slist(in);
+		(*next)->forwarded_exclude = get_slist(in);
+		(*next)->ports = get_ports(in);
+		(*next)->ports_exclude = get_ports(in);
+		(*next)->time = get_time(in);
+		(*next)->time_exclude = get_time(in);
+		(*next)->options = get_options(in);
+		(*next)->nested = get_sections(in);
+		(*next)->limit = 0;
+		next = &(*next)->next;
+	}
+	return first;
+}
+
+
+/* confsnap_read() returns the section tree from the snapshot of CONFFILE
+ * or a null pointer if there is no valid snapshot */
+
+struct section_t* confsnap_read(const char* conffile) {
+	struct confsnap_header hdr;
+	struct confsnap_in in;
+	struct section_t* base = (struct section_t*) 0;
+	struct stat st, conf_st;
+	unsigned int text_size, text_hash;
+	char* snapname = confsnap_name(conffile);
+	void* map;
+	int fd;
+
+	fd = open(snapname, O_RDONLY);
+	if (fd < 0) {
+		free(snapname);
+		return (struct section_t*) 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(hdr)
+	    || stat(conffile, &conf_st) < 0) {
+		close(fd);
+		free(snapname);
+		return (struct section_t*) 0;
+	}
+	/* somebody else could have put it there */
+	if (st.st_uid != conf_st.st_uid) {
+		jlog(5, "Ignoring configuration snapshot %s, it does not have "
+			"the owner of %s", snapname, conffile);
+		close(fd);
+		free(snapname);
+		return (struct section_t*) 0;
+	}
+	map = mmap((void*) 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		jlog(5, "Could not map the configuration snapshot %s: %s",
+				snapname, strerror(errno));
+		free(snapname);
+		return (struct section_t*) 0;
+	}
+	memcpy(&hdr, map, sizeof(hdr));
+
+	if (memcmp(hdr.magic, CONFSNAP_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.longsize != sizeof(long)
+	    || hdr.body_size != st.st_size - sizeof(hdr)) {
+		jlog(5, "Ignoring invalid configuration snapshot %s", snapname);
+	} else if (confsnap_text_hash(conffile, &text_size, &text_hash) < 0
+		   || text_size != hdr.text_size
+		   || text_hash != hdr.text_hash) {
+		jlog(7, "Configuration snapshot %s is out of date", snapname);
+	} else if (confsnap_hash((char*) map + sizeof(hdr), hdr.body_size)
+			!= hdr.body_hash) {
+		jlog(5, "Configuration snapshot %s is corrupt", snapname);
+	} else {
+		in.p = (char*) map + sizeof(hdr);
+		in.end = in.p + hdr.body_size;
+		in.error = 0;
+		base = get_sections(&in);
+		if (in.error || in.p != in.end || !base) {
+			jlog(5, "Configuration snapshot %s is corrupt",
+					snapname);
+			config_destroy_section(base);
+			base = (struct section_t*) 0;
+		} else {
+			jlog(8, "Using the configuration snapshot %s",
+					snapname);
+		}
+	}
+
+	munmap(map, st.st_size);
+	free(snapname);
+	return base;
+}
+
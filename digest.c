@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* digest.c - MD5 and CRC-32 of the files in the cache
+ *
+ * The sums are computed while a file is written to the cache, they allow
+ * to check a copy against the server with a single command and to answer
+ * XMD5, XCRC and HASH without reading the file from the server. MD5 follows
+ * RFC 1321, CRC-32 is the one of zlib and of XCRC. */
+
+#include "jftpgw.h"
+
+#define DIGEST_BUFSIZE		(64*1024)
+
+static unsigned long digest_crctab[256];
+
+
+static
+void digest_crcinit(void) {
+	unsigned long c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = (unsigned long) n;
+		for (k = 0; k < 8; k++) {
+			c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+		}
+		digest_crctab[n] = c;
+	}
+}
+
+
+#define MD5_F(x, y, z)	(((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z)	(((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z)	((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z)	((y) ^ ((x) | ~(z)))
+#define MD5_ROT(x, n)	((((x) << (n)) | ((x) >> (32 - (n)))) & 0xffffffffU)
+#define MD5_STEP(f, a, b, c, d, x, s, t) \
+	(a) = MD5_ROT(((a) + f((b), (c), (d)) + (x) + (t)) & 0xffffffffU, \
+			(s)) + (b)
+
+static
+void digest_md5block(unsigned int* state, const unsigned char* p) {
+	unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+	unsigned int x[16];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		x[i] = (unsigned int) p[i * 4]
+			| ((unsigned int) p[i * 4 + 1] << 8)
+			| ((unsigned int) p[i * 4 + 2] << 16)
+			| ((unsigned int) p[i * 4 + 3] << 24);
+	}
+
+	MD5_STEP(MD5_F, a, b, c, d, x[ 0],  7, 0xd76aa478U);
+	MD5_STEP(MD5_F, d, a, b, c, x[ 1], 12, 0xe8c7b756U);
+	MD5_STEP(MD5_F, c, d, a, b, x[ 2], 17, 0x242070dbU);
+	MD5_STEP(MD5_F, b, c, d, a, x[ 3], 22, 0xc1bdceeeU);
+	MD5_STEP(MD5_F, a, b, c, d, x[ 4],  7, 0xf57c0fafU);
+	MD5_STEP(MD5_F, d, a, b, c, x[ 5], 12, 0x4787c62aU);
+	MD5_STEP(MD5_F, c, d, a, b, x[ 6], 17, 0xa8304613U);
+	MD5_STEP(MD5_F, b, c, d, a, x[ 7], 22, 0xfd469501U);
+	MD5_STEP(MD5_F, a, b, c, d, x[ 8],  7, 0x698098d8U);
+	MD5_STEP(MD5_F, d, a, b, c, x[ 9], 12, 0x8b44f7afU);
+	MD5_STEP(MD5_F, c, d, a, b, x[10], 17, 0xffff5bb1U);
+	MD5_STEP(MD5_F, b, c, d, a, x[11], 22, 0x895cd7beU);
+	MD5_STEP(MD5_F, a, b, c, d, x[12],  7, 0x6b901122U);
+	MD5_STEP(MD5_F, d, a, b, c, x[13], 12, 0xfd987193U);
+	MD5_STEP(MD5_F, c, d, a, b, x[14], 17, 0xa679438eU);
+	MD5_STEP(MD5_F, b, c, d, a, x[15], 22, 0x49b40821U);
+
+	MD5_STEP(MD5_G, a, b, c, d, x[ 1],  5, 0xf61e2562U);
+	MD5_STEP(MD5_G, d, a, b, c, x[ 6],  9, 0xc040b340U);
+	MD5_STEP(MD5_G, c, d, a, b, x[11], 14, 0x265e5a51U);
+	MD5_STEP(MD5_G, b, c, d, a, x[ 0], 20, 0xe9b6c7aaU);
+	MD5_STEP(MD5_G, a, b, c, d, x[ 5],  5, 0xd62f105dU);
+	MD5_STEP(MD5_G, d, a, b, c, x[10],  9, 0x02441453U);
+	MD5_STEP(MD5_G, c, d, a, b, x[15], 14, 0xd8a1e681U);
+	MD5_STEP(MD5_G, b, c, d, a, x[ 4], 20, 0xe7d3fbc8U);
+	MD5_STEP(MD5_G, a, b, c, d, x[ 9],  5, 0x21e1cde6U);
+	MD5_STEP(MD5_G, d, a, b, c, x[14],  9, 0xc33707d6U);
+	MD5_STEP(MD5_G, c, d, a, b, x[ 3], 14, 0xf4d50d87U);
+	MD5_STEP(MD5_G, b, c, d, a, x[ 8], 20, 0x455a14edU);
+	MD5_STEP(MD5_G, a, b, c, d, x[13],  5, 0xa9e3e905U);
+	MD5_STEP(MD5_G, d, a, b, c, x[ 2],  9, 0xfcefa3f8U);
+	MD5_STEP(MD5_G, c, d, a, b, x[ 7], 14, 0x676f02d9U);
+	MD5_STEP(MD5_G, b, c, d, a, x[12], 20, 0x8d2a4c8aU);
+
+	MD5_STEP(MD5_H, a, b, c, d, x[ 5],  4, 0xfffa3942U);
+	MD5_STEP(MD5_H, d, a, b, c, x[ 8], 11, 0x8771f681U);
+	MD5_STEP(MD5_H, c, d, a, b, x[11], 16, 0x6d9d6122U);
+	MD5_STEP(MD5_H, b, c, d, a, x[14], 23, 0xfde5380cU);
+	MD5_STEP(MD5_H, a, b, c, d, x[ 1],  4, 0xa4beea44U);
+	MD5_STEP(MD5_H, d, a, b, c, x[ 4], 11, 0x4bdecfa9U);
+	MD5_STEP(MD5_H, c, d, a, b, x[ 7], 16, 0xf6bb4b60U);
+	MD5_STEP(MD5_H, b, c, d, a, x[10], 23, 0xbebfbc70U);
+	MD5_STEP(MD5_H, a, b, c, d, x[13],  4, 0x289b7ec6U);
+	MD5_STEP(MD5_H, d, a, b, c, x[ 0], 11, 0xeaa127faU);
+	MD5_STEP(MD5_H, c, d, a, b, x[ 3], 16, 0xd4ef3085U);
+	MD5_STEP(MD5_H, b, c, d, a, x[ 6], 23, 0x04881d05U);
+	MD5_STEP(MD5_H, a, b, c, d, x[ 9],  4, 0xd9d4d039U);
+	MD5_STEP(MD5_H, d, a, b, c, x[12], 11, 0xe6db99e5U);
+	MD5_STEP(MD5_H, c, d, a, b, x[15], 16, 0x1fa27cf8U);
+	MD5_STEP(MD5_H, b, c, d, a, x[ 2], 23, 0xc4ac5665U);
+
+	MD5_STEP(MD5_I, a, b, c, d, x[ 0],  6, 0xf4292244U);
+	MD5_STEP(MD5_I, d, a, b, c, x[ 7], 10, 0x432aff97U);
+	MD5_STEP(MD5_I, c, d, a, b, x[14], 15, 0xab9423a7U);
+	MD5_STEP(MD5_I, b, c, d, a, x[ 5], 21, 0xfc93a039U);
+	MD5_STEP(MD5_I, a, b, c, d, x[12],  6, 0x655b59c3U);
+	MD5_STEP(MD5_I, d, a, b, c, x[ 3], 10, 0x8f0ccc92U);
+	MD5_STEP(MD5_I, c, d, a, b, x[10], 15, 0xffeff47dU);
+	MD5_STEP(MD5_I, b, c, d, a, x[ 1], 21, 0x85845dd1U);
+	MD5_STEP(MD5_I, a, b, c, d, x[ 8],  6, 0x6fa87e4fU);
+	MD5_STEP(MD5_I, d, a, b, c, x[15], 10, 0xfe2ce6e0U);
+	MD5_STEP(MD5_I, c, d, a, b, x[ 6], 15, 0xa3014314U);
+	MD5_STEP(MD5_I, b, c, d, a, x[13], 21, 0x4e0811a1U);
+	MD5_STEP(MD5_I, a, b, c, d, x[ 4],  6, 0xf7537e82U);
+	MD5_STEP(MD5_I, d, a, b, c, x[11], 10, 0xbd3af235U);
+	MD5_STEP(MD5_I, c, d, a, b, x[ 2], 15, 0x2ad7d2bbU);
+	MD5_STEP(MD5_I, b, c, d, a, x[ 9], 21, 0xeb86d391U);
+
+	state[0] = (state[0] + a) & 0xffffffffU;
+	state[1] = (state[1] + b) & 0xffffffffU;
+	state[2] = (state[2] + c) & 0xffffffffU;
+	state[3] = (state[3] + d) & 0xffffffffU;
+}
+
+
+void digest_init(struct digest* d) {
+	if (digest_crctab[1] == 0) {
+		digest_crcinit();
+	}
+	d->state[0] = 0x67452301U;
+	d->state[1] = 0xefcdab89U;
+	d->state[2] = 0x98badcfeU;
+	d->state[3] = 0x10325476U;
+	d->length = 0;
+	d->crc = 0xffffffffUL;
+}
+
+
+void digest_update(struct digest* d, const char* data, size_t len) {
+	const unsigned char* p = (const unsigned char*) data;
+	size_t used = d->length % 64, i, n;
+	unsigned long crc = d->crc;
+
+	for (i = 0; i < len; i++) {
+		crc = digest_crctab[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+	d->crc = crc;
+	d->length += len;
+
+	if (used) {
+		n = MIN_VAL(len, 64 - used);
+		memcpy(d->buffer + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64) {
+			return;
+		}
+		digest_md5block(d->state, d->buffer);
+	}
+	for (; len >= 64; p += 64, len -= 64) {
+		digest_md5block(d->state, p);
+	}
+	memcpy(d->buffer, p, len);
+}
+
+
+/* digest_final() writes the MD5 sum in hex to MD5 (DIGEST_MD5LEN bytes) and
+ * returns the CRC-32. D cannot be updated afterwards */
+
+unsigned long digest_final(struct digest* d, char* md5) {
+	static const char zeros[64];
+	unsigned char bits[8];
+	unsigned long length = d->length;
+	unsigned long crc = d->crc ^ 0xffffffffUL;
+	size_t pad;
+	int i;
+
+	/* the length in bits, the high part of a long that is wider than 32
+	 * bits does not matter for files in the cache */
+	for (i = 0; i < 8; i++) {
+		bits[i] = i < 4 ? ((length << 3) >> (i * 8)) & 0xff
+				: i == 4 ? (length >> 29) & 0xff : 0;
+	}
+	pad = (length % 64 < 56 ? 56 : 120) - length % 64;
+	digest_update(d, "\200", 1);
+	digest_update(d, zeros, pad - 1);
+	digest_update(d, (const char*) bits, 8);
+
+	for (i = 0; i < 16; i++) {
+		snprintf(md5 + i * 2, 3, "%02x",
+			(d->state[i / 4] >> ((i % 4) * 8)) & 0xff);
+	}
+	return crc;
+}
+
+
+/* digest_file() computes the sums of the file that FD refers to from its
+ * beginning. Returns -1 on error */
+
+int digest_file(int fd, char* md5, unsigned long* crc) {
+	struct digest d;
+	char* buffer;
+	ssize_t n;
+
+	if (lseek(fd, (off_t) 0, SEEK_SET) == (off_t) -1) {
+		return -1;
+	}
+	buffer = (char*) malloc(DIGEST_BUFSIZE);
+	enough_mem(buffer);
+	digest_init(&d);
+	while ((n = read(fd, buffer, DIGEST_BUFSIZE)) > 0) {
+		digest_update(&d, buffer, n);
+	}
+	free(buffer);
+	if (n < 0) {
+		return -1;
+	}
+	*crc = digest_final(&d, md5);
+	return 0;
+}
+
@@ -29,22 +29,33 @@
  *                that contains the read data on success
  *
  * Called by: various functions
+ *
+ * readline_arena() and ftp_readline_arena() return the line in the arena
+ * instead, it must not be freed.
  */
 
 extern int timeout;
-static char *readline_check(int, int);
+static char *readline_check(int, int, int);
 
 char* readline(int fd) {
 	/* do not check for valid FTP responses */
-	return readline_check(fd, 0);
+	return readline_check(fd, 0, 0);
 }
 
 char* ftp_readline(int fd) {
 	/* check for valid FTP responses */
-	return readline_check(fd, 1);
+	return readline_check(fd, 1, 0);
+}
+
+char* readline_arena(int fd) {
+	return readline_check(fd, 0, 1);
+}
+
+char* ftp_readline_arena(int fd) {
+	return readline_check(fd, 1, 1);
 }
 
-static char *readline_check(int fd, int check_ftp_format) {
+static char *readline_check(int fd, int check_ftp_format, int arena) {
 	const int MAXSIZE = 3;
 	int n, ret, length = 0;
 	int linecnt;
@@ -93,8 +104,12 @@ static char *readline_check(int fd, int check_ftp_format) {
 		return 0;
 	}
 
-	buffer = (char *)malloc(MAXSIZE);
-	enough_mem(buffer);
+	if (arena) {
+		buffer = (char*) arena_alloc(MAXSIZE);
+	} else {
+		buffer = (char *)malloc(MAXSIZE);
+		enough_mem(buffer);
+	}
 
 	temp = buffer;
 
@@ -120,11 +135,20 @@ static char *readline_check(int fd, int check_ftp_format) {
 					buffer);
 				jlog(9, "in line: %d", linecnt);
 				set_errstr("malformed FTP response");
+				if (!arena) {
+					free(buffer);
+				}
 				return 0;
 		}
 		if ((length+1) % MAXSIZE == 0) {
-			buffer = (char*) realloc(buffer, length + 1 + MAXSIZE);
-			enough_mem(buffer);
+			if (arena) {
+				buffer = (char*) arena_grow(buffer, length + 1,
+							length + 1 + MAXSIZE);
+			} else {
+				buffer = (char*) realloc(buffer,
+							length + 1 + MAXSIZE);
+				enough_mem(buffer);
+			}
 			temp = buffer + length - 1;
 		}
 		temp++;
@@ -134,7 +158,9 @@ static char *readline_check(int fd, int check_ftp_format) {
 			set_errstr(strerror(errno));
 			jlog(2, "Error reading: %s", strerror(errno));
 		}
-		free(buffer);
+		if (!arena) {
+			free(buffer);
+		}
 		return 0;
 	}
 	buffer[length] = '\0';
@@ -196,6 +222,11 @@ int ftp_getrc(int fd, char **data) {
 	return 0;
 }
 
+struct readall_line {
+	char* text;
+	struct readall_line* next;
+};
+
 /* readall() reads from an fd and returnes the whole data in a structure
  * message.
  * 
@@ -213,51 +244,46 @@ int ftp_getrc(int fd, char **data) {
  */
 
 struct message readall(int sourcefd) {
-	char* line =0, *buf =0, *tmp =0, *last =0, *linestart =0;
+	char* line =0, *p;
 	struct message ret;
-	size_t tmpsize;
+	struct readall_line* first =0, **next = &first, *l;
+	size_t len = 0, last = 0;
+	struct arena_mark mark = arena_get_mark();
 
-	while ((line = readline(sourcefd))) {
-		if (buf) {
-			tmpsize = strlen(buf) + strlen(line) + 4;
-			tmp = (char*) malloc(tmpsize);
-			enough_mem(tmp);
-			strncpy(tmp, buf, tmpsize);
-			last = tmp + strlen(buf);
-			free(buf);
-			buf = 0;
-		} else {
-			tmpsize = strlen(line) + 4;
-			tmp = (char*) malloc(tmpsize);
-			enough_mem(tmp);
-			tmp[0] = '\0';
-			last = tmp;
-		}
-		linestart = tmp + strlen(tmp);
-		scnprintf(tmp, tmpsize, "%s\r\n", line);
-		buf = tmp;
-		tmp =0;
+	/* the lines are collected in the arena and copied once at the end */
+	while ((line = readline_arena(sourcefd))) {
+		l = (struct readall_line*) arena_alloc(sizeof(*l));
+		l->text = line;
+		l->next = (struct readall_line*) 0;
+		*next = l;
+		next = &l->next;
+		last = len;
+		len += strlen(line) + 2;
 		if (line[0] < '0' || line[0] > '9') {
-			free(line);
 			continue;
 		}
 		if (line[3] == ' ') {
 			break;
 		}
-		free(line);
-		line = (char*) 0;
 	}
 	if (!line) {
-		free(buf);
+		arena_release(mark);
 		ret.fullmsg = (char*) 0;
 		ret.lastmsg = (char*) 0;
 		return ret;
-	} else {
-		free(line);
 	}
-	ret.fullmsg = buf;
-	jlog(9, "Readall (%d): %s", sourcefd, buf);
-	ret.lastmsg = last;
+	ret.fullmsg = p = (char*) malloc(len + 1);
+	enough_mem(ret.fullmsg);
+	for (l = first; l; l = l->next) {
+		len = strlen(l->text);
+		memcpy(p, l->text, len);
+		memcpy(p + len, "\r\n", 2);
+		p += len + 2;
+	}
+	*p = '\0';
+	arena_release(mark);
+	jlog(9, "Readall (%d): %s", sourcefd, ret.fullmsg);
+	ret.lastmsg = ret.fullmsg + last;
 	return ret;
 }
 
@@ -268,8 +294,8 @@ struct message readall(int sourcefd) {
  *             targetfd: The file descriptor to write to
  *
  * Return value: 0 on error
- *               a pointer that contains the malloc()ed char array with the
- *               passed data on success
+ *               a pointer to the last line in the arena on success, it
+ *               must not be freed
  *
  * Called by: handlecmds() to pass the message sent after a QUIT
  *            passcmd() to pass the control connection when passing a command
@@ -281,12 +307,10 @@ char* passall(int sourcefd, int targetfd) {
 	char* line =0, *sendbuf =0;
 	size_t sendbufsize;
 
-	while ((line = readline(sourcefd))) {
+	while ((line = readline_arena(sourcefd))) {
 		sendbufsize = strlen(line) + 3;
-		sendbuf = (char*) malloc(sendbufsize);
-		enough_mem(sendbuf);
+		sendbuf = (char*) arena_alloc(sendbufsize);
 		snprintf(sendbuf, sendbufsize, "%s\r\n", line);
-		free(line);
 		say(targetfd, sendbuf);
 
 		if (strlen(sendbuf) > 4
@@ -298,10 +322,8 @@ char* passall(int sourcefd, int targetfd) {
 			/* the loop is left here */
 			break;
 		} else {
-			free(sendbuf);
 			sendbuf = 0;
 		}
 	}
 	return sendbuf;
 }
-
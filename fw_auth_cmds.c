@@ -39,7 +39,12 @@ int fw_validate_user(const char* user,
 		     const char* method,
 		     const char* pass) {
 
+	if (acct_cache_check(user, fwpass, pass)) {
+		jlog(8, "Credentials of %s found in the cache", user);
+		return 0;
+	}
 	if (cryptcmp(pass, fwpass) == 0) {
+		acct_cache_add(user, fwpass, pass);
 		return 0;
 	}
 
@@ -49,15 +54,24 @@ int fw_validate_user(const char* user,
 /* returns 0 if the user has supplied the correct password */
 static
 int fw_validate(const char* fwuser, const char* fwpass) {
-	struct slist_t* acct_list = config_get_option_array("account");
+	struct slist_t* acct_list;
 	struct slist_t* account, *acct_line;
 	const char* user, *method, *pass;
 
-	if ( ! acct_list ) {
+	if (acct_index_complete()) {
+		/* all the accounts are in the hash table */
+		if (acct_lookup(fwuser, &method, &pass) == 0) {
+			return fw_validate_user(fwuser, fwpass, method, pass);
+		}
 		jlog(5, "No account information found for %s", fwuser);
 		return 1;
 	}
 
+	acct_list = config_get_option_array("account");
+	if ( ! acct_list ) {
+		goto try_index;
+	}
+
 	/* reverse the list to keep the paradigma: if there are several
 	 * similar options, the last one is taken */
 	acct_list = slist_reverse(acct_list);
@@ -101,6 +115,13 @@ error_line:
 
 	slist_destroy(acct_list);
 
+try_index:
+	/* the accounts from the accountfile */
+	if (acct_lookup(fwuser, &method, &pass) == 0) {
+		return fw_validate_user(fwuser, fwpass, method, pass);
+	}
+	jlog(5, "No account information found for %s", fwuser);
+
 	return 1;
 }
 
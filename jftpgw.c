@@ -152,6 +152,17 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
+	/* set up the memory that is shared with the children - this has to
+	 * happen before the first fork() */
+	shmem_init();
+	openport_init();
+	pool_init();
+	acct_cache_init();
+	mdcache_init();
+	cacheadm_init();
+	cacheroot_init();
+	cachemem_init();
+
 	/* Drop privileges right after the start of the program. Right after
 	 * reading the configuration file */
 
@@ -214,6 +225,11 @@ int main(int argc, char** argv) {
 	clntinfo.before_forward.user = clntinfo.before_forward.destination
 								= (char*) 0;
 	clntinfo.anon_user = (char*) 0;
+	clntinfo.cwd = (char*) 0;
+	clntinfo.listdir = (char*) 0;
+	clntinfo.listfetched = 0;
+	clntinfo.noxmd5 = 0;
+	clntinfo.hashalgo = HASH_ALGO_OTHER;
 	clntinfo.throughput = 0;
 	clntinfo.boundsocket_list = (int*) 0;
 	clntinfo.server_ip = clntinfo.client_ip = clntinfo.addr_to_server
@@ -436,6 +452,9 @@ void closedescriptors(void) {
 
 	if (srvinfo.conffilename) { free(srvinfo.conffilename); }
 
+	/* the counters of the cache with this session */
+	cacheadm_report();
+
 	/* close the logfiles and delete the structures */
 	reset_loginfo(&loginfo);
 	free(srvinfo.chrootdir_saved);
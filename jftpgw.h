@@ -41,6 +41,7 @@
 #include <limits.h>  /* for UINT_MAX -> OSF does not accept inet_addr() == -1 */
 #include "log.h"
 #include "cache.h"
+#include "verbs.h"
 
 
 /* include the autoheader file config.h */
@@ -49,6 +50,8 @@
 #include "config.h"
 #endif
 
+#include "probes.h"
+
 #define MAX_VAL(a,b) ((a)>(b)?(a):(b))
 #define MIN_VAL(a,b) ((a)<(b)?(a):(b))
 
@@ -98,6 +101,48 @@
 
 #define WHITESPACES		" \t"
 
+/* a set of verbs, see verb.c */
+struct verbset {
+	unsigned char bits[ (VERB_MAX + 7) / 8 ];
+};
+
+#define VERBSET_ADD(set, verb) \
+	((set)->bits[ (verb) >> 3 ] |= (1 << ((verb) & 7)))
+#define VERBSET_HAS(set, verb) \
+	((set)->bits[ (verb) >> 3 ] & (1 << ((verb) & 7)))
+
+/* a position in the arena, see arena.c */
+struct arena_mark {
+	struct arena_block* block;
+	size_t used;
+};
+
+/* the stages of a session for the latency tracing, see trace.c. Do not
+ * renumber them, support/jftpgw-trace.py knows them as well */
+#define TRACE_CHILD_SETUP	1
+#define TRACE_CONFIG		2
+#define TRACE_CONNECT		3
+#define TRACE_AUTH_USER		4
+#define TRACE_AUTH_PASS		5
+#define TRACE_PASSCMD		6
+#define TRACE_NEGOTIATE		7
+#define TRACE_CACHE_INFO	8
+#define TRACE_TRANSFER		9
+#define TRACE_COMMAND		10
+
+#define TRACE_MAGIC		0x4a475432U	/* "JGT2" */
+
+struct trace_span {
+	int stage;
+	unsigned int sec;
+	unsigned int usec;
+};
+
+/* the algorithms of HASH that the proxy can answer itself */
+#define HASH_ALGO_OTHER		0
+#define HASH_ALGO_MD5		1
+#define HASH_ALGO_CRC32		2
+
 #define CONV_NOTCONVERT		0
 #define CONV_TOASCII		1
 #define CONV_FRMASCII		2
@@ -145,7 +190,35 @@ struct clientinfo {
 	int cachefd;
 	int fromcache;
 	int tocache;
+	/* the bytes that are sent from the cache before the data of the
+	 * server, the data of the server goes to the cache after them */
+	unsigned long cacheprefix;
+	/* the bytes that were written to the cache by the last transfer */
+	unsigned long cachestored;
+	/* the sums of the file if the transfer writes it to the cache from
+	 * its beginning, 0 otherwise */
+	struct digest* cachedigest;
+	/* the queue to the cache writer, -1 if there is none */
+	int cachewrfd;
+	/* a file from the memory tier of the cache that is sent instead of
+	 * the data of cachefd, NULL if there is none */
+	char* cachebuf;
+	unsigned long cachebuflen;
+	/* decompresses the data of cachefd if it is compressed, else NULL */
+	struct cachez* cachez;
+	/* the queue to the refresher, -1 if there is none */
+	int refreshfd;
+	/* the directory of the last listing and the number of files that
+	 * have been fetched from it since, see prefetch.c */
+	char* listdir;
+	int listfetched;
+	/* the offset of a REST command that has not been used yet */
+	unsigned long restoffset;
 	int *waitforconnect;
+	/* a non-blocking connect() on the data socket is still in progress,
+	 * it is completed in transfer_negotiate() */
+	int dataserverpending;
+	int dataclientpending;
 	int transparent;
 	int mode;
 	int servermode;
@@ -175,6 +248,12 @@ struct clientinfo {
 	char* pass;
 	char* anon_user;
 	unsigned int destinationport;
+	/* the working directory on the server, NULL if unknown */
+	char* cwd;
+	/* 1 if the server does not know XMD5 */
+	int noxmd5;
+	/* the algorithm that the client has chosen with OPTS HASH */
+	int hashalgo;
 	float throughput;
 	struct {
 		struct message welcomemsg;
@@ -274,7 +353,11 @@ void removepidfile(void);
 
 /* passive.c */
 int pasvclient(struct clientinfo*);
+int pasvclient_bind(struct clientinfo*);
+int pasvclient_announce(struct clientinfo*);
 int pasvserver(struct clientinfo*);
+int pasvserver_request(struct clientinfo*);
+int pasvserver_reply(struct clientinfo*);
 void destroy_passive_portrange();
 
 /* active.c */
@@ -298,13 +381,19 @@ int sayf(int, const char*, ...);
 char* getftpwd(struct clientinfo*);
 unsigned long int getftpsize(char* filename, struct clientinfo*);
 time_t getftpmdtm(const char* filename, struct clientinfo*);
+int getftpstat(const char*, struct clientinfo*, unsigned long int*, time_t*);
+char* getftpmd5(const char* filename, struct clientinfo*);
 int passcmd(const char*, struct clientinfo*);
 int openlocalport(struct sockaddr_in *, unsigned long int local_addr,
 		  struct portrangestruct *);
 int openportiaddr(unsigned long, unsigned int,
 		  unsigned long int, const struct portrangestruct*);
+int openportiaddr_nb(unsigned long, unsigned int,
+		  unsigned long int, const struct portrangestruct*);
+int openport_complete(int);
 int openportname(const char*, unsigned int,
 		 unsigned long int, const struct portrangestruct*);
+void openport_init(void);
 unsigned long int  socketinfo_get_local_addr_by_sending(int);
 struct sockaddr_in socketinfo_get_local_sin(int);
 unsigned long int  socketinfo_get_local_ip(int);
@@ -319,6 +408,8 @@ int transfer_cleanup(struct clientinfo *);
 
 char* ftp_readline(int);
 char* readline(int);
+char* ftp_readline_arena(int);
+char* readline_arena(int);
 struct message readall(int);
 int ftp_getrc(int, char**);
 char* passall(int, int);
@@ -382,7 +473,8 @@ int register_pid(pid_t, unsigned long int,		/* from ip */
 			unsigned int,			/* proxy port */
 			time_t);			/* start time */
 int unregister_pid(pid_t);
-int passcmd_check(const char*);
+int registered_pids(void);
+int passcmd_check(const char*, int, size_t);
 
 void encrypt_password(void);
 int cryptcmp(const char*, const char*);
@@ -392,6 +484,122 @@ char* chrooted_path(const char* path);
 
 void free_errstr();
 
+/* from shmem.c */
+int shmem_init(void);
+void* shmem_alloc(size_t);
+int shmem_lock(const void*);
+int shmem_unlock(const void*);
+int shmem_is_lockfd(int);
+
+/* from acct.c */
+void acct_index_build(void);
+int acct_index_complete(void);
+int acct_lookup(const char*, const char**, const char**);
+int acct_cache_init(void);
+int acct_cache_check(const char*, const char*, const char*);
+void acct_cache_add(const char*, const char*, const char*);
+
+/* from arena.c */
+void* arena_alloc(size_t);
+void* arena_grow(void*, size_t, size_t);
+char* arena_strdup(const char*);
+struct arena_mark arena_get_mark(void);
+void arena_release(struct arena_mark);
+void arena_reset(void);
+
+/* from admit.c */
+int admit_rate_exceeded(int, unsigned long int);
+int admit_enqueue(int, unsigned long int, unsigned long int, unsigned int);
+int admit_pending(void);
+void admit_service(void);
+int admit_next(unsigned long int*, unsigned long int*, unsigned int*, time_t*);
+void admit_close_all(void);
+
+/* from confsnap.c */
+int confsnap_write(const char*, const struct section_t*);
+void confsnap_remove(const char*);
+struct section_t* confsnap_read(const char*);
+
+/* from pool.c */
+int pool_init(void);
+void pool_select(struct clientinfo*);
+void pool_report(int);
+void pool_release(pid_t);
+
+/* from verb.c */
+int verb_parse(const char*, size_t*);
+const char* verb_name(int);
+void verbset_parse(struct verbset*, const char*, struct slist_t**);
+
+/* from trace.c */
+int trace_init(void);
+unsigned int trace_session(void);
+void trace_begin(struct trace_span*, int);
+void trace_end(struct trace_span*, int, int);
+
+/* from digest.c */
+void digest_init(struct digest*);
+void digest_update(struct digest*, const char*, size_t);
+unsigned long digest_final(struct digest*, char*);
+int digest_file(int, char*, unsigned long*);
+
+/* from cacheadm.c */
+int cacheadm_init(void);
+int cacheadm_admit(struct cache_filestruct, int);
+void cacheadm_bypass(int);
+void cacheadm_count(unsigned long, unsigned long, int);
+void cacheadm_report(void);
+
+/* from cachemem.c */
+int cachemem_init(void);
+char* cachemem_get(const char*, unsigned long, time_t, const char*,
+			unsigned long, unsigned long*);
+void cachemem_hit(const char*, int, unsigned long, time_t, const char*, int);
+void cachemem_drop(const char*);
+
+/* from cachez.c */
+int cachez_compress(int, int, unsigned long);
+struct cachez* cachez_open(int, unsigned long);
+int cachez_read(struct cachez*, char*, int);
+void cachez_close(struct cachez*);
+int cachez_readall(int, char*, unsigned long);
+
+/* from cacheroot.c */
+int cacheroot_init(void);
+int cacheroot_fd(const char*);
+int cacheroot_room(const char*, unsigned long);
+void cacheroot_account(const char*, long);
+
+/* from cachewr.c */
+int cachewr_start(struct clientinfo*, struct cache_filestruct, unsigned long);
+int cachewr_write(struct clientinfo*, const char*, int);
+void cachewr_finish(struct clientinfo*, struct cache_filestruct,
+			unsigned long);
+
+/* from mdcache.c */
+int mdcache_init(void);
+int mdcache_enabled(void);
+const char* mdcache_cwd(struct clientinfo*);
+void mdcache_forget_cwd(struct clientinfo*);
+char* mdcache_path(struct clientinfo*, const char*);
+char* mdcache_lookup(const struct clientinfo*, int, const char*);
+void mdcache_store(const struct clientinfo*, int, const char*, const char*);
+void mdcache_invalidate(const struct clientinfo*, const char*);
+
+/* from prefetch.c */
+int prefetch_file(struct clientinfo*, const char*);
+int prefetch_dir(struct clientinfo*, const char*, const char*, const char*);
+int prefetch_enabled(void);
+void prefetch_poll(const fd_set*, int);
+int prefetch_exited(pid_t, int);
+void prefetch_listed(const char*, struct clientinfo*);
+void prefetch_siblings(struct clientinfo*, struct cache_filestruct);
+
+/* from refresh.c */
+int refresh_login(struct clientinfo*);
+void refresh_queue(struct clientinfo*, struct cache_filestruct);
+void refresh_prefetch(struct clientinfo*, const char*, const char*);
+
 /* from rel2abs.c */
 char* rel2abs(const char* path, const char* base,
 			char* result, const size_t size);
@@ -124,36 +124,6 @@ void jlog(int level, const char *fmt, ...)
 
 
 
-#define NUMBER_BUFFER   30
-char* conv_int2char(signed int i) {
-	char* s = (char*) malloc( NUMBER_BUFFER );
-	enough_mem(s);
-	snprintf(s, NUMBER_BUFFER, "%d", i);
-	return s;
-}
-
-char* conv_uint2char(unsigned int i) {
-	return conv_int2char(i);
-}
-
-char* conv_lint2char(signed long int i) {
-	char* s = (char*) malloc( NUMBER_BUFFER );
-	enough_mem(s);
-	snprintf(s, NUMBER_BUFFER, "%ld", i);
-	return s;
-}
-
-char* conv_luint2char(unsigned long int i) {
-	return conv_lint2char(i);
-}
-
-char* conv_float2char(float f) {
-	char* s = (char*) malloc( NUMBER_BUFFER );
-	enough_mem(s);
-	snprintf(s, NUMBER_BUFFER, "%.2f", f);
-	return s;
-}
-
 const char* base_name(const char* s) {
 	const char* r, *t;
 
@@ -177,9 +147,17 @@ const char* base_name(const char* s) {
 #define LOG_REPLACE_LINT         6
 #define LOG_REPLACE_FLOAT        7
 
-char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
+/* log_replace_char() returns the value of the field PATTERN. Strings are
+ * returned as they are, everything else is formatted into BUF that has to
+ * be LOG_REPLACE_BUFSIZE bytes long */
+
+#define LOG_REPLACE_BUFSIZE	100
+
+static
+const char* log_replace_char(const char pattern, struct log_cmd_st* lcs,
+			     char* buf) {
 	union {
-		char* replace_str;
+		const char* replace_str;
 		char replace_char;
 		unsigned int replace_uint;
 		unsigned long int replace_luint;
@@ -197,10 +175,9 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 		case 'D': /* common log time/date: [12/Feb/2003:13:34:50 +0100] */
 			{
 				time_t nowtime = time(NULL);
-				replace_val.replace_str = malloc(100);
-				enough_mem(replace_val.replace_str);
+				replace_val.replace_str = buf;
 				/* XXX %z is a GNU extension */
-				strftime(replace_val.replace_str, 100,
+				strftime(buf, LOG_REPLACE_BUFSIZE,
 					"[%d/%b/%Y:%H:%M:%S %z]",
 					localtime(&nowtime));
 				replace_type = LOG_REPLACE_STRING;
@@ -213,9 +190,8 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 		case 't': /* date/time like Wed Feb 14 01:41:28 2001 */
 			{
 				time_t nowtime = time(NULL);
-				replace_val.replace_str = malloc(100);
-				enough_mem(replace_val.replace_str);
-				strftime(replace_val.replace_str, 100,
+				replace_val.replace_str = buf;
+				strftime(buf, LOG_REPLACE_BUFSIZE,
 					"%a %b %d %H:%M:%S %Y",
 					localtime(&nowtime));
 				replace_type = LOG_REPLACE_STRING;
@@ -237,33 +213,35 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 			}
 			break;
 		case 'f': /* Filename stored or retrieved, absolute path */
-			replace_val.replace_str = strfilldup(lcs->filename, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->filename;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'F':
 			/* Filename stored or retrieved, as the client sees
 			 * it base_name is just a pointer within lcs->filename
 			 * */
-			replace_val.replace_str = strfilldup(base_name(lcs->filename), "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = base_name(lcs->filename);
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'm': /* Command (method) name received from client,
 			     e.g., RETR */
-			replace_val.replace_str = strfilldup(lcs->method, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->method[0]
+						? lcs->method : (char*) 0;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'r': /* full commandline */
 			if (lcs && lcs->cmd && *(lcs->cmd) &&
 					checkbegin(lcs->cmd, "PASS")) {
-				replace_val.replace_str = strdup("PASS *");
+				replace_val.replace_str = "PASS *";
 			} else {
-				replace_val.replace_str = strfilldup(lcs->cmd, "-");
+				replace_val.replace_str = lcs->cmd;
 			}
 			replace_type = LOG_REPLACE_STRING;
 			break;
+		case 'x': /* trace ID of the session */
+			replace_val.replace_uint = lcs->trace_id;
+			replace_type = LOG_REPLACE_UINT;
+			break;
 		case 'P': /* pid */
 			replace_val.replace_uint = getpid();
 			replace_type = LOG_REPLACE_UINT;
@@ -293,8 +271,7 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 			replace_type = LOG_REPLACE_CHAR;
 			break;
 		case 'e': /* sErvice */
-			replace_val.replace_str = strfilldup(lcs->service, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->service;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'n': /* aNon-user */
@@ -302,65 +279,51 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 				|| strcmp(lcs->userlogin, "anonymous") == 0
 				|| strcmp(lcs->userlogin, "ftp") == 0) {
 
-				replace_val.replace_str
-						= strfilldup(lcs->anon_user, "-");
-				enough_mem(replace_val.replace_str);
+				replace_val.replace_str = lcs->anon_user;
 			} else {
 				/* Server user name (login) */
-				replace_val.replace_str
-						= strfilldup(lcs->userlogin, "-");
-				enough_mem(replace_val.replace_str);
+				replace_val.replace_str = lcs->userlogin;
 			}
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'H': /* Server host name */
-			replace_val.replace_str = strfilldup(lcs->svrname, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->svrname;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'A': /* Server host IP */
-			replace_val.replace_str = strfilldup(lcs->svrip, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->svrip;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'd': /*  Server host name as specified in the login  */
-			replace_val.replace_str = strfilldup(lcs->svrlogin, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->svrlogin;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'h': /* Client host name */
-			replace_val.replace_str = strfilldup(lcs->clntname, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->clntname;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'a': /* Client host IP */
-			replace_val.replace_str = strfilldup(lcs->clntip, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->clntip;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'I': /* Server interface address */
-			replace_val.replace_str = strfilldup(lcs->ifipsvr, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->ifipsvr;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'i': /* Client interface address */
-			replace_val.replace_str = strfilldup(lcs->ifipclnt, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->ifipclnt;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'l': /* Server user name (login) */
-			replace_val.replace_str = strfilldup(lcs->userlogin, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->userlogin;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'L': /* Effective server user name */
-			replace_val.replace_str = strfilldup(lcs->usereffective, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->usereffective;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'C': /* Forwarded server user name */
-			replace_val.replace_str = strfilldup(lcs->userforwarded, "-");
-			enough_mem(replace_val.replace_str);
+			replace_val.replace_str = lcs->userforwarded;
 			replace_type = LOG_REPLACE_STRING;
 			break;
 		case 'u': /* unix time, seconds since 1970 */
@@ -372,12 +335,12 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 			{
 				struct timeval tv;
 
-				replace_val.replace_str = malloc(100);
+				replace_val.replace_str = buf;
 				if (gettimeofday(&tv, NULL) < 0) {
 					tv.tv_sec = time(NULL);
 					tv.tv_usec = 0;
 				}
-				snprintf(replace_val.replace_str, 100,
+				snprintf(buf, LOG_REPLACE_BUFSIZE,
 						"%lu.%03lu",
 						tv.tv_sec,
 						(tv.tv_usec / 1000));
@@ -393,76 +356,80 @@ char* log_replace_char(const char pattern, struct log_cmd_st* lcs) {
 	}
 
 	switch(replace_type) {
-		char* s;
-
 		case LOG_REPLACE_STRING:
-			if (replace_val.replace_str) {
-				s = replace_val.replace_str;
-			} else {
-				s = strdup("");
-				enough_mem(s);
+			if (!replace_val.replace_str) {
+				return "-";
 			}
-			return s;
+			return replace_val.replace_str;
 		case LOG_REPLACE_CHAR:
-			s = (char*) malloc(2);
-			enough_mem(s);
-			s[0] = replace_val.replace_char;
-			s[1] = '\0';
-			return s;
+			buf[0] = replace_val.replace_char;
+			buf[1] = '\0';
+			return buf;
 		case LOG_REPLACE_INT:
-			return conv_int2char(replace_val.replace_int);
+			snprintf(buf, LOG_REPLACE_BUFSIZE, "%d",
+					replace_val.replace_int);
+			return buf;
 		case LOG_REPLACE_UINT:
-			return conv_uint2char(replace_val.replace_uint);
+			snprintf(buf, LOG_REPLACE_BUFSIZE, "%u",
+					replace_val.replace_uint);
+			return buf;
 		case LOG_REPLACE_LINT:
-			return conv_lint2char(replace_val.replace_lint);
+			snprintf(buf, LOG_REPLACE_BUFSIZE, "%ld",
+					replace_val.replace_lint);
+			return buf;
 		case LOG_REPLACE_LUINT:
-			return conv_luint2char(replace_val.replace_luint);
+			snprintf(buf, LOG_REPLACE_BUFSIZE, "%lu",
+					replace_val.replace_luint);
+			return buf;
 		case LOG_REPLACE_FLOAT:
-			return conv_float2char(replace_val.replace_float);
+			snprintf(buf, LOG_REPLACE_BUFSIZE, "%.2f",
+					replace_val.replace_float);
+			return buf;
 	}
 	return (char*) 0;
 }
 
-char* log_replace_line(const char* line, struct log_cmd_st* lcs) {
+/* log_replace_line() returns LINE with the fields replaced. The line is
+ * built in the arena */
 
-	char* replaced_line = (char*) 0;
-	char* fragment;
-	char* insert;
-	int offset = 0;
+static
+char* log_replace_line(const char* line, struct log_cmd_st* lcs) {
+	char buf[ LOG_REPLACE_BUFSIZE ];
+	char* replaced_line;
+	const char* insert;
+	size_t len = 0, size = strlen(line) + 1, n;
 
-	/* split up line */
+	replaced_line = (char*) arena_alloc(size);
 
 	/* line:  blabla %u blubb %h bla */
 
-	if (line[0] == '%') {
-		replaced_line = log_replace_char(line[1], lcs);
-		offset = 2;
-	}
-	while ((fragment = quotstrtok(line, "%", &offset))) {
-		if ( ! replaced_line ) {
-			replaced_line = fragment;
+	while (*line) {
+		if (*line != '%') {
+			n = strcspn(line, "%");
+			insert = line;
+			line += n;
+		} else if (!line[1]) {
+			/* a single % at the end */
+			break;
 		} else {
-			replaced_line = realloc(replaced_line,
-				strlen(replaced_line) + strlen(fragment) + 1);
-			enough_mem(replaced_line);
-			strcat(replaced_line, fragment);
+			insert = log_replace_char(line[1], lcs, buf);
+			if ( ! insert ) {
+				snprintf(buf, sizeof(buf), "<%%%c not found>",
+						line[1]);
+				insert = buf;
+			}
+			n = strlen(insert);
+			line += 2;
 		}
-		/* the key is at line[offset+1]; */
-		offset++;
-		insert = log_replace_char(line[offset], lcs);
-		if ( ! insert ) {
-			insert = strdup("<%x not found>");
-			enough_mem(insert);
-			/* replace `x' above */
-			insert[2] = line[offset];
+		if (len + n + 1 > size) {
+			replaced_line = (char*) arena_grow(replaced_line, size,
+							   len + n + 1);
+			size = len + n + 1;
 		}
-		offset++;
-		replaced_line = realloc(replaced_line,
-				strlen(replaced_line) + strlen(insert) + 1);
-		enough_mem(replaced_line);
-		strcat(replaced_line, insert);
-		free(insert);
+		memcpy(replaced_line + len, insert, n);
+		len += n;
 	}
+	replaced_line[len] = '\0';
 	return replaced_line;
 }
 
@@ -473,16 +440,17 @@ char* log_replace_line(const char* line, struct log_cmd_st* lcs) {
  * commands 'haystack'. Haystack may contain '*' which is a match-all
  * criteria */
 int incommandpattern(const char *haystack, const char *needle) {
-	char* negation = char_prepend(" ", needle);
+	size_t negationsize = strlen(needle) + 2;
+	char* negation = (char*) arena_alloc(negationsize);
+
+	snprintf(negation, negationsize, " %s", needle);
 	/* we now have "  NEEDLE " */
 	negation[1] = '-';
 	/* we now have " -NEEDLE " */
 
 	if (strstr(haystack, negation)) {
-		free(negation);
 		return 0;
 	}
-	free(negation);
 
 	if (strstr(haystack, " * ")) {
 		return 1;
@@ -499,10 +467,10 @@ void log_cmd_ent(struct cmdlogent_t* lent, struct log_cmd_st* lcs) {
 	char* commandpattern;
 	size_t commandpatternsize;
 	char* ws;
+	struct arena_mark mark = arena_get_mark();
 
 	commandpatternsize = strlen(lcs->cmd) + 3;
-	commandpattern = (char*) malloc(commandpatternsize);
-	enough_mem(commandpattern);
+	commandpattern = (char*) arena_alloc(commandpatternsize);
 
 	if ((ws = strpbrk(lcs->cmd, " \t")) == NULL) {
 		/* Command consisting of a single word */
@@ -522,24 +490,21 @@ void log_cmd_ent(struct cmdlogent_t* lent, struct log_cmd_st* lcs) {
 				"%A %n %l %D \"%m\" %s %b";
 			char* replaced = log_replace_line(line_pattern, lcs);
 			fprintf(lent->logf, "%s\n", replaced);
-			free(replaced);
 		} else if (strcmp(lent->style, "xferlog") == 0) {
 			const char* line_pattern =
 				"%t %T %d %b \"%f\" %y _ %w %o %n %e 0 * %c";
 			char* replaced = log_replace_line(line_pattern, lcs);
 			fprintf(lent->logf, "%s\n", replaced);
-			free(replaced);
 		} else {
 			char* line_pattern = lent->style;
 			char* replaced;
 
 			replaced = log_replace_line(line_pattern, lcs);
 			fprintf(lent->logf, "%s\n", replaced);
-			free(replaced);
 		}
 		fflush(lent->logf);
 	}
-	free(commandpattern);
+	arena_release(mark);
 }
 
 
@@ -564,6 +529,18 @@ void log_cmd(struct log_cmd_st* lcs) {
 	lcs->filename = (char*) 0;
 }
 
+
+/* remember the verb of the current command, LEN characters of CMD */
+
+void log_cmd_set_method(struct log_cmd_st* lcs, const char* cmd, size_t len) {
+	if (len >= sizeof(lcs->method)) {
+		len = sizeof(lcs->method) - 1;
+	}
+	strncpy(lcs->method, cmd, len);
+	lcs->method[len] = '\0';
+}
+
+
 static
 int log_name_exists(const struct cmdlogent_t* cl, const char* needle) {
 	while (cl) {
@@ -986,6 +963,10 @@ int log_init() {
 		return -1;
 	}
 
+	if (trace_init() < 0) {
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1156,6 +1137,7 @@ int log_detect_log_change() {
 		log_init_syslog(&loginfo);
 	}
 	log_detect_cmdlog_change();
+	trace_init();
 	return 0;
 }
 
@@ -38,6 +38,9 @@
 
 extern void jlog(int, const char *fmt, ...);
 
+/* long enough for every verb we know, longer ones are cut in the log */
+#define LOG_METHOD_LEN	16
+
 struct log_cmd_st {
 
 	const char* svrname;
@@ -56,7 +59,7 @@ struct log_cmd_st {
 	const char* anon_user;
 
 	const char* cmd;
-	char* method;
+	char method[ LOG_METHOD_LEN ];
 	const char* filename;
 	const char* service;   /* "ftp" */
 	char direction;  /* either 'o'utgoing or 'i'ncoming */
@@ -65,6 +68,7 @@ struct log_cmd_st {
 	int complete;
 	unsigned int transfer_duration;
 	unsigned long int transferred;
+	unsigned int trace_id;
 };
 
 
@@ -87,6 +91,7 @@ struct loginfo_st {
 
 
 void log_cmd(struct log_cmd_st*);
+void log_cmd_set_method(struct log_cmd_st*, const char*, size_t);
 int log_init(void);
 int log_detect_log_change(void);
 
@@ -43,14 +43,17 @@ static int login_finish_login(struct clientinfo*);
 static int login_loggedin_setup(struct clientinfo*);
 
 static int login_failed(struct clientinfo*);
+static void login_pool_answer(const char*);
 
 
 int handle_login(struct clientinfo* clntinfo) {
 	struct cmdhandlerstruct *cmdhandler;
 	char *buffer = 0;
 	int ss, cs;
-	int i, expected;
+	int verb = VERB_UNKNOWN, expected;
+	size_t len;
 	int protoviolations = 0;
+	struct trace_span span;
 
 	conn_info.lcs = &lcs;
 	conn_info.clntinfo = clntinfo;
@@ -89,9 +92,9 @@ int handle_login(struct clientinfo* clntinfo) {
 
 		if (buffer) {
 			lcs.cmd = buffer;
-			free(lcs.method);
-			i = 0;
-			lcs.method = quotstrtok(lcs.cmd, WHITESPACES, &i);
+			trace_begin(&span, TRACE_COMMAND);
+			verb = verb_parse(buffer, &len);
+			log_cmd_set_method(&lcs, buffer, len);
 
 			if (buffer[0] == '\0') {
 				/* empty line. Prevent logging of the
@@ -102,7 +105,7 @@ int handle_login(struct clientinfo* clntinfo) {
 			}
 			/* log the command */
 			log_cmd(&lcs);
-			free(lcs.method); lcs.method = (char*) 0;
+			lcs.method[0] = '\0';
 			lcs.respcode = 0;
 			lcs.transferred = 0;
 		}
@@ -126,7 +129,7 @@ int handle_login(struct clientinfo* clntinfo) {
 		}
 
 		/* check for QUIT */
-		if (checkbegin(buffer, "QUIT")) {
+		if (verb == VERB_QUIT) {
 			int ret = (cmdhandler[QUITFUNC].func)
 						(buffer, &conn_info);
 			ret = (cmdhandler[RESETFUNC].func)
@@ -136,7 +139,9 @@ int handle_login(struct clientinfo* clntinfo) {
 			 * handle_cmds */
 			return 1;
 		}
-		if (cmdhandler[expected].cmd 
+		if (cmdhandler[expected].cmd
+			&& verb != VERB_UNKNOWN
+			&& verb == verb_parse(cmdhandler[expected].cmd, &len)
 			&& checkbegin(buffer, cmdhandler[expected].cmd)) {
 
 			int ret = (cmdhandler[expected].func)
@@ -187,6 +192,7 @@ int handle_login(struct clientinfo* clntinfo) {
 						(buffer, &conn_info);
 			expected = QUITFUNC + 1;
 		}
+		trace_end(&span, verb, lcs.respcode);
 		if (clntinfo->login.stage == LOGIN_ST_FULL) {
 			/* we are done */
 			free(buffer); buffer = (char*) 0;
@@ -236,11 +242,16 @@ int login(struct clientinfo* clntinfo, int stage) {
 		ret = login_auth(clntinfo);
 		if (ret) {
 			int ret2;
+			JFTPGW_PROBE3(login__failure, clntinfo->user,
+					clntinfo->destination, lcs.respcode);
 			if ((ret2 = login_failed(clntinfo)) < 0) {
 				return ret2;
 			}
 			return ret;
 		} else {
+			JFTPGW_PROBE3(login__success, clntinfo->user,
+					clntinfo->destination,
+					clntinfo->destinationport);
 			config_destroy_sectionconfig();
 		}
 		ret = login_loggedin_setup(clntinfo);
@@ -252,13 +263,18 @@ int login(struct clientinfo* clntinfo, int stage) {
 
 static
 int login_connect(struct clientinfo* clntinfo) {
+	struct trace_span span;
 	int ret;
 
 	if (clntinfo->login.stage >= LOGIN_ST_CONNECTED) {
 		return CMD_HANDLED;
 	}
 
-	if ((ret = login_init_connection(clntinfo)) < 0) {
+	/* name resolution, connect() and the welcome message */
+	trace_begin(&span, TRACE_CONNECT);
+	ret = login_init_connection(clntinfo);
+	trace_end(&span, VERB_UNKNOWN, ret);
+	if (ret < 0) {
 		/* the error is logged and say()ed */
 		return ret;
 	}
@@ -275,6 +291,7 @@ int login_connect(struct clientinfo* clntinfo) {
 
 static
 int login_auth(struct clientinfo* clntinfo) {
+	struct trace_span span;
 	int ret;
 
 	if (clntinfo->login.stage >= LOGIN_ST_LOGGEDIN) {
@@ -289,12 +306,17 @@ int login_auth(struct clientinfo* clntinfo) {
 		clntinfo->login.stage = LOGIN_ST_USER;
 	}
 
+	/* the answer to PASS is read by login_finish_login() */
+	trace_begin(&span, TRACE_AUTH_PASS);
 	if ((ret = login_sendauth_pass(clntinfo)) < 0) {
+		trace_end(&span, VERB_PASS, ret);
 		clntinfo->login.stage = LOGIN_ST_CONNECTED;
 		return ret;
 	}
 
-	if ((ret = login_finish_login(clntinfo)) < 0) {
+	ret = login_finish_login(clntinfo);
+	trace_end(&span, VERB_PASS, ret);
+	if (ret < 0) {
 		clntinfo->login.stage = LOGIN_ST_CONNECTED;
 		return ret;
 	}
@@ -702,6 +724,9 @@ int login_init_connection(struct clientinfo* clntinfo) {
 	int ss, cs = clntinfo->clientsocket;
 	int ret, err;
 
+	/* the destination may be the name of an upstream pool */
+	pool_select(clntinfo);
+
 	if ((ret = login_mayconnect(clntinfo)) < 0) {
 		/* the error is logged and say()ed */
 		return ret;
@@ -716,6 +741,7 @@ int login_init_connection(struct clientinfo* clntinfo) {
 			  (struct portrangestruct*) 0); /* source port */
 	if (ss < 0) {
 		err = errno;
+		pool_report(0);
 		sayf(cs, "500 "ERR_STR_P2,
 				clntinfo->destination,
 				clntinfo->destinationport,
@@ -740,6 +766,7 @@ int login_connected_setup(struct clientinfo* clntinfo) {
 	char* buffer;
 
 	if ((ret = login_readwelcome(clntinfo)) < 0) {
+		pool_report(0);
 		return ret;
 	}
 
@@ -820,10 +847,12 @@ static
 int login_sendauth_user(struct clientinfo* clntinfo) {
 	size_t sendbufsize, ret;
 	char* sendbuf;
+	struct trace_span span;
 
 	if (clntinfo->login.stage >= LOGIN_ST_USER) {
 		return CMD_HANDLED;
 	}
+	trace_begin(&span, TRACE_AUTH_USER);
 
 	sendbufsize = strlen("USER \r\n") + strlen(clntinfo->user) + 1;
 	sendbuf = (char*) malloc(sendbufsize);
@@ -836,6 +865,7 @@ int login_sendauth_user(struct clientinfo* clntinfo) {
 	if (ret < 0) {
 		jlog(2, "Error writing the user name to the server: %s",
 			strerror(errno));
+		trace_end(&span, VERB_USER, CMD_ABORT);
 		return CMD_ABORT;
 	}
 
@@ -848,11 +878,15 @@ int login_sendauth_user(struct clientinfo* clntinfo) {
 		} else {
 			err_readline(clntinfo->clientsocket);
 		}
+		pool_report(0);
 		free(clntinfo->login.welcomemsg.fullmsg);
 		clntinfo->login.welcomemsg.fullmsg = (char*) 0;
 		clntinfo->login.welcomemsg.lastmsg = (char*) 0;
+		trace_end(&span, VERB_USER, CMD_ABORT);
 		return CMD_ABORT;
 	}
+	trace_end(&span, VERB_USER, CMD_HANDLED);
+	login_pool_answer(clntinfo->login.authresp.lastmsg);
 
 	clntinfo->login.stage = LOGIN_ST_USER;
 	return CMD_HANDLED;
@@ -933,6 +967,9 @@ int login_loggedin_setup(struct clientinfo* clntinfo) {
 	/* we seem to have a successful login */
 	jlog(7, "Logged in to %s as %s!",
 		clntinfo->destination, clntinfo->user);
+	mdcache_forget_cwd(clntinfo);
+	clntinfo->noxmd5 = 0;
+	clntinfo->hashalgo = HASH_ALGO_OTHER;
 
 	/* initialize the log_cmd_st structure with the values that have to
 	 * be set only once after a successful login */
@@ -995,6 +1032,7 @@ int login_finish_login(struct clientinfo* clntinfo) {
 		else {
 			err_readline(clntinfo->clientsocket);
 		}
+		pool_report(0);
 		if (clntinfo->login.welcomemsg.fullmsg) {
 			free(clntinfo->login.welcomemsg.fullmsg);
 		}
@@ -1017,6 +1055,7 @@ int login_finish_login(struct clientinfo* clntinfo) {
 	}
 
 	lcs.respcode = getcode(clntinfo->login.authresp.lastmsg);
+	login_pool_answer(clntinfo->login.authresp.lastmsg);
 
 	if (!checkdigits(clntinfo->login.authresp.lastmsg, 230)) {
 		say(clntinfo->clientsocket,
@@ -1044,6 +1083,22 @@ int login_finish_login(struct clientinfo* clntinfo) {
 }
 
 
+/* login_pool_answer() reports the answer to USER or PASS to the upstream
+ * pool. Only a 230 shows that the backend works, an error answer counts as
+ * a failure unless it is just a wrong login (530) */
+
+static
+void login_pool_answer(const char* answer) {
+	int code = getcode(answer);
+
+	if (code == 230) {
+		pool_report(1);
+	} else if (code >= 400 && code < 600 && code != 530) {
+		pool_report(0);
+	}
+}
+
+
 static
 int login_failed(struct clientinfo* clntinfo) {
 
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* mdcache.c - the cache of metadata responses
+ *
+ * Mirror tools send lots of SIZE, MDTM, MLST and STAT commands. If
+ * "metacachetime" is set, the successful answers of the server are kept in
+ * shared memory for that many seconds and the same command for the same
+ * file by the same login (user@host:port) is answered by the proxy.
+ *
+ * The entries are keyed by the absolute path, relative names are resolved
+ * against the working directory of the session. The proxy learns it with
+ * PWD and forgets it when the client changes the directory. Commands that
+ * modify a file remove the entries of the file, of everything below it and
+ * of its parent directory once the server has answered. Changes that do
+ * not go through the proxy only show up after the entries have expired.
+ *
+ * If "negcachetime" is set, 550 answers to RETR, SIZE and MDTM are kept as
+ * well, build farms tend to poll for files that are not there yet. */
+
+#include "jftpgw.h"
+
+#define MDCACHE_SIZE		1024
+#define MDCACHE_WAYS		4
+#define MDCACHE_KEY_LEN		256
+#define MDCACHE_REPLY_LEN	512
+
+struct mdcache_entry {
+	unsigned int hash;
+	time_t expires;
+	char key[ MDCACHE_KEY_LEN ];
+	char reply[ MDCACHE_REPLY_LEN ];
+};
+
+struct mdcache_shared {
+	struct mdcache_entry entries[ MDCACHE_SIZE ];
+};
+
+static struct mdcache_shared* mdcache;
+
+
+/* the time to live of the answer REPLY, 0 if it is not cached */
+
+static
+int mdcache_ttl(const char* reply) {
+	int code = respcode(reply);
+
+	if (code >= 200 && code < 300) {
+		return config_get_ioption("metacachetime", 0);
+	}
+	if (code == 550) {
+		return config_get_ioption("negcachetime", 0);
+	}
+	return 0;
+}
+
+
+int mdcache_init(void) {
+	mdcache = (struct mdcache_shared*)
+			shmem_alloc(sizeof(struct mdcache_shared));
+	if (!mdcache) {
+		return -1;
+	}
+	return 0;
+}
+
+
+static
+unsigned int mdcache_hashval(const char* s) {
+	/* FNV-1a */
+	unsigned int h = 2166136261U;
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+/* the entries of a login start with "user@host:port\n", returns the length
+ * or -1 if it does not fit */
+
+static
+int mdcache_scope(const struct clientinfo* clntinfo, char* buf, size_t size) {
+	int n;
+
+	if (!clntinfo->user || !clntinfo->destination) {
+		return -1;
+	}
+	n = snprintf(buf, size, "%s@%s:%u\n", clntinfo->user,
+			clntinfo->destination, clntinfo->destinationport);
+	if (n < 0 || (size_t) n >= size) {
+		return -1;
+	}
+	return n;
+}
+
+
+/* the key is the scope, the path and the verb. The answer to SIZE depends on
+ * the transfer type of the server */
+
+static
+int mdcache_key(const struct clientinfo* clntinfo, int verb,
+		const char* path, char* buf) {
+	int n = mdcache_scope(clntinfo, buf, MDCACHE_KEY_LEN);
+	int m;
+
+	if (n < 0) {
+		return -1;
+	}
+	m = snprintf(buf + n, MDCACHE_KEY_LEN - n, "%s\n%s%s", path,
+			verb_name(verb),
+			verb != VERB_SIZE ? "" :
+			clntinfo->transfermode_server == TRANSFER_ASCII
+				? " A" : " I");
+	if (m < 0 || m >= MDCACHE_KEY_LEN - n) {
+		return -1;
+	}
+	return 0;
+}
+
+
+int mdcache_enabled(void) {
+	return config_get_ioption("metacachetime", 0) > 0
+		|| config_get_ioption("negcachetime", 0) > 0;
+}
+
+
+/* mdcache_cwd() returns the working directory on the server, it is asked
+ * for with PWD if it is not known */
+
+const char* mdcache_cwd(struct clientinfo* clntinfo) {
+	if (!clntinfo->cwd) {
+		clntinfo->cwd = getftpwd(clntinfo);
+	}
+	return clntinfo->cwd;
+}
+
+
+void mdcache_forget_cwd(struct clientinfo* clntinfo) {
+	if (clntinfo->cwd) {
+		free(clntinfo->cwd);
+		clntinfo->cwd = (char*) 0;
+	}
+}
+
+
+/* mdcache_path() returns the absolute path of the argument ARG in the arena
+ * or NULL if it cannot be determined. An empty argument is the working
+ * directory */
+
+char* mdcache_path(struct clientinfo* clntinfo, const char* arg) {
+	const char* cwd;
+	char* path;
+	size_t size;
+
+	if (arg[0] == '~') {
+		/* only the server knows */
+		return (char*) 0;
+	}
+	if (arg[0] == '/') {
+		cwd = "/";
+	} else if (!(cwd = mdcache_cwd(clntinfo)) || cwd[0] != '/') {
+		return (char*) 0;
+	}
+	size = strlen(cwd) + 1 + strlen(arg) + 1;
+	path = (char*) arena_alloc(size);
+	if (!rel2abs(arg[0] ? arg : ".", cwd, path, size)) {
+		return (char*) 0;
+	}
+	return path;
+}
+
+
+/* mdcache_lookup() returns a copy of the cached answer to the command VERB
+ * for PATH in the arena or NULL */
+
+char* mdcache_lookup(const struct clientinfo* clntinfo, int verb,
+		     const char* path) {
+	char key[ MDCACHE_KEY_LEN ];
+	struct mdcache_entry* e;
+	unsigned int h;
+	time_t now;
+	char* reply = (char*) 0;
+	int i;
+
+	if (!mdcache || !path || !mdcache_enabled()
+	    || mdcache_key(clntinfo, verb, path, key) < 0) {
+		return (char*) 0;
+	}
+	h = mdcache_hashval(key);
+	now = time(NULL);
+
+	shmem_lock(mdcache);
+	e = &mdcache->entries[ (h % (MDCACHE_SIZE / MDCACHE_WAYS))
+						* MDCACHE_WAYS ];
+	for (i = 0; i < MDCACHE_WAYS; i++, e++) {
+		if (e->hash == h && e->expires > now
+		    && strcmp(e->key, key) == 0) {
+			/* the cache for this kind of answer may be off in the
+			 * configuration of this session */
+			if (mdcache_ttl(e->reply) > 0) {
+				reply = arena_strdup(e->reply);
+			}
+			break;
+		}
+	}
+	shmem_unlock(mdcache);
+
+	jlog(9, "Metadata cache %s for %s %s", reply ? "hit" : "miss",
+			verb_name(verb), path);
+	return reply;
+}
+
+
+/* mdcache_store() remembers REPLY, the answer to the command VERB for PATH,
+ * if it is a successful answer or a 550 one. Answers that are too long are
+ * not cached */
+
+void mdcache_store(const struct clientinfo* clntinfo, int verb,
+		   const char* path, const char* reply) {
+	char key[ MDCACHE_KEY_LEN ];
+	struct mdcache_entry* e, *victim;
+	int ttl = mdcache ? mdcache_ttl(reply) : 0;
+	unsigned int h;
+	time_t now;
+	int i;
+
+	if (!mdcache || !path || ttl <= 0
+	    || strlen(reply) >= MDCACHE_REPLY_LEN
+	    || mdcache_key(clntinfo, verb, path, key) < 0) {
+		return;
+	}
+	h = mdcache_hashval(key);
+	now = time(NULL);
+
+	shmem_lock(mdcache);
+	e = &mdcache->entries[ (h % (MDCACHE_SIZE / MDCACHE_WAYS))
+						* MDCACHE_WAYS ];
+	/* the same key, an expired entry or the one that expires first */
+	victim = e;
+	for (i = 0; i < MDCACHE_WAYS; i++, e++) {
+		if (e->hash == h && strcmp(e->key, key) == 0) {
+			victim = e;
+			break;
+		}
+		if (e->expires <= now) {
+			victim = e;
+		} else if (victim->expires > now
+			   && e->expires < victim->expires) {
+			victim = e;
+		}
+	}
+	victim->hash = h;
+	victim->expires = now + ttl;
+	strcpy(victim->key, key);
+	strcpy(victim->reply, reply);
+	shmem_unlock(mdcache);
+}
+
+
+/* mdcache_invalidate() removes the entries of PATH, of everything below it
+ * and of its parent directory, i.e. everything that a modification of PATH
+ * may have changed. If PATH is NULL, all entries of the login are removed */
+
+void mdcache_invalidate(const struct clientinfo* clntinfo, const char* path) {
+	char scope[ MDCACHE_KEY_LEN ];
+	const char* p, *slash;
+	size_t scopelen, pathlen = 0, parentlen = 0;
+	int n, i, removed = 0;
+
+	if (!mdcache || (n = mdcache_scope(clntinfo, scope, sizeof(scope))) < 0) {
+		return;
+	}
+	scopelen = n;
+	if (path) {
+		pathlen = strlen(path);
+		while (pathlen > 1 && path[ pathlen - 1 ] == '/') {
+			pathlen--;
+		}
+		slash = path + pathlen;
+		while (slash > path && *(slash - 1) != '/') {
+			slash--;
+		}
+		/* "/" is its own parent */
+		parentlen = slash - path > 1 ? slash - path - 1 : 1;
+	}
+
+	shmem_lock(mdcache);
+	for (i = 0; i < MDCACHE_SIZE; i++) {
+		if (!mdcache->entries[i].expires
+		    || strncmp(mdcache->entries[i].key, scope, scopelen) != 0) {
+			continue;
+		}
+		p = mdcache->entries[i].key + scopelen;
+		if (path
+		    && !(strncmp(p, path, pathlen) == 0
+			 && (p[ pathlen ] == '\n' || p[ pathlen ] == '/'
+			     || pathlen == 1))
+		    && !(strncmp(p, path, parentlen) == 0
+			 && p[ parentlen ] == '\n')) {
+			continue;
+		}
+		mdcache->entries[i].expires = 0;
+		mdcache->entries[i].hash = 0;
+		removed++;
+	}
+	shmem_unlock(mdcache);
+
+	if (removed) {
+		jlog(9, "Removed %d entries of %s from the metadata cache",
+				removed, path ? path : "the login");
+	}
+}
+
@@ -17,6 +17,7 @@
  */
 
 #include <sys/types.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in_systm.h>
 #include <netinet/in.h>
@@ -209,10 +210,15 @@ int getportinrange(int sd, struct sockaddr_in* sin,
 }
 
 
+/* openport() connects to SIN from LOCAL_ADDRESS. If NONBLOCKING is set,
+ * the connect() is only started and the caller has to wait for the socket
+ * to become writable and call openport_complete() afterwards */
+
 static
 int openport(struct sockaddr_in sin,
 	     unsigned long int local_address,
-	     const struct portrangestruct* localportrange) {
+	     const struct portrangestruct* localportrange,
+	     int nonblocking) {
 
 	int handle;
 	int one = 1;
@@ -255,21 +261,80 @@ int openport(struct sockaddr_in sin,
 	/* will default to getanylocalport if localportrange is not defined
 	 * */
 	handle = getportinrange(handle, &dp, localportrange);
+	if (handle < 0) {
+		return -1;
+	}
+
+	if (nonblocking) {
+		int fdflags = fcntl(handle, F_GETFL);
+		if (fdflags < 0 ||
+			fcntl(handle, F_SETFL, fdflags | O_NONBLOCK) < 0) {
+			jlog(2, "Could not set socket to non-blocking mode: %s",
+							strerror(errno));
+			close(handle);
+			return -1;
+		}
+	}
 
 	if (connect(handle, (struct sockaddr*) &sin, sizeof(sin)) < 0) {
 		int err = errno;
+		if (nonblocking && err == EINPROGRESS) {
+			jlog(9, "Connection to %s:%d is in progress",
+						inet_ntoa(sin.sin_addr),
+						ntohs(sin.sin_port));
+			return handle;
+		}
 		jlog(1, "Error connecting to %s:%d: %s",
 						inet_ntoa(sin.sin_addr),
 						ntohs(sin.sin_port),
 						strerror(err));
+		close(handle);
 		errno = err;
 		set_errstr(strerror(err));
 		return -1;
 	}
 
+	if (nonblocking && openport_complete(handle) < 0) {
+		close(handle);
+		return -1;
+	}
+
 	return handle;
 }
 
+/* openport_complete() is called when a socket returned by
+ * openportiaddr_nb() has become writable. It fetches the result of the
+ * connect() and puts the socket back into blocking mode.
+ *
+ * Return values: -1 if the connection could not be established,
+ *                 0 on success
+ */
+
+int openport_complete(int handle) {
+	int err = 0;
+	int fdflags;
+	socklen_t errlen;
+
+	errlen = sizeof(err);
+	if (getsockopt(handle, SOL_SOCKET, SO_ERROR,
+				(void*) &err, &errlen) < 0) {
+		err = errno;
+	}
+	if (err) {
+		jlog(1, "Error connecting (fd %d): %s", handle, strerror(err));
+		errno = err;
+		set_errstr(strerror(err));
+		return -1;
+	}
+	if ((fdflags = fcntl(handle, F_GETFL)) < 0 ||
+		fcntl(handle, F_SETFL, fdflags & ~O_NONBLOCK) < 0) {
+		jlog(2, "Could not set socket back to blocking mode: %s",
+							strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 int openportiaddr(unsigned long addr,
 		  unsigned int port,
 		  unsigned long int local_address,
@@ -280,7 +345,207 @@ int openportiaddr(unsigned long addr,
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = addr;
 	sin.sin_port = htons(port);
-	return openport(sin, local_address, localportrange);
+	return openport(sin, local_address, localportrange, 0);
+}
+
+/* the same as openportiaddr() but the connect() does not block, see
+ * openport_complete() */
+
+int openportiaddr_nb(unsigned long addr,
+		     unsigned int port,
+		     unsigned long int local_address,
+		     const struct portrangestruct* localportrange) {
+
+	struct sockaddr_in sin;
+	memset((void*)&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = addr;
+	sin.sin_port = htons(port);
+	return openport(sin, local_address, localportrange, 1);
+}
+
+/* Addresses that we could not connect to recently. The table lives in
+ * shared memory so that the failure that one session noticed spares the
+ * following sessions the connect timeout. Those addresses are tried last.
+ * */
+
+struct connect_failure {
+	unsigned long int ip;
+	unsigned int port;
+	time_t when;
+};
+
+#define CONNECT_FAILURES	64
+static struct connect_failure* connect_failures;
+
+void openport_init(void) {
+	connect_failures = (struct connect_failure*)
+		shmem_alloc(CONNECT_FAILURES * sizeof(struct connect_failure));
+}
+
+static
+int connect_failed_recently(unsigned long int ip, unsigned int port) {
+	int i, ret = 0;
+	time_t now = time(NULL);
+	int expire = config_get_ioption("connectfailuretimeout", 300);
+
+	if (!connect_failures) {
+		return 0;
+	}
+	shmem_lock(connect_failures);
+	for (i = 0; i < CONNECT_FAILURES; i++) {
+		if (connect_failures[i].ip == ip
+			&& connect_failures[i].port == port
+			&& connect_failures[i].when + expire > now) {
+			ret = 1;
+			break;
+		}
+	}
+	shmem_unlock(connect_failures);
+	return ret;
+}
+
+static
+void connect_failure_set(unsigned long int ip, unsigned int port,
+							int failed) {
+	int i, slot = -1;
+
+	if (!connect_failures) {
+		return;
+	}
+	shmem_lock(connect_failures);
+	for (i = 0; i < CONNECT_FAILURES; i++) {
+		if (connect_failures[i].ip == ip
+			&& connect_failures[i].port == port) {
+			slot = i;
+			break;
+		}
+		/* remember the oldest entry in case we have to replace it */
+		if (slot < 0 || connect_failures[i].when
+					< connect_failures[slot].when) {
+			slot = i;
+		}
+	}
+	if (failed) {
+		connect_failures[slot].ip = ip;
+		connect_failures[slot].port = port;
+		connect_failures[slot].when = time(NULL);
+	} else if (connect_failures[slot].ip == ip
+			&& connect_failures[slot].port == port) {
+		connect_failures[slot].when = 0;
+	}
+	shmem_unlock(connect_failures);
+}
+
+
+/* openport_multi() connects to one of the N addresses in ADDRS. The
+ * connection attempts are started one after the other, each
+ * "connectstagger" milliseconds after the previous one or as soon as the
+ * previous one failed, and the first connection that succeeds is used.
+ *
+ * Return value: -1 on error, the connected socket on success
+ */
+
+static
+int openport_multi(const unsigned long int* addrs, int n,
+		   unsigned int port,
+		   unsigned long int local_address,
+		   const struct portrangestruct* localportrange) {
+
+	int* socks;
+	int i, ret, maxfd;
+	int next = 0, active = 0, winner = -1, start_next = 1;
+	int err = ECONNREFUSED;
+	int stagger = config_get_ioption("connectstagger", 250);
+	struct sockaddr_in sin;
+	struct timeval tv;
+	fd_set wset;
+
+	socks = (int*) malloc(n * sizeof(int));
+	enough_mem(socks);
+
+	memset((void*)&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+
+	while (winner < 0 && (next < n || active > 0)) {
+		if (next < n && (start_next || active == 0 || stagger <= 0)) {
+			sin.sin_addr.s_addr = addrs[next];
+			jlog(8, "Trying %s:%d", inet_ntoa(sin.sin_addr), port);
+			socks[next] = openport(sin, local_address,
+						localportrange, 1);
+			if (socks[next] < 0) {
+				err = errno;
+				connect_failure_set(addrs[next], port, 1);
+			} else {
+				active++;
+			}
+			next++;
+			start_next = 0;
+			continue;
+		}
+
+		FD_ZERO(&wset);
+		maxfd = -1;
+		for (i = 0; i < next; i++) {
+			if (socks[i] >= 0) {
+				FD_SET(socks[i], &wset);
+				maxfd = MAX_VAL(maxfd, socks[i]);
+			}
+		}
+		tv.tv_sec = stagger / 1000;
+		tv.tv_usec = (stagger % 1000) * 1000;
+		ret = select(maxfd + 1, NULL, &wset, NULL,
+				next < n ? &tv : (struct timeval*) 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = errno;
+			jlog(2, "select() error in openport_multi(): %s",
+						strerror(errno));
+			break;
+		}
+		if (ret == 0) {
+			/* the stagger delay has passed */
+			start_next = 1;
+			continue;
+		}
+		for (i = 0; i < next && winner < 0; i++) {
+			if (socks[i] < 0 || !FD_ISSET(socks[i], &wset)) {
+				continue;
+			}
+			if (openport_complete(socks[i]) == 0) {
+				winner = i;
+				break;
+			}
+			err = errno;
+			sin.sin_addr.s_addr = addrs[i];
+			jlog(5, "Connecting to %s:%d failed: %s",
+				inet_ntoa(sin.sin_addr), port, strerror(err));
+			connect_failure_set(addrs[i], port, 1);
+			close(socks[i]);
+			socks[i] = -1;
+			active--;
+			start_next = 1;
+		}
+	}
+
+	for (i = 0; i < next; i++) {
+		if (i != winner && socks[i] >= 0) {
+			close(socks[i]);
+		}
+	}
+	if (winner < 0) {
+		free(socks);
+		errno = err;
+		set_errstr(strerror(err));
+		return -1;
+	}
+	connect_failure_set(addrs[winner], port, 0);
+	ret = socks[winner];
+	free(socks);
+	return ret;
 }
 
 int openportname(const char* hostname,
@@ -289,8 +554,11 @@ int openportname(const char* hostname,
 		 const struct portrangestruct* localportrange) {
 
 	unsigned long int host_ip;
-	struct sockaddr_in sin;
+	unsigned long int* addrs;
+	const struct ullist_t* addr_list;
+	const struct ullist_t* ul;
 	struct in_addr local_addr;
+	int n, i, ret, front, back;
 	local_addr.s_addr = local_address;
 
 	if (local_address != INADDR_ANY) {
@@ -300,16 +568,43 @@ int openportname(const char* hostname,
 			hostname, port);
 	}
 
-	memset((void*)&sin, 0, sizeof(sin));
-	host_ip = hostent_get_ip(&hostcache, hostname);
-	if (host_ip == (unsigned long int) UINT_MAX) {
-		jlog(3, "Could not look up %s", hostname);
-		return -1;
+	addr_list = hostent_get_addr(&hostcache, hostname);
+	n = 0;
+	for (ul = addr_list; ul; ul = ul->next) {
+		n++;
 	}
-	sin.sin_family         = AF_INET;
-	sin.sin_addr.s_addr    = host_ip;
-	sin.sin_port           = htons(port);
-	return openport(sin, local_address, localportrange);
+	if (n < 2) {
+		/* nothing to choose from */
+		host_ip = hostent_get_ip(&hostcache, hostname);
+		if (host_ip == (unsigned long int) UINT_MAX) {
+			jlog(3, "Could not look up %s", hostname);
+			return -1;
+		}
+		return openport_multi(&host_ip, 1, port,
+					local_address, localportrange);
+	}
+
+	/* put the addresses that failed recently at the end */
+	addrs = (unsigned long int*) malloc(n * sizeof(unsigned long int));
+	enough_mem(addrs);
+	front = 0;
+	back = n;
+	for (ul = addr_list; ul; ul = ul->next) {
+		if (connect_failed_recently(ul->value, port)) {
+			addrs[--back] = ul->value;
+		} else {
+			addrs[front++] = ul->value;
+		}
+	}
+	/* the failed ones are in reverse order now */
+	for (i = back; i < back + (n - back) / 2; i++) {
+		host_ip = addrs[i];
+		addrs[i] = addrs[n - 1 - (i - back)];
+		addrs[n - 1 - (i - back)] = host_ip;
+	}
+	ret = openport_multi(addrs, n, port, local_address, localportrange);
+	free(addrs);
+	return ret;
 }
 
 
@@ -39,6 +39,28 @@ static void saypasv(int, char*, unsigned short int);
  * */
 
 int pasvserver(struct clientinfo* clntinfo) {
+	if (pasvserver_request(clntinfo) < 0) {
+		return -1;
+	}
+	return pasvserver_reply(clntinfo);
+}
+
+/* pasvserver_request() only sends the PASV command to the server so that
+ * the caller can do something else while the answer is on its way. The
+ * answer is read by pasvserver_reply() */
+
+int pasvserver_request(struct clientinfo* clntinfo) {
+	if (say(clntinfo->serversocket, "PASV\r\n") < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* pasvserver_reply() reads the answer to the PASV command and starts
+ * connecting to the announced address. The connect() does not block, it
+ * is completed by transfer_negotiate() */
+
+int pasvserver_reply(struct clientinfo* clntinfo) {
 	int ss, cs, ret, pssock;
 	char* brk;
 	char* buffer;
@@ -48,7 +70,9 @@ int pasvserver(struct clientinfo* clntinfo) {
 	ss = clntinfo->serversocket;
 	cs = clntinfo->clientsocket;
 
-	say(ss, "PASV\r\n");
+	if (clntinfo->waitforconnect == &clntinfo->dataserversock) {
+		clntinfo->waitforconnect = (int*) 0;
+	}
 	buffer = ftp_readline(ss);
 	if (!buffer) {
 		if (timeout) {
@@ -122,7 +146,7 @@ int pasvserver(struct clientinfo* clntinfo) {
 					inet_ntoa(pasvserv_sin.sin_addr),
 					ntohs(pasvserv_sin.sin_port));
 	/* open the port on the foreign machine specified by PASVSERVERSOCK */
-	pssock = openportiaddr(pasvserv_sin.sin_addr.s_addr, /* dest ip   */
+	pssock = openportiaddr_nb(pasvserv_sin.sin_addr.s_addr, /* dest ip */
 			ntohs(pasvserv_sin.sin_port),        /* dest port */
 			clntinfo->data_addr_to_server,       /* source ip */
 			prs);                             /* source ports */
@@ -132,7 +156,11 @@ int pasvserver(struct clientinfo* clntinfo) {
 		free(buffer);
 		return -1;
 	}
+	if (clntinfo->dataserversock >= 0) {
+		close(clntinfo->dataserversock);
+	}
 	clntinfo->dataserversock = pssock;
+	clntinfo->dataserverpending = 1;
 
 	free(buffer);
 	return 0;
@@ -152,10 +180,18 @@ int pasvserver(struct clientinfo* clntinfo) {
 
 
 int pasvclient(struct clientinfo* clntinfo) {
+	if (pasvclient_bind(clntinfo) < 0) {
+		return -1;
+	}
+	return pasvclient_announce(clntinfo);
+}
+
+/* pasvclient_bind() opens the port for the client without telling it
+ * about it yet, pasvclient_announce() sends the 227 reply */
+
+int pasvclient_bind(struct clientinfo* clntinfo) {
 	int pcsock;
-	int cs = clntinfo->clientsocket;
 	struct sockaddr_in pasvclientsin;
-	struct in_addr in;
 
 	clntinfo->clientmode = PASSIVE;
 
@@ -183,11 +219,29 @@ int pasvclient(struct clientinfo* clntinfo) {
 		return -1;
 	}
 	clntinfo->dataclientsock = pcsock;
+	clntinfo->dataclientpending = 0;
 	clntinfo->waitforconnect = &clntinfo->dataclientsock;
 
+	return 0;
+}
+
+int pasvclient_announce(struct clientinfo* clntinfo) {
+	int cs = clntinfo->clientsocket;
+	struct sockaddr_in pasvclientsin;
+	struct in_addr in;
+	socklen_t slen;
+
+	slen = sizeof(pasvclientsin);
+	if (getsockname(clntinfo->dataclientsock,
+			(struct sockaddr*) &pasvclientsin, &slen) < 0) {
+		jlog(2, "getsockname failed for the passive port: %s",
+				strerror(errno));
+		return -1;
+	}
+
 	/* write the values to the client socket CS */
 	in.s_addr = pasvclientsin.sin_addr.s_addr;
-	saypasv(cs, inet_ntoa(in), htons(pasvclientsin.sin_port));
+	saypasv(cs, inet_ntoa(in), ntohs(pasvclientsin.sin_port));
 
 	return 0;
 }
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* pool.c - upstream server pools
+ *
+ * A pool is a named set of equivalent servers:
+ *
+ *     upstreampool  mirrors  ftp1.foo.com  ftp2.foo.com:2121/2  10.0.0.3
+ *
+ * If the destination of a session is the name of a pool, one of its
+ * members is chosen instead: the one with the fewest active sessions
+ * relative to its weight. The session counts are kept in shared memory so
+ * that all children see them. The master releases the slot of a session
+ * when the child exits.
+ *
+ * Members that fail to connect or that do not greet properly "poolmaxfails"
+ * times in a row are ejected for "poolretrytime" seconds. After that time a
+ * single session is let through as a probe, if it succeeds the member is
+ * re-admitted, otherwise it is ejected again. */
+
+#include "jftpgw.h"
+
+#define POOL_MAX_BACKENDS	64
+#define POOL_MAX_SESSIONS	1024
+#define POOL_MAX_MEMBERS	32
+#define POOL_NAME_LEN		32
+#define POOL_HOST_LEN		128
+
+struct pool_backend {
+	char pool[ POOL_NAME_LEN ];
+	char host[ POOL_HOST_LEN ];
+	unsigned int port;
+	int active;		/* sessions currently using it */
+	int fails;		/* consecutive failures */
+	time_t ejected;		/* time of the ejection, 0 if healthy */
+	pid_t probe;		/* pid of the probing session */
+};
+
+struct pool_session {
+	pid_t pid;
+	int backend;
+};
+
+struct pool_shared {
+	struct pool_backend backends[ POOL_MAX_BACKENDS ];
+	struct pool_session sessions[ POOL_MAX_SESSIONS ];
+};
+
+struct pool_member {
+	char* host;
+	unsigned int port;
+	int weight;
+};
+
+static struct pool_shared* pool_shm;
+
+/* the backend this session is using, -1 if none */
+static int pool_current = -1;
+
+
+int pool_init(void) {
+	pool_shm = (struct pool_shared*) shmem_alloc(sizeof(struct pool_shared));
+	if (!pool_shm) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/* parse a member specification host[:port][/weight] */
+
+static
+int pool_parse_member(const char* spec, unsigned int defport,
+			struct pool_member* m) {
+	const char* p;
+	size_t hostlen;
+
+	m->port = defport;
+	m->weight = 1;
+
+	hostlen = strcspn(spec, ":/");
+	if (hostlen == 0 || hostlen >= POOL_HOST_LEN) {
+		return -1;
+	}
+	p = spec + hostlen;
+	if (*p == ':') {
+		p++;
+		m->port = strtoul(p, (char**) &p, 10);
+		if (m->port == 0 || m->port > 65535) {
+			return -1;
+		}
+	}
+	if (*p == '/') {
+		p++;
+		m->weight = strtol(p, (char**) &p, 10);
+		if (m->weight <= 0) {
+			return -1;
+		}
+	}
+	if (*p) {
+		return -1;
+	}
+	m->host = (char*) malloc(hostlen + 1);
+	enough_mem(m->host);
+	strncpy(m->host, spec, hostlen);
+	m->host[ hostlen ] = '\0';
+	return 0;
+}
+
+
+/* read the members of the pool NAME from the configuration, returns the
+ * number of members or 0 if there is no such pool */
+
+static
+int pool_get_members(const char* name, unsigned int defport,
+			struct pool_member* members) {
+	struct slist_t* pool_list = config_get_option_array("upstreampool");
+	struct slist_t* pool, *line, *spec;
+	int n = 0;
+
+	if (!pool_list) {
+		return 0;
+	}
+	/* the last definition of a pool wins */
+	pool_list = slist_reverse(pool_list);
+
+	for (pool = pool_list; pool && n == 0; pool = pool->next) {
+		line = config_split_line(pool->value, WHITESPACES);
+		if (!line || !line->next) {
+			jlog(5, "Incorrect pool specification: %s",
+					pool->value);
+			slist_destroy(line);
+			continue;
+		}
+		if (strcasecmp(line->value, name) != 0) {
+			slist_destroy(line);
+			continue;
+		}
+		if (strlen(name) >= POOL_NAME_LEN) {
+			jlog(5, "Pool name too long: %s", name);
+			slist_destroy(line);
+			break;
+		}
+		for (spec = line->next; spec; spec = spec->next) {
+			if (n == POOL_MAX_MEMBERS) {
+				jlog(5, "Too many members in pool %s", name);
+				break;
+			}
+			if (pool_parse_member(spec->value, defport,
+						&members[n]) < 0) {
+				jlog(5, "Incorrect pool member %s in pool %s",
+						spec->value, name);
+				continue;
+			}
+			n++;
+		}
+		slist_destroy(line);
+	}
+	slist_destroy(pool_list);
+
+	return n;
+}
+
+
+/* is NAME still defined as a pool in the configuration? */
+
+static
+int pool_configured(const char* name) {
+	struct slist_t* pool_list = config_get_option_array("upstreampool");
+	struct slist_t* pool;
+	size_t len = strlen(name);
+	int found = 0;
+
+	for (pool = pool_list; pool && !found; pool = pool->next) {
+		found = strncasecmp(pool->value, name, len) == 0
+			&& (pool->value[len] == '\0'
+			    || strchr(WHITESPACES, pool->value[len]));
+	}
+	slist_destroy(pool_list);
+	return found;
+}
+
+
+/* find the shared entry of a member or create it, returns -1 if the table
+ * is full. IDX holds the N entries that the other members of the pool have
+ * already got, they must not be recycled. Has to be called with the lock
+ * held */
+
+static
+int pool_get_backend(const char* name, const struct pool_member* m,
+		     const int* idx, int n) {
+	struct pool_backend* b;
+	int i, j, unused = -1, idle = -1;
+
+	for (i = 0; i < POOL_MAX_BACKENDS; i++) {
+		b = &pool_shm->backends[i];
+		if (!b->pool[0]) {
+			if (unused < 0) {
+				unused = i;
+			}
+			continue;
+		}
+		if (strcasecmp(b->pool, name) == 0
+		    && strcmp(b->host, m->host) == 0
+		    && b->port == m->port) {
+			return i;
+		}
+	}
+	/* recycle an entry that is not in use, preferably from a pool that
+	 * was removed from the configuration. An entry of a pool that is
+	 * still there is only taken if it has no failures to remember */
+	for (i = 0; i < POOL_MAX_BACKENDS && unused < 0; i++) {
+		b = &pool_shm->backends[i];
+		if (b->active || b->probe) {
+			continue;
+		}
+		for (j = 0; j < n && idx[j] != i; j++);
+		if (j < n) {
+			continue;
+		}
+		if (!pool_configured(b->pool)) {
+			unused = i;
+		} else if (idle < 0 && !b->fails && !b->ejected) {
+			idle = i;
+		}
+	}
+	if (unused < 0) {
+		unused = idle;
+	}
+	if (unused < 0) {
+		return -1;
+	}
+	b = &pool_shm->backends[ unused ];
+	memset(b, 0, sizeof(struct pool_backend));
+	strncpy(b->pool, name, POOL_NAME_LEN - 1);
+	strncpy(b->host, m->host, POOL_HOST_LEN - 1);
+	b->port = m->port;
+	return unused;
+}
+
+
+/* release the session slot of PID, has to be called with the lock held */
+
+static
+void pool_release_locked(pid_t pid) {
+	struct pool_backend* b;
+	int i;
+
+	for (i = 0; i < POOL_MAX_SESSIONS; i++) {
+		if (pool_shm->sessions[i].pid != pid) {
+			continue;
+		}
+		b = &pool_shm->backends[ pool_shm->sessions[i].backend ];
+		if (b->active > 0) {
+			b->active--;
+		}
+		if (b->probe == pid) {
+			b->probe = 0;
+		}
+		pool_shm->sessions[i].pid = 0;
+		break;
+	}
+}
+
+
+void pool_release(pid_t pid) {
+	if (!pool_shm || pid <= 0) {
+		return;
+	}
+	shmem_lock(pool_shm);
+	pool_release_locked(pid);
+	shmem_unlock(pool_shm);
+}
+
+
+/* pool_select() checks if the destination of the session is the name of a
+ * pool. If so, it replaces the destination by one of the members */
+
+void pool_select(struct clientinfo* clntinfo) {
+	struct pool_member members[ POOL_MAX_MEMBERS ];
+	int idx[ POOL_MAX_MEMBERS ];
+	struct pool_backend* b, *best_b;
+	int n, i, best = -1, slot;
+	time_t now = time(NULL);
+	int retrytime = config_get_ioption("poolretrytime", 30);
+	const char* name = clntinfo->destination;
+
+	if (!name || !pool_shm) {
+		return;
+	}
+	n = pool_get_members(name, clntinfo->destinationport, members);
+	if (n == 0) {
+		return;
+	}
+
+	shmem_lock(pool_shm);
+
+	/* a new login within the same session gives up the old slot */
+	pool_release_locked(getpid());
+	pool_current = -1;
+
+	for (i = 0; i < n; i++) {
+		idx[i] = pool_get_backend(name, &members[i], idx, i);
+	}
+
+	/* least weighted active sessions among the healthy members and the
+	 * ejected ones that are due for a probe */
+	for (i = 0; i < n; i++) {
+		if (idx[i] < 0) {
+			continue;
+		}
+		b = &pool_shm->backends[ idx[i] ];
+		if (b->ejected
+		    && (now - b->ejected < retrytime || b->probe)) {
+			continue;
+		}
+		if (best < 0) {
+			best = i;
+			continue;
+		}
+		best_b = &pool_shm->backends[ idx[best] ];
+		if ((b->active + 1) * members[best].weight
+		    < (best_b->active + 1) * members[i].weight) {
+			best = i;
+		}
+	}
+	if (best < 0) {
+		/* everything is ejected, take the one that has been out for
+		 * the longest time rather than refusing the session */
+		for (i = 0; i < n; i++) {
+			if (idx[i] < 0) {
+				continue;
+			}
+			b = &pool_shm->backends[ idx[i] ];
+			if (best < 0
+			    || b->ejected
+			      < pool_shm->backends[ idx[best] ].ejected) {
+				best = i;
+			}
+		}
+	}
+	if (best < 0) {
+		/* the shared table is full, do without it */
+		shmem_unlock(pool_shm);
+		jlog(4, "Backend table full, using the first member of pool %s",
+				name);
+		best = 0;
+	} else {
+		b = &pool_shm->backends[ idx[best] ];
+		if (b->ejected) {
+			b->probe = getpid();
+			jlog(6, "Probing ejected backend %s:%d of pool %s",
+					b->host, b->port, name);
+		}
+		b->active++;
+		for (slot = 0; slot < POOL_MAX_SESSIONS; slot++) {
+			if (pool_shm->sessions[slot].pid == 0) {
+				pool_shm->sessions[slot].pid = getpid();
+				pool_shm->sessions[slot].backend = idx[best];
+				break;
+			}
+		}
+		if (slot == POOL_MAX_SESSIONS) {
+			/* we cannot release it later */
+			b->active--;
+			if (b->probe == getpid()) {
+				b->probe = 0;
+			}
+			jlog(4, "Session table full, not counting this session");
+		} else {
+			pool_current = idx[best];
+		}
+		jlog(7, "Pool %s: using %s:%d (%d active sessions, weight %d)",
+				name, b->host, b->port, b->active,
+				members[best].weight);
+		shmem_unlock(pool_shm);
+	}
+
+	free(clntinfo->destination);
+	clntinfo->destination = strdup(members[best].host);
+	enough_mem(clntinfo->destination);
+	clntinfo->destinationport = members[best].port;
+
+	for (i = 0; i < n; i++) {
+		free(members[i].host);
+	}
+}
+
+
+/* pool_report() records if the backend of this session works (OK is 1) or
+ * not */
+
+void pool_report(int ok) {
+	struct pool_backend* b;
+	int maxfails;
+
+	if (pool_current < 0 || !pool_shm) {
+		return;
+	}
+	maxfails = config_get_ioption("poolmaxfails", 3);
+
+	shmem_lock(pool_shm);
+	b = &pool_shm->backends[ pool_current ];
+	if (b->probe == getpid()) {
+		b->probe = 0;
+	}
+	if (ok) {
+		if (b->ejected) {
+			jlog(5, "Re-admitting backend %s:%d of pool %s",
+					b->host, b->port, b->pool);
+		}
+		b->fails = 0;
+		b->ejected = 0;
+	} else {
+		b->fails++;
+		if (b->fails >= maxfails) {
+			jlog(4, "Ejecting backend %s:%d of pool %s after %d failures",
+					b->host, b->port, b->pool, b->fails);
+			b->ejected = time(NULL);
+		}
+	}
+	shmem_unlock(pool_shm);
+}
+
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* probes.h - static tracepoints
+ *
+ * If <sys/sdt.h> from SystemTap is available, the probes below are compiled
+ * into the binary as USDT probes of the provider "jftpgw". A probe that is
+ * not enabled costs a single nop instruction, so they can stay in
+ * production builds and be attached to with systemtap, bpftrace or perf
+ * without restarting the proxy or raising the debuglevel:
+ *
+ *     bpftrace -e 'usdt:/usr/sbin/jftpgw:jftpgw:relay__chunk
+ *                  { @bytes = hist(arg0); }'
+ *
+ * Without <sys/sdt.h> the macros expand to nothing.
+ *
+ * Probe                   Arguments
+ * accept                  client fd, client address (network order)
+ * fork                    pid of the child, client fd
+ * login__success          user, destination host, destination port
+ * login__failure          user, destination host, response code
+ * command                 verb (enum ftp_verb), method, client fd
+ * cache__hit              file name, size
+ * cache__miss             file name, reason (CACHE_NOTAVL_*)
+ * cache__evict            file name, size
+ * data__established       source data fd, destination data fd, mode
+ * relay__chunk            bytes, source fd, destination fd
+ */
+
+#ifndef JFTPGW_PROBES_H
+#define JFTPGW_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#if defined(HAVE_SYS_SDT_H) && defined(DTRACE_PROBE3)
+#define JFTPGW_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(jftpgw, name, a1, a2)
+#define JFTPGW_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(jftpgw, name, a1, a2, a3)
+#else
+#define JFTPGW_PROBE2(name, a1, a2)
+#define JFTPGW_PROBE3(name, a1, a2, a3)
+#endif
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* refresh.c - revalidating cache entries in the background
+ *
+ * Usually every hit of the cache asks the server for the size and the date
+ * of the file before the first byte is sent. With "cachesoftttl" an entry
+ * that has been checked against the server less than that many seconds ago
+ * is sent right away. An entry that is older but younger than
+ * "cachehardttl" is sent right away as well and is queued for the
+ * refresher of the session, only older entries are checked before they are
+ * sent.
+ *
+ * The refresher is forked when the first entry is queued. It logs into the
+ * server on a connection of its own with the login of the session and
+ * checks all the entries that the session queues over that connection
+ * until the session ends. An entry whose file has not changed is marked as
+ * checked, any other is removed. The refresher also prefetches the
+ * siblings of the files of the session, see prefetch.c. */
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include "jftpgw.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* one entry per message, an entry is either queued or not */
+#ifdef SOCK_SEQPACKET
+#define REFRESH_SOCKTYPE	SOCK_SEQPACKET
+#else
+#define REFRESH_SOCKTYPE	SOCK_STREAM
+#endif
+
+/* the connection is probed after being idle for that long */
+#define REFRESH_IDLE		30
+
+
+/* refresh_login() logs into the server of CLNTINFO on a connection of its
+ * own, returns the descriptor or -1. Used by the prefetch workers as well */
+
+int refresh_login(struct clientinfo* clntinfo) {
+	struct message msg;
+	const char* pass;
+	int ss, code;
+
+	ss = openportname(clntinfo->destination, clntinfo->destinationport,
+			  config_get_addroption("controlserveraddress",
+							INADDR_ANY),
+			  (struct portrangestruct*) 0);
+	if (ss < 0) {
+		jlog(4, "Could not connect to %s:%d in the background: %s",
+				clntinfo->destination,
+				clntinfo->destinationport, strerror(errno));
+		return -1;
+	}
+	msg = readall(ss);
+	code = respcode(msg.lastmsg);
+	free(msg.fullmsg);
+	if (code == 220) {
+		sayf(ss, "USER %s\r\n", clntinfo->user);
+		msg = readall(ss);
+		code = respcode(msg.lastmsg);
+		free(msg.fullmsg);
+	}
+	if (code == 331) {
+		pass = clntinfo->pass ? clntinfo->pass : clntinfo->anon_user;
+		sayf(ss, "PASS %s\r\n", pass ? pass : "");
+		msg = readall(ss);
+		code = respcode(msg.lastmsg);
+		free(msg.fullmsg);
+	}
+	if (code != 230) {
+		jlog(4, "Could not log into %s:%d in the background",
+				clntinfo->destination,
+				clntinfo->destinationport);
+		close(ss);
+		return -1;
+	}
+	/* some servers do not tell the size of a file in ASCII mode */
+	say(ss, "TYPE I\r\n");
+	msg = readall(ss);
+	free(msg.fullmsg);
+	jlog(8, "Logged into %s:%d in the background",
+			clntinfo->destination, clntinfo->destinationport);
+	return ss;
+}
+
+
+/* the connection to the server is still there? */
+
+static
+int refresh_alive(int ss) {
+	char* answer;
+	int ok;
+
+	say(ss, "NOOP\r\n");
+	answer = ftp_readline(ss);
+	ok = answer && respcode(answer) < 400;
+	free(answer);
+	return ok;
+}
+
+
+/* the refresher process, it never returns */
+
+static
+void refresh_run(int fd, struct clientinfo* clntinfo) {
+	char line[ MAX_LINE_SIZE ];
+	char* skip;
+	time_t last = 0;
+	ssize_t n;
+
+	clntinfo->serversocket = -1;
+	while ((n = recv(fd, line, sizeof(line) - 1, 0)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		line[n] = '\0';
+		line[ strcspn(line, "\r\n") ] = '\0';
+		if (!line[0]) {
+			continue;
+		}
+		arena_reset();
+		if (clntinfo->serversocket >= 0
+		    && time(NULL) - last > REFRESH_IDLE
+		    && !refresh_alive(clntinfo->serversocket)) {
+			close(clntinfo->serversocket);
+			clntinfo->serversocket = -1;
+		}
+		if (clntinfo->serversocket < 0
+		    && (clntinfo->serversocket
+				= refresh_login(clntinfo)) < 0) {
+			/* the entry is checked when it is used next time
+			 * after cachehardttl */
+			continue;
+		}
+		if (strncmp(line, "prefetch ", 9) == 0) {
+			/* "prefetch <dir>\t<file that the session fetches>" */
+			if ((skip = strchr(line, '\t'))) {
+				*skip++ = '\0';
+			}
+			prefetch_dir(clntinfo, line + 9, "*", skip);
+		} else {
+			cache_refresh(line, clntinfo);
+		}
+		last = time(NULL);
+	}
+	if (clntinfo->serversocket >= 0) {
+		say(clntinfo->serversocket, "QUIT\r\n");
+		close(clntinfo->serversocket);
+	}
+	close(fd);
+	_exit(0);
+}
+
+
+/* fork the refresher of the session */
+
+static
+int refresh_start(struct clientinfo* clntinfo) {
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, REFRESH_SOCKTYPE, 0, sv) < 0) {
+		jlog(3, "Could not create the queue to the refresher: %s",
+				strerror(errno));
+		return -1;
+	}
+	if ((pid = fork()) < 0) {
+		jlog(3, "Could not fork the refresher: %s", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		/* the connections must close when the session closes them */
+		close(sv[0]);
+		close(clntinfo->clientsocket);
+		close(clntinfo->serversocket);
+		if (clntinfo->dataclientsock >= 0) {
+			close(clntinfo->dataclientsock);
+		}
+		if (clntinfo->dataserversock >= 0) {
+			close(clntinfo->dataserversock);
+		}
+		if (clntinfo->cachefd >= 0) {
+			close(clntinfo->cachefd);
+		}
+		if (clntinfo->cachewrfd >= 0) {
+			close(clntinfo->cachewrfd);
+		}
+		refresh_run(sv[1], clntinfo);
+	}
+	close(sv[1]);
+	if (fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) < 0) {
+		jlog(3, "Could not make the refresh queue non-blocking: %s",
+				strerror(errno));
+	}
+	clntinfo->refreshfd = sv[0];
+	jlog(8, "Forked the refresher %d", (int) pid);
+	return 0;
+}
+
+
+/* hand LINE to the refresher of the session, it is started if there is
+ * none yet. If the queue is full the line is dropped */
+
+static
+int refresh_send(struct clientinfo* clntinfo, const char* line) {
+	size_t len = strlen(line);
+
+	if (clntinfo->refreshfd < 0 && refresh_start(clntinfo) < 0) {
+		return -1;
+	}
+	if (send(clntinfo->refreshfd, line, len, MSG_NOSIGNAL)
+			!= (ssize_t) len) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			jlog(7, "The refresh queue is full, not queueing %s",
+					line);
+			return -1;
+		}
+		/* the refresher is gone, the next entry starts a new one */
+		jlog(4, "Could not queue %s for the refresher: %s",
+				line, strerror(errno));
+		close(clntinfo->refreshfd);
+		clntinfo->refreshfd = -1;
+		return -1;
+	}
+	jlog(8, "Queued %s for the refresher", line);
+	return 0;
+}
+
+
+/* refresh_queue() hands the entry of CFS to the refresher of the session.
+ * If the queue is full the entry is not checked this time */
+
+void refresh_queue(struct clientinfo* clntinfo, struct cache_filestruct cfs) {
+	char* line;
+	size_t len;
+
+	len = strlen(cfs.filepath) + strlen(cfs.filename) + 1;
+	line = (char*) arena_alloc(len);
+	snprintf(line, len, "%s%s", cfs.filepath, cfs.filename);
+	refresh_send(clntinfo, line);
+}
+
+
+/* refresh_prefetch() has the refresher of the session prefetch the files in
+ * the directory DIR except SKIP, see prefetch.c */
+
+void refresh_prefetch(struct clientinfo* clntinfo, const char* dir,
+		      const char* skip) {
+	char* line;
+	size_t len;
+
+	len = strlen("prefetch ") + strlen(dir) + 1 + strlen(skip) + 1;
+	line = (char*) arena_alloc(len);
+	snprintf(line, len, "prefetch %s\t%s", dir, skip);
+	refresh_send(clntinfo, line);
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* shmem.c - memory that is shared between the master process and all the
+ * children it forks.
+ *
+ * The areas have to be allocated before the first fork(), i.e. in main().
+ * Areas that are allocated later on are private to the process (which is
+ * what happens in inetd mode anyway).
+ *
+ * The locking is done with fcntl() locks on an unlinked temporary file,
+ * one byte per area. */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "jftpgw.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SHMEM_MAX_AREAS		32
+
+static struct {
+	void* ptr;
+	size_t size;
+} shmem_areas[ SHMEM_MAX_AREAS ];
+
+static int shmem_nareas;
+static int shmem_lockfd = -1;
+
+
+int shmem_init(void) {
+	char lockname[] = "/tmp/jftpgw.lock.XXXXXX";
+
+	if (shmem_lockfd >= 0) {
+		return 0;
+	}
+	shmem_lockfd = mkstemp(lockname);
+	if (shmem_lockfd < 0) {
+		jlog(3, "Could not create the lock file %s: %s",
+				lockname, strerror(errno));
+		return -1;
+	}
+	/* we only need the descriptor */
+	unlink(lockname);
+	return 0;
+}
+
+
+/* shmem_alloc() returns a zeroed memory area of SIZE bytes that is shared
+ * with all processes forked afterwards. It falls back to private memory if
+ * no shared memory can be obtained. */
+
+void* shmem_alloc(size_t size) {
+	void* ptr;
+
+	if (shmem_nareas >= SHMEM_MAX_AREAS) {
+		jlog(2, "Too many shared memory areas");
+		return (void*) 0;
+	}
+
+#ifdef MAP_ANONYMOUS
+	ptr = mmap((void*) 0, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#else
+	{
+		int fd = open("/dev/zero", O_RDWR);
+		if (fd < 0) {
+			ptr = MAP_FAILED;
+		} else {
+			ptr = mmap((void*) 0, size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+			close(fd);
+		}
+	}
+#endif
+	if (ptr == MAP_FAILED) {
+		jlog(4, "Could not map %lu bytes of shared memory: %s",
+				(unsigned long) size, strerror(errno));
+		ptr = calloc(1, size);
+		enough_mem(ptr);
+	}
+
+	shmem_areas[ shmem_nareas ].ptr = ptr;
+	shmem_areas[ shmem_nareas ].size = size;
+	shmem_nareas++;
+
+	return ptr;
+}
+
+
+static
+int shmem_setlock(const void* ptr, int type) {
+	struct flock fl;
+	int i;
+
+	if (shmem_lockfd < 0) {
+		return 0;
+	}
+	for (i = 0; i < shmem_nareas; i++) {
+		if (shmem_areas[i].ptr == ptr) {
+			break;
+		}
+	}
+	if (i == shmem_nareas) {
+		jlog(3, "Trying to lock an unknown shared memory area");
+		return -1;
+	}
+
+	memset((void*) &fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = i;
+	fl.l_len = 1;
+	while (fcntl(shmem_lockfd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR) {
+			jlog(3, "Could not (un)lock the shared memory: %s",
+					strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int shmem_lock(const void* ptr) {
+	return shmem_setlock(ptr, F_WRLCK);
+}
+
+int shmem_unlock(const void* ptr) {
+	return shmem_setlock(ptr, F_UNLCK);
+}
+
+/* a process that closes all of its descriptors has to keep the one of the
+ * lock file */
+
+int shmem_is_lockfd(int fd) {
+	return shmem_lockfd >= 0 && fd == shmem_lockfd;
+}
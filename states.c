@@ -70,6 +70,17 @@ int register_pid(pid_t pid,
 }
 
 
+int registered_pids(void) {
+	struct connliststruct* cls;
+	int n = 0;
+
+	for (cls = connected_clients; cls; cls = cls->next) {
+		n++;
+	}
+	return n;
+}
+
+
 int unregister_pid(pid_t pid) {
 
 	struct connliststruct* cls, *prev = 0;
@@ -108,6 +119,7 @@ int unregister_pid(pid_t pid) {
 						cls->proxy_ip,
 						cls->proxy_port,
 						cls->start_time);
+			pool_release(pid);
 			/* remove that element */
 			free(cls);
 			return 0;
@@ -269,14 +281,28 @@ int save_runasuser_uid(void) {
 	return 0;
 }
 
-struct slist_t* passcmd_create_list(const char* list_str) {
-	if ( ! list_str ) {
-		return (struct slist_t*) 0;
+/* the verbs of the passcmds and dontpasscmds options, words that are no
+ * known verbs are kept in the lists */
+static struct verbset passcmd_white, passcmd_black;
+static int passcmd_sets_built;
+
+static
+int passcmd_list_contains(const struct slist_t* list, const char* cmd,
+			  size_t len) {
+	while (list) {
+		if (strlen(list->value) == len
+		    && strncasecmp(list->value, cmd, len) == 0) {
+			return 1;
+		}
+		list = list->next;
 	}
-	return config_split_line(list_str, WHITESPACES);
+	return 0;
 }
 
-int passcmd_check(const char* cmd) {
+/* passcmd_check() checks the command line CMD whose verb has the ID VERB
+ * and is LEN characters long */
+
+int passcmd_check(const char* cmd, int verb, size_t len) {
 
 	if (strcmp(config_get_option("passcmds"), "*") == 0) {
 		/* this is a dummy and means "checking disabled". The "*"
@@ -285,18 +311,22 @@ int passcmd_check(const char* cmd) {
 		return 1;
 	}
 
-	if ( !passcmd_white_list ) {
-		passcmd_white_list
-			= passcmd_create_list(config_get_option("passcmds"));
-	}
-	if ( !passcmd_black_list ) {
-		passcmd_black_list
-			= passcmd_create_list(config_get_option("dontpasscmds"));
+	if ( !passcmd_sets_built ) {
+		verbset_parse(&passcmd_white, config_get_option("passcmds"),
+				&passcmd_white_list);
+		verbset_parse(&passcmd_black,
+				config_get_option("dontpasscmds"),
+				&passcmd_black_list);
+		passcmd_sets_built = 1;
 	}
 
-	if (slist_case_contains(passcmd_white_list, cmd)
+	if (verb != VERB_UNKNOWN) {
+		return VERBSET_HAS(&passcmd_white, verb)
+			&& !VERBSET_HAS(&passcmd_black, verb);
+	}
+	if (passcmd_list_contains(passcmd_white_list, cmd, len)
 			&&
-	   !slist_case_contains(passcmd_black_list, cmd)) {
+	   !passcmd_list_contains(passcmd_black_list, cmd, len)) {
 
 		return 1;
 	}
@@ -16,6 +16,7 @@
  * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
  */
 
+#include <ctype.h>
 #include "jftpgw.h"
 #include "cmds.h"
 
@@ -27,12 +28,94 @@ int getpasswd(const char*, struct clientinfo*);
 
 int login(struct clientinfo*, int);
 
+/* the argument of a command: everything after the verb and one space */
+
+static
+const char* std_cmdarg(const char* args, int* verb) {
+	size_t len;
+
+	*verb = verb_parse(args, &len);
+	args += len;
+	if (*args == ' ') {
+		args++;
+	}
+	return args;
+}
+
+
+/* If the cache is used, the offset of REST is kept by the proxy. It is sent
+ * to the server right before the transfer, a download may start at another
+ * offset if a part of the file is in the cache */
+
+int std_rest(const char* args, struct conn_info_st* conn_info) {
+	const char* arg;
+	char* end;
+	unsigned long offset;
+	int verb;
+
+	if (!config_get_bool("cache")) {
+		return CMD_PASS;
+	}
+	arg = std_cmdarg(args, &verb);
+	if (arg[0] < '0' || arg[0] > '9') {
+		/* let the server complain */
+		return CMD_PASS;
+	}
+	offset = strtoul(arg, &end, 10);
+	if (*end || offset == ULONG_MAX) {
+		return CMD_PASS;
+	}
+	conn_info->clntinfo->restoffset = offset;
+	sayf(conn_info->clntinfo->clientsocket,
+		"350 Restarting at %lu. Send STORE or RETRIEVE to initiate "
+		"transfer.\r\n", offset);
+	conn_info->lcs->respcode = 350;
+	return CMD_HANDLED;
+}
+
+
+/* std_rest_send() sends REST OFFSET to the server. If the server does not
+ * accept it, the answer is passed to the client and -1 is returned */
+
+static
+int std_rest_send(struct conn_info_st* conn_info, unsigned long offset) {
+	struct message answer;
+	int code;
+
+	sayf(conn_info->clntinfo->serversocket, "REST %lu\r\n", offset);
+	answer = readall(conn_info->clntinfo->serversocket);
+	if (!answer.fullmsg) {
+		if (timeout) {
+			jlog(2, "Timeout in %s line %d\n", __FILE__ ,__LINE__);
+			err_time_readline(conn_info->clntinfo->clientsocket);
+		} else {
+			err_readline(conn_info->clntinfo->clientsocket);
+		}
+		return -1;
+	}
+	code = respcode(answer.fullmsg);
+	if (code != 350) {
+		jlog(6, "The server did not accept REST %lu: %s", offset,
+				answer.lastmsg);
+		say(conn_info->clntinfo->clientsocket, answer.fullmsg);
+		conn_info->lcs->respcode = code;
+		free(answer.fullmsg);
+		return -1;
+	}
+	free(answer.fullmsg);
+	return 0;
+}
+
+
 int transfer_initiate(struct conn_info_st* conn_info, int retrieve_from_cache){
 	int ret;
 	char *t;
 	time_t transfer_start;
+	struct trace_span span;
 
+	trace_begin(&span, TRACE_NEGOTIATE);
 	ret = transfer_negotiate(conn_info->clntinfo);
+	trace_end(&span, VERB_UNKNOWN, ret);
 	if (ret == -1) {
 		/* dramatic error */
 		return 1;
@@ -42,7 +125,9 @@ int transfer_initiate(struct conn_info_st* conn_info, int retrieve_from_cache){
 		/* if there was no error, transfer the file or
 		 * listing */
 		transfer_start = time(NULL);
+		trace_begin(&span, TRACE_TRANSFER);
 		ret = transfer_transmit(conn_info->clntinfo);
+		trace_end(&span, VERB_UNKNOWN, ret);
 		conn_info->lcs->transfer_duration = time(NULL) - transfer_start;
 	} else {
 		/* there was an error in transfer_negotiate but it
@@ -58,11 +143,13 @@ int transfer_initiate(struct conn_info_st* conn_info, int retrieve_from_cache){
 			conn_info->lcs->respcode = 226;
 			conn_info->lcs->complete = 1;
 		} else {
+			/* wait for the server to confirm the transfer */
+			trace_begin(&span, TRACE_PASSCMD);
 			t = passall(conn_info->clntinfo->serversocket,
 				    conn_info->clntinfo->clientsocket);
+			trace_end(&span, VERB_UNKNOWN, respcode(t));
 			conn_info->lcs->respcode = respcode(t);
 			conn_info->lcs->complete = conn_info->lcs->respcode == 226;
-			free(t);
 		}
 	} else {
 		if (ret == TRNSMT_ABORTED) {
@@ -99,7 +186,6 @@ int std_quit(const char* args, struct conn_info_st* conn_info) {
 		say(ss, "QUIT\r\n");
 		response = passall(ss, cs);
 		conn_info->lcs->respcode = respcode(response);
-		free(response);
 	} else {
 		/* Generate an own goodbye message if we are
 		 * not yet connected */
@@ -115,7 +201,19 @@ int std_pasv(const char* args, struct conn_info_st* conn_info) {
 
 	if (conn_info->clntinfo->servermode == PASSIVE || 
 	    conn_info->clntinfo->servermode == ASCLIENT) {
-		ret = pasvserver(conn_info->clntinfo);
+		/* send the PASV to the server right away and open the port
+		 * for the client while its answer is on the way */
+		ret = pasvserver_request(conn_info->clntinfo);
+		if ( ! ret ) {
+			int bindret = pasvclient_bind(conn_info->clntinfo);
+			/* read the answer in any case to keep the control
+			 * connection in sync */
+			ret = pasvserver_reply(conn_info->clntinfo);
+			ret |= bindret;
+		}
+		if ( ! ret ) {
+			ret = pasvclient_announce(conn_info->clntinfo);
+		}
 		if (ret == 0) {
 			conn_info->lcs->respcode = 227;
 		}
@@ -123,11 +221,11 @@ int std_pasv(const char* args, struct conn_info_st* conn_info) {
 		ret = activeserver(&answer, conn_info->clntinfo);
 		conn_info->lcs->respcode = respcode(answer);
 		free(answer);
+		if ( ! ret ) {
+			ret |= pasvclient(conn_info->clntinfo);
+		}
 	}
 
-	if ( ! ret ) {
-		ret |= pasvclient(conn_info->clntinfo);
-	}
 	if (ret) {
 		if (errno == EPIPE) {
 			/* The remote server has closed the connection */
@@ -187,6 +285,11 @@ int std_port(const char* args, struct conn_info_st* conn_info) {
 int std_stor(const char* args, struct conn_info_st* conn_info) {
 	/* chop of the "STOR "/"STOU "/"APPE " prefix */
 	char* space = strchr(args, ' ');
+	char* path = (char*) 0;
+	const char* arg;
+	struct cache_filestruct cfs;
+	struct digest digest;
+	int verb, ret, keep;
 	if (space) {
 		conn_info->lcs->filename = space + 1;
 	} else {
@@ -220,17 +323,68 @@ int std_stor(const char* args, struct conn_info_st* conn_info) {
 		free(answer.fullmsg);
 	}
 
+	arg = std_cmdarg(args, &verb);
+	if (mdcache_enabled()) {
+		/* the name of STOU is chosen by the server, in the working
+		 * directory */
+		path = mdcache_path(conn_info->clntinfo,
+					verb == VERB_STOU ? "" : arg);
+	}
+
+	/* the copy in the cache is out of date. A complete upload in binary
+	 * mode goes to the cache on the way, appended or partial uploads
+	 * only remove it */
+	cfs.filepath = cfs.filename = cfs.checksum = (char*) 0;
+	if (config_get_bool("cache") && verb != VERB_STOU) {
+		cfs = cache_gather_info(arg, conn_info->clntinfo,
+						CACHE_INFO_PATH);
+		keep = verb == VERB_STOR
+			&& conn_info->clntinfo->restoffset == 0
+			&& conn_info->clntinfo->transfermode_server
+							== TRANSFER_BINARY
+			&& config_get_bool("cachewritethrough");
+		conn_info->clntinfo->cachefd = cache_upload(cfs, keep);
+		if (conn_info->clntinfo->cachefd >= 0) {
+			conn_info->clntinfo->tocache = 1;
+			conn_info->clntinfo->cachestored = 0;
+			digest_init(&digest);
+			conn_info->clntinfo->cachedigest = &digest;
+		}
+	}
+
+	ret = CMD_ERROR;
+	if (conn_info->clntinfo->restoffset
+	    && std_rest_send(conn_info, conn_info->clntinfo->restoffset) < 0) {
+		goto out;
+	}
 	if (passcmd(args, conn_info->clntinfo) < 0) {
-		return CMD_ERROR;
+		goto out;
 	}
 	if (conn_info->lcs->respcode != 125 && conn_info->lcs->respcode != 150) {
-		return CMD_ERROR;
+		goto out;
 	}
-	if (transfer_initiate(conn_info, 0)) {
-		return CMD_ERROR;
+	ret = transfer_initiate(conn_info, 0) ? CMD_ERROR : CMD_HANDLED;
+	if (mdcache_enabled()) {
+		mdcache_invalidate(conn_info->clntinfo, path);
 	}
 
-	return CMD_HANDLED;
+out:
+	if (conn_info->clntinfo->tocache) {
+		if (conn_info->clntinfo->cachefd >= 0) {
+			/* the transfer has not begun */
+			close(conn_info->clntinfo->cachefd);
+			conn_info->clntinfo->cachefd = -1;
+		}
+		cache_uploaded(cfs, conn_info->clntinfo,
+				conn_info->clntinfo->cachestored, &digest,
+				ret == CMD_HANDLED
+					&& conn_info->lcs->complete);
+	}
+	conn_info->clntinfo->tocache = 0;
+	conn_info->clntinfo->cachedigest = (struct digest*) 0;
+	free(cfs.filepath);
+	free(cfs.filename);
+	return ret;
 }
 
 int std_retr(const char* args, struct conn_info_st* conn_info) {
@@ -239,6 +393,11 @@ int std_retr(const char* args, struct conn_info_st* conn_info) {
 	int retrieve_from_cache = 0;
 	int ret;
 	char* last = (char*) 0;
+	char* path = (char*) 0, *reply;
+	unsigned long offset, avail, cachestart = 0, sent, prefix;
+	int converting;
+	struct digest digest;
+	struct trace_span span;
 
 	/* chop off the "RETR " prefix */
 	char* space = strchr(args, ' ');
@@ -249,6 +408,20 @@ int std_retr(const char* args, struct conn_info_st* conn_info) {
 	}
 	conn_info->lcs->direction = 'o';
 
+	cfs.filepath = cfs.filename = cfs.checksum = (char*) 0;
+
+	/* a file that has just been missing is not asked for again */
+	if (mdcache_enabled()) {
+		path = mdcache_path(conn_info->clntinfo,
+					conn_info->lcs->filename);
+		if ((reply = mdcache_lookup(conn_info->clntinfo,
+						VERB_RETR, path))) {
+			say(conn_info->clntinfo->clientsocket, reply);
+			conn_info->lcs->respcode = respcode(reply);
+			return CMD_ERROR;
+		}
+	}
+
 	/* check the transfer mode */
 	/* we always want to have a binary connection to the server if we're
 	 * retrieving a file and the cache is used */
@@ -286,47 +459,91 @@ int std_retr(const char* args, struct conn_info_st* conn_info) {
 							= CONV_NOTCONVERT;
 	}
 
-	if (config_get_bool("cache")) {
+	/* the offset of a REST command before */
+	offset = conn_info->clntinfo->restoffset;
+	conn_info->clntinfo->restoffset = 0;
+	conn_info->clntinfo->cachefd = -1;
+	conn_info->clntinfo->fromcache = 0;
+	conn_info->clntinfo->tocache = 0;
+	conn_info->clntinfo->cacheprefix = 0;
+	conn_info->clntinfo->cachestored = 0;
+	converting = conn_info->clntinfo->transfermode_havetoconvert
+							!= CONV_NOTCONVERT;
+
+	/* the offset of a converted transfer does not refer to the binary
+	 * data in the cache */
+	if (config_get_bool("cache") && !(converting && offset)) {
 		cfs = cache_gather_info(conn_info->lcs->filename,
-					conn_info->clntinfo);
-		/* try to read the file from the cache */
-		if ((conn_info->clntinfo->cachefd = cache_readfd(cfs)) < 0) {
-			/* okay, it is not in, so try to create it */
-			jlog(9, "File %s not in cache",
+				conn_info->clntinfo,
+				config_compare_option("cachevalidate", "md5")
+					? CACHE_INFO_HASH : CACHE_INFO_DATE);
+		if (cfs.stale) {
+			refresh_queue(conn_info->clntinfo, cfs);
+		}
+		prefetch_siblings(conn_info->clntinfo, cfs);
+		conn_info->clntinfo->cachebuf = cache_mem(cfs, offset,
+					&conn_info->clntinfo->cachebuflen);
+		if (conn_info->clntinfo->cachebuf) {
+			/* neither the info file nor the data file are
+			 * needed */
+			jlog(9, "File %s was in memory",
 						conn_info->lcs->filename);
-			conn_info->clntinfo->fromcache = 0;
-			if ((conn_info->clntinfo->cachefd
-						= cache_writefd(cfs)) < 0) {;
-				conn_info->clntinfo->tocache = 0;
-			} else {
-				conn_info->clntinfo->tocache = 1;
-			}
-		} else {
+			conn_info->clntinfo->fromcache = 1;
+		} else if ((conn_info->clntinfo->cachefd
+				= cache_open(cfs, offset, &avail,
+					&conn_info->clntinfo->cachez)) < 0) {
+			jlog(9, "File %s is not cached",
+						conn_info->lcs->filename);
+		} else if (offset + avail >= cfs.size) {
 			jlog(9, "File %s was in cache",
 						conn_info->lcs->filename);
 			conn_info->clntinfo->fromcache = 1;
-			conn_info->clntinfo->tocache = 0;
+		} else {
+			/* send what we have and get the rest from the server,
+			 * it is added to the cache. A converted transfer
+			 * starts from the beginning */
+			if (converting) {
+				avail = 0;
+			}
+			jlog(9, "%lu bytes of %s from offset %lu are in cache",
+					avail, conn_info->lcs->filename,
+					offset);
+			conn_info->clntinfo->tocache = 1;
+			conn_info->clntinfo->cacheprefix = avail;
+			cachestart = offset + avail;
+			/* the sums are computed on the way if the client
+			 * gets all of the file */
+			if (offset == 0) {
+				digest_init(&digest);
+				conn_info->clntinfo->cachedigest = &digest;
+			}
 		}
-		free(cfs.filepath);
-		free(cfs.filename);
 	} else {
 		/* no cache active */
 		jlog(9, "caching not active");
-		conn_info->clntinfo->fromcache = 0;
-		conn_info->clntinfo->tocache = 0;
-	}
-	if (conn_info->clntinfo->fromcache) {
-		/* do not send the RETR command to the server */
 	}
 
 	/* pass the request to the server if we do not have the file in the
 	 * cache */
 	if ( ! conn_info->clntinfo->fromcache ) {
+		if (offset + conn_info->clntinfo->cacheprefix > 0
+		    && std_rest_send(conn_info,
+			    offset + conn_info->clntinfo->cacheprefix) < 0) {
+			if (conn_info->clntinfo->tocache) {
+				close(conn_info->clntinfo->cachefd);
+				conn_info->clntinfo->cachefd = -1;
+				conn_info->clntinfo->tocache = 0;
+			}
+			ret = CMD_ERROR;
+			goto out;
+		}
+		trace_begin(&span, TRACE_PASSCMD);
 		sayf(conn_info->clntinfo->serversocket, "RETR %s\r\n",
 						conn_info->lcs->filename);
 
 		last = passall(conn_info->clntinfo->serversocket,
 					conn_info->clntinfo->clientsocket);
+		trace_end(&span, VERB_RETR, respcode(last));
 		if (last) {
 			jlog(9, "Send (client - %d): %s",
 				conn_info->clntinfo->clientsocket, last);
@@ -339,23 +556,22 @@ int std_retr(const char* args, struct conn_info_st* conn_info) {
 			} else {
 				err_readline(conn_info->clntinfo->clientsocket);
 			}
-			return CMD_ERROR;
+			ret = CMD_ERROR;
+			goto out;
 		}
 		if (!checkdigits(last, 150) && !checkdigits(last, 125)) {
 			jlog(4, "Server returned invalid response: %s", last);
-			if (conn_info->clntinfo->fromcache) {
+			if (conn_info->clntinfo->tocache) {
 				close(conn_info->clntinfo->cachefd);
 				conn_info->clntinfo->cachefd = -1;
-			} else if (conn_info->clntinfo->tocache) {
-				close(conn_info->clntinfo->cachefd);
-				conn_info->clntinfo->cachefd = -1;
-				cfs = cache_gather_info(
-					conn_info->lcs->filename,
-					conn_info->clntinfo);
+				conn_info->clntinfo->tocache = 0;
 				cache_delete(cfs, 1);
 			}
+			/* remember a 550 if negcachetime is set */
+			mdcache_store(conn_info->clntinfo, VERB_RETR, path, last);
 			/* say(conn_info->clntinfo->clientsocket, last); */
-			return CMD_ERROR;
+			ret = CMD_ERROR;
+			goto out;
 		}
 	} else {
 		/* we pretend to be the server */
@@ -367,39 +583,63 @@ int std_retr(const char* args, struct conn_info_st* conn_info) {
 
 	/* Okay, everything is fine, establish a connection */
 
-	ret = transfer_initiate(conn_info, retrieve_from_cache);
-	if (ret != TRNSMT_SUCCESS && ret != TRNSMT_ABORTED) {
-		return CMD_ERROR;
+	if (conn_info->clntinfo->tocache
+	    && cachewr_start(conn_info->clntinfo, cfs, cachestart) == 0) {
+		/* the writer computes the sums */
+		conn_info->clntinfo->cachedigest = (struct digest*) 0;
 	}
 
-	if (ret == TRNSMT_SUCCESS && conn_info->lcs->respcode == 226) {
-		/* add to cache */
-		if (conn_info->clntinfo->tocache) {
-			struct cache_filestruct cfs;
-			cfs = cache_gather_info(conn_info->lcs->filename,
-							conn_info->clntinfo);
-			cache_add(cfs);
-			free(cfs.filepath);
-			free(cfs.filename);
+	ret = transfer_initiate(conn_info, retrieve_from_cache);
+
+	if (cfs.filename) {
+		/* the bytes from the cache and from the server */
+		sent = conn_info->lcs->transferred;
+		if (retrieve_from_cache) {
+			cacheadm_count(sent, 0, 0);
+		} else if (conn_info->clntinfo->tocache) {
+			prefix = MIN_VAL(conn_info->clntinfo->cacheprefix, sent);
+			cacheadm_count(prefix, sent - prefix, 0);
+		} else {
+			cacheadm_count(0, sent, 1);
 		}
+	}
+
+	/* what has arrived is kept, even if the transfer has been aborted.
+	 * The size and the date from before the transfer are still good
+	 * enough */
+	if (conn_info->clntinfo->tocache) {
+		cachewr_finish(conn_info->clntinfo, cfs, cachestart);
+	}
+	if (ret != TRNSMT_SUCCESS && ret != TRNSMT_ABORTED) {
+		ret = CMD_ERROR;
 	} else {
-		if (conn_info->clntinfo->tocache) {
-			/* delete again from cache - should not
-			 * happen */
-			struct cache_filestruct cfs;
-			cfs = cache_gather_info(conn_info->lcs->filename,
-							conn_info->clntinfo);
-			cache_delete(cfs, 1);
-			free(cfs.filepath);
-			free(cfs.filename);
-		}
+		ret = CMD_HANDLED;
 	}
+
+out:
+	free(conn_info->clntinfo->cachebuf);
+	conn_info->clntinfo->cachebuf = (char*) 0;
+	conn_info->clntinfo->cachebuflen = 0;
+	cachez_close(conn_info->clntinfo->cachez);
+	conn_info->clntinfo->cachez = (struct cachez*) 0;
 	conn_info->clntinfo->fromcache  = 0;
 	conn_info->clntinfo->tocache    = 0;
-	return CMD_HANDLED;
+	conn_info->clntinfo->cacheprefix = 0;
+	conn_info->clntinfo->cachedigest = (struct digest*) 0;
+	free(cfs.filepath);
+	free(cfs.filename);
+	free(cfs.checksum);
+	return ret;
 }
 
 int std_list(const char* args, struct conn_info_st* conn_info) {
+	if (config_get_ioption("prefetchsiblings", 0) > 0) {
+		prefetch_listed(args, conn_info->clntinfo);
+	}
+	if (conn_info->clntinfo->restoffset
+	    && std_rest_send(conn_info, conn_info->clntinfo->restoffset) < 0) {
+		return CMD_ERROR;
+	}
 	if (passcmd(args, conn_info->clntinfo) < 0) {
 		return CMD_ERROR;
 	}
@@ -466,6 +706,181 @@ int std_type(const char* args, struct conn_info_st* conn_info) {
 	return CMD_HANDLED;
 }
 
+/* SIZE, MDTM, MLST and STAT with an argument are answered from the metadata
+ * cache if possible, the answer of the server is put into it otherwise */
+
+int std_metacmd(const char* args, struct conn_info_st* conn_info) {
+	struct clientinfo* clntinfo = conn_info->clntinfo;
+	struct message answer;
+	struct trace_span span;
+	char* path, *reply;
+	int verb;
+
+	if (!mdcache_enabled()) {
+		return CMD_PASS;
+	}
+	path = mdcache_path(clntinfo, std_cmdarg(args, &verb));
+	if (!path) {
+		return CMD_PASS;
+	}
+	if ((reply = mdcache_lookup(clntinfo, verb, path))) {
+		say(clntinfo->clientsocket, reply);
+		conn_info->lcs->respcode = respcode(reply);
+		return CMD_HANDLED;
+	}
+
+	trace_begin(&span, TRACE_PASSCMD);
+	sayf(clntinfo->serversocket, "%s\r\n", args);
+	answer = readall(clntinfo->serversocket);
+	trace_end(&span, verb, respcode(answer.fullmsg));
+	if (!answer.fullmsg) {
+		if (timeout) {
+			jlog(2, "Timeout in %s line %d\n", __FILE__ ,__LINE__);
+			err_time_readline(clntinfo->clientsocket);
+		} else {
+			err_readline(clntinfo->clientsocket);
+		}
+		return CMD_ABORT;
+	}
+	say(clntinfo->clientsocket, answer.fullmsg);
+	conn_info->lcs->respcode = respcode(answer.fullmsg);
+	mdcache_store(clntinfo, verb, path, answer.fullmsg);
+	free(answer.fullmsg);
+	return CMD_HANDLED;
+}
+
+
+/* XMD5, XCRC and HASH are answered from the cache if the file is complete
+ * there, the server does not have to read the file again. HASH only if the
+ * client has chosen an algorithm that the cache knows */
+
+int std_hash(const char* args, struct conn_info_st* conn_info) {
+	struct clientinfo* clntinfo = conn_info->clntinfo;
+	struct cache_filestruct cfs;
+	char md5[ DIGEST_MD5LEN ];
+	unsigned long crc;
+	const char* arg;
+	int verb, ret, i;
+
+	if (!config_get_bool("cache")) {
+		return CMD_PASS;
+	}
+	arg = std_cmdarg(args, &verb);
+	if (verb == VERB_HASH && clntinfo->hashalgo == HASH_ALGO_OTHER) {
+		return CMD_PASS;
+	}
+	/* XMD5 and XCRC may have a range of the file after the name */
+	if (!*arg || (verb != VERB_HASH && strchr(arg, ' '))) {
+		return CMD_PASS;
+	}
+	cfs = cache_gather_info(arg, clntinfo, CACHE_INFO_PATH);
+	ret = cache_sums(&cfs, clntinfo, md5, &crc);
+	free(cfs.filepath);
+	free(cfs.filename);
+	if (ret < 0) {
+		return CMD_PASS;
+	}
+
+	jlog(8, "Answering %s from the cache", verb_name(verb));
+	if (verb == VERB_HASH) {
+		if (clntinfo->hashalgo == HASH_ALGO_MD5) {
+			sayf(clntinfo->clientsocket, "213 MD5 0-%lu %s %s\r\n",
+					cfs.size - 1, md5, arg);
+		} else {
+			sayf(clntinfo->clientsocket,
+					"213 CRC32 0-%lu %08lx %s\r\n",
+					cfs.size - 1, crc, arg);
+		}
+		conn_info->lcs->respcode = 213;
+		return CMD_HANDLED;
+	}
+	if (verb == VERB_XMD5) {
+		for (i = 0; md5[i]; i++) {
+			md5[i] = toupper((int) md5[i]);
+		}
+		sayf(clntinfo->clientsocket, "250 %s\r\n", md5);
+	} else {
+		sayf(clntinfo->clientsocket, "250 %08lX\r\n", crc);
+	}
+	conn_info->lcs->respcode = 250;
+	return CMD_HANDLED;
+}
+
+
+/* the algorithm of HASH is noted if the server accepts it */
+
+int std_opts(const char* args, struct conn_info_st* conn_info) {
+	struct clientinfo* clntinfo = conn_info->clntinfo;
+	const char* arg;
+	int verb;
+
+	if (!config_get_bool("cache")) {
+		return CMD_PASS;
+	}
+	arg = std_cmdarg(args, &verb);
+	if (strncasecmp(arg, "HASH ", 5) != 0) {
+		return CMD_PASS;
+	}
+	arg += 5;
+	if (passcmd(args, clntinfo) < 0) {
+		return CMD_ABORT;
+	}
+	if (conn_info->lcs->respcode == 200) {
+		if (strcasecmp(arg, "MD5") == 0) {
+			clntinfo->hashalgo = HASH_ALGO_MD5;
+		} else if (strcasecmp(arg, "CRC32") == 0) {
+			clntinfo->hashalgo = HASH_ALGO_CRC32;
+		} else {
+			clntinfo->hashalgo = HASH_ALGO_OTHER;
+		}
+	}
+	return CMD_HANDLED;
+}
+
+
+/* the working directory is asked for again after it may have changed */
+
+int std_cwd(const char* args, struct conn_info_st* conn_info) {
+	mdcache_forget_cwd(conn_info->clntinfo);
+	return CMD_PASS;
+}
+
+
+/* commands that modify files remove the affected entries from the metadata
+ * cache after the server has answered */
+
+int std_modify(const char* args, struct conn_info_st* conn_info) {
+	struct clientinfo* clntinfo = conn_info->clntinfo;
+	const char* arg;
+	char* path = (char*) 0;
+	int verb;
+
+	if (!mdcache_enabled()) {
+		return CMD_PASS;
+	}
+	arg = std_cmdarg(args, &verb);
+	if (verb == VERB_MFMT || verb == VERB_MFCT) {
+		/* the time comes first */
+		arg += strcspn(arg, " ");
+		if (*arg == ' ') {
+			arg++;
+		}
+	}
+	/* the path of the others is not known, all the entries of the login
+	 * are removed. RNTO has to follow RNFR immediately, PWD must not be
+	 * sent in between */
+	if (verb != VERB_SITE && verb != VERB_MFF
+	    && (verb != VERB_RNTO || arg[0] == '/' || clntinfo->cwd)) {
+		path = mdcache_path(clntinfo, arg);
+	}
+	if (passcmd(args, clntinfo) < 0) {
+		return CMD_ABORT;
+	}
+	mdcache_invalidate(clntinfo, path);
+	return CMD_HANDLED;
+}
+
+
 int std_loggedin(const char* args, struct conn_info_st* conn_info) {
 	say(conn_info->clntinfo->clientsocket,
 			"503 You are already logged in!\r\n");
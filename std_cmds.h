@@ -25,6 +25,12 @@ int std_stor(const char*, struct conn_info_st*);
 int std_retr(const char*, struct conn_info_st*);
 int std_type(const char*, struct conn_info_st*);
 int std_list(const char*, struct conn_info_st*);
+int std_metacmd(const char*, struct conn_info_st*);
+int std_cwd(const char*, struct conn_info_st*);
+int std_modify(const char*, struct conn_info_st*);
+int std_rest(const char*, struct conn_info_st*);
+int std_hash(const char*, struct conn_info_st*);
+int std_opts(const char*, struct conn_info_st*);
 
 
 struct cmdhandlerstruct std_cmdhandler[] = {
@@ -39,10 +45,36 @@ struct cmdhandlerstruct std_cmdhandler[] = {
 	{ "RETR ", std_retr },
 	{ "APPE ", std_stor },
 	{ "TYPE ", std_type },
+	{ "REST ", std_rest },
 	{ "QUIT", std_quit },
 	{ "LIST", std_list },
 	{ "NLST", std_list },
   { "MLSD", std_list },
+	{ "SIZE ", std_metacmd },
+	{ "MDTM ", std_metacmd },
+	{ "MLST", std_metacmd },
+	{ "STAT ", std_metacmd },
+	{ "CWD", std_cwd },
+	{ "XCWD", std_cwd },
+	{ "CDUP", std_cwd },
+	{ "XCUP", std_cwd },
+	{ "SMNT", std_cwd },
+	{ "REIN", std_cwd },
+	{ "DELE ", std_modify },
+	{ "RNFR ", std_modify },
+	{ "RNTO ", std_modify },
+	{ "MKD ", std_modify },
+	{ "XMKD ", std_modify },
+	{ "RMD ", std_modify },
+	{ "XRMD ", std_modify },
+	{ "SITE ", std_modify },
+	{ "MFMT ", std_modify },
+	{ "MFCT ", std_modify },
+	{ "MFF ", std_modify },
+	{ "XMD5 ", std_hash },
+	{ "XCRC ", std_hash },
+	{ "HASH ", std_hash },
+	{ "OPTS ", std_opts },
 	{ 0, 0 }
 };
 
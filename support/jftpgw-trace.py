@@ -0,0 +1,130 @@
+#!/usr/bin/env python
+#
+# jftpgw-trace.py - print the latency distributions of a jftpgw trace file
+#
+#     jftpgw-trace.py [-s trace-id] tracefile ...
+#
+# The trace file is written by jftpgw if the "tracefile" option is set. For
+# every stage the number of spans and the percentiles of their duration are
+# printed. The commands are split into the time spent waiting for the
+# server, the time of the data transfer and the remaining proxy time.
+
+import struct
+import sys
+
+MAGIC = 0x4a475432
+RECORD = "IIIIIIQQQiI"
+RECSIZE = struct.calcsize("=" + RECORD)
+
+STAGES = {
+	1: "child setup",
+	2: "config matching",
+	3: "server connect",
+	4: "USER to server",
+	5: "PASS to server",
+	6: "passed command",
+	7: "transfer setup",
+	8: "cache lookup",
+	9: "transfer",
+	10: "command",
+}
+COMMAND = 10
+
+# keep in sync with verbs.h, support/mkverbs.py generates both
+VERBS = """
+	ABOR ACCT ADAT ALLO APPE AUTH CCC  CDUP CLNT CONF CWD  DELE ENC  EPRT
+	EPSV FEAT HASH HELP LANG LIST MDTM MFCT MFF  MFMT MIC  MKD  MLSD MLST
+	MODE NLST NOOP OPEN OPTS PASS PASV PBSZ PORT PROT PWD  QUIT REIN REST
+	RETR RMD  RNFR RNTO SITE SIZE SMNT STAT STOR STOU STRU SYST TYPE USER
+	XCRC XCUP XCWD XMD5 XMKD XPWD XRMD
+""".split()
+VERBS.sort()
+
+def verbname(v):
+	if v < 1 or v > len(VERBS):
+		return "other"
+	return VERBS[v - 1]
+
+def read_records(fname, only):
+	f = open(fname, "rb")
+	data = f.read()
+	f.close()
+	order = None
+	for o in ("<", ">"):
+		if len(data) >= 4 and struct.unpack(o + "I", data[:4])[0] == MAGIC:
+			order = o
+	if order is None:
+		sys.stderr.write("%s: not a jftpgw trace file\n" % fname)
+		return []
+	recs = []
+	for off in range(0, len(data) - RECSIZE + 1, RECSIZE):
+		r = struct.unpack(order + RECORD, data[off:off + RECSIZE])
+		if r[0] != MAGIC:
+			sys.stderr.write("%s: bad record at %d\n" % (fname, off))
+			break
+		if only is not None and r[1] != only:
+			continue
+		recs.append(r)
+	return recs
+
+def percentile(values, p):
+	i = int(round(p / 100.0 * (len(values) - 1)))
+	return values[i]
+
+def ms(usec):
+	return "%9.2f" % (usec / 1000.0)
+
+def print_table(title, rows):
+	print(title)
+	print("%-16s %7s %9s %9s %9s %9s %9s" % ("", "count", "mean", "p50",
+					 "p90", "p99", "max"))
+	for name, values in rows:
+		values.sort()
+		mean = sum(values) / float(len(values))
+		print("%-16s %7d %s %s %s %s %s" % (name, len(values), ms(mean),
+			ms(percentile(values, 50)), ms(percentile(values, 90)),
+			ms(percentile(values, 99)), ms(values[-1])))
+	print("")
+
+def main(args):
+	only = None
+	if len(args) > 1 and args[0] == "-s":
+		only = int(args[1])
+		args = args[2:]
+	if not args:
+		sys.stderr.write("usage: jftpgw-trace.py [-s trace-id] tracefile ...\n")
+		return 1
+	recs = []
+	for fname in args:
+		recs.extend(read_records(fname, only))
+	if not recs:
+		return 0
+
+	stages = {}
+	verbs = {}
+	for r in recs:
+		stages.setdefault(r[2], []).append(r[6])
+		if r[2] == COMMAND:
+			v = verbs.setdefault(verbname(r[3]), ([], [], [], []))
+			v[0].append(r[6])
+			v[1].append(r[7])
+			v[2].append(r[8])
+			v[3].append(max(r[6] - r[7] - r[8], 0))
+
+	print("%d spans of %d sessions, times in milliseconds\n"
+	      % (len(recs), len(set([r[1] for r in recs]))))
+	rows = []
+	for s in sorted(stages.keys()):
+		rows.append((STAGES.get(s, "stage %d" % s), stages[s]))
+	print_table("Stages", rows)
+
+	for i, title in ((0, "Commands: total"), (1, "Commands: server"),
+			 (2, "Commands: transfer"), (3, "Commands: proxy")):
+		rows = []
+		for name in sorted(verbs.keys()):
+			rows.append((name, verbs[name][i]))
+		print_table(title, rows)
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+#
+# mkverbs.py - generate the perfect hash over the FTP verbs
+#
+# Writes verbs.h (the verb IDs) and verbhash.h (the lookup tables for
+# verb.c). Run it from the top source directory after changing the list:
+#
+#     python support/mkverbs.py
+#
+# A verb has up to four letters or digits, each of them is mapped to a
+# number between 1 and 36 and the numbers are packed into a key of six bits
+# per character. The slot of a key is the upper part of key * multiplier,
+# the script searches a multiplier for which no two verbs share a slot.
+
+import sys
+
+verbs = """
+	ABOR ACCT ADAT ALLO APPE AUTH CCC  CDUP CLNT CONF CWD  DELE ENC  EPRT
+	EPSV FEAT HASH HELP LANG LIST MDTM MFCT MFF  MFMT MIC  MKD  MLSD MLST
+	MODE NLST NOOP OPEN OPTS PASS PASV PBSZ PORT PROT PWD  QUIT REIN REST
+	RETR RMD  RNFR RNTO SITE SIZE SMNT STAT STOR STOU STRU SYST TYPE USER
+	XCRC XCUP XCWD XMD5 XMKD XPWD XRMD
+""".split()
+
+bits = 8
+
+def charval(c):
+	if c.isdigit():
+		return ord(c) - ord('0') + 27
+	return ord(c.upper()) - ord('A') + 1
+
+def key(verb):
+	k = 0
+	for c in verb:
+		k = (k << 6) | charval(c)
+	return k
+
+def slot(k, mult):
+	return ((k * mult) & 0xffffffff) >> (32 - bits)
+
+def search():
+	mult = 0x9e3779b1
+	while 1:
+		slots = {}
+		for v in verbs:
+			slots[slot(key(v), mult)] = v
+		if len(slots) == len(verbs):
+			return mult
+		mult = (mult + 2) & 0xffffffff
+
+if len(verbs) >= (1 << bits) or len(verbs) > 254:
+	sys.stderr.write("too many verbs\n")
+	sys.exit(1)
+verbs.sort()
+mult = search()
+
+header = "/* generated by support/mkverbs.py, do not edit */\n\n"
+
+f = open("verbs.h", "w")
+f.write(header)
+f.write("enum ftp_verb {\n\tVERB_UNKNOWN = 0,\n")
+for v in verbs:
+	f.write("\tVERB_%s,\n" % v)
+f.write("\tVERB_MAX\n};\n\n")
+f.write("#define VERB_MAXLEN\t\t4\n")
+f.write("#define VERB_HASH_BITS\t\t%d\n" % bits)
+f.write("#define VERB_HASH_MULT\t\t0x%08xUL\n" % mult)
+f.close()
+
+table = [0] * (1 << bits)
+for i in range(len(verbs)):
+	table[slot(key(verbs[i]), mult)] = i + 1
+
+f = open("verbhash.h", "w")
+f.write(header)
+f.write("static const char* verb_names[ VERB_MAX ] = {\n\t\"\",")
+for i in range(len(verbs)):
+	if i % 8 == 0:
+		f.write("\n\t")
+	else:
+		f.write(" ")
+	f.write("\"%s\"," % verbs[i])
+f.write("\n};\n\n")
+f.write("static const unsigned char verb_slots[ 1 << VERB_HASH_BITS ] = {")
+for i in range(len(table)):
+	if i % 16 == 0:
+		f.write("\n\t")
+	else:
+		f.write(" ")
+	f.write("%d," % table[i])
+f.write("\n};\n")
+f.close()
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* trace.c - latency tracing
+ *
+ * If "tracefile" is set, the time spent in the stages of a session is
+ * appended to that file as fixed size binary records. All processes share
+ * the file, the records are small enough to be appended atomically. Every
+ * session has a trace ID that is also available to the command log (%x).
+ *
+ * A record of a command carries the time that was spent waiting for the
+ * server and the time of the data transfer, the remainder is the time of
+ * the proxy itself. support/jftpgw-trace.py prints the distributions. */
+
+#include <fcntl.h>
+#include "jftpgw.h"
+
+/* in the native byte order, the reader can tell it by the magic number */
+struct trace_record {
+	unsigned int magic;
+	unsigned int trace_id;
+	unsigned int stage;
+	unsigned int verb;
+	unsigned int start_sec;		/* monotonic clock */
+	unsigned int start_usec;
+	/* microseconds, 64 bits for transfers longer than an hour */
+	unsigned long long duration;
+	unsigned long long upstream;	/* of a command: waiting for the server */
+	unsigned long long transfer;	/* of a command: data transfer */
+	int result;
+	unsigned int reserved;		/* explicit padding for the reader */
+};
+
+static int trace_fd = -1;
+static char* trace_fname;
+static unsigned int trace_id;
+
+/* the times that the current command has spent in the other stages */
+static unsigned long long trace_cmd_upstream;
+static unsigned long long trace_cmd_transfer;
+
+
+static
+void trace_now(unsigned int* sec, unsigned int* usec) {
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		*sec = ts.tv_sec;
+		*usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif
+	gettimeofday(&tv, NULL);
+	*sec = tv.tv_sec;
+	*usec = tv.tv_usec;
+}
+
+
+/* trace_init() opens the trace file, it is called together with the
+ * initialization of the logfiles and when the configuration changes */
+
+int trace_init(void) {
+	const char* fname = config_get_option("tracefile");
+
+	if (trace_fname && fname && strcmp(trace_fname, fname) == 0) {
+		return 0;
+	}
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	free(trace_fname);
+	trace_fname = (char*) 0;
+	if (!fname) {
+		return 0;
+	}
+
+	trace_fd = open(fname, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (trace_fd < 0) {
+		jlog(3, "Could not open the trace file %s: %s", fname,
+				strerror(errno));
+		return -1;
+	}
+	trace_fname = strdup(fname);
+	enough_mem(trace_fname);
+	return 0;
+}
+
+
+/* trace_session() is called at the beginning of a session and returns its
+ * trace ID */
+
+unsigned int trace_session(void) {
+	trace_id = ((unsigned int) time(NULL) << 16) ^ (unsigned int) getpid();
+	return trace_id;
+}
+
+
+void trace_begin(struct trace_span* span, int stage) {
+	span->stage = stage;
+	if (trace_fd < 0) {
+		return;
+	}
+	trace_now(&span->sec, &span->usec);
+	if (stage == TRACE_COMMAND) {
+		trace_cmd_upstream = trace_cmd_transfer = 0;
+	}
+}
+
+
+/* trace_end() writes the record of SPAN. VERB is the verb of the command
+ * that the span belongs to, RESULT the return value of the stage */
+
+void trace_end(struct trace_span* span, int verb, int result) {
+	struct trace_record rec;
+	unsigned int sec, usec;
+
+	if (trace_fd < 0) {
+		return;
+	}
+	trace_now(&sec, &usec);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = TRACE_MAGIC;
+	rec.trace_id = trace_id;
+	rec.stage = span->stage;
+	rec.verb = verb;
+	rec.start_sec = span->sec;
+	rec.start_usec = span->usec;
+	rec.duration = (unsigned long long) (sec - span->sec) * 1000000
+			+ usec - span->usec;
+	rec.result = result;
+
+	switch (span->stage) {
+		case TRACE_CONNECT:
+		case TRACE_AUTH_USER:
+		case TRACE_AUTH_PASS:
+		case TRACE_PASSCMD:
+		case TRACE_CACHE_INFO:
+			trace_cmd_upstream += rec.duration;
+			break;
+		case TRACE_NEGOTIATE:
+		case TRACE_TRANSFER:
+			trace_cmd_transfer += rec.duration;
+			break;
+		case TRACE_COMMAND:
+			rec.upstream = trace_cmd_upstream;
+			rec.transfer = trace_cmd_transfer;
+			break;
+	}
+
+	if (write(trace_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+		jlog(4, "Could not write to the trace file: %s",
+				strerror(errno));
+	}
+}
+
@@ -333,6 +333,9 @@ int get_chld_pid() {
 
 		errno = 0;
 		jlog(9, "A child exited. Pid: %d", pid);
+		if (prefetch_exited(pid, status)) {
+			continue;
+		}
 		jlog(9, "unregistering pid ...");
 		ret = unregister_pid(pid);
 		if (ret) {
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 1999-2004 Joachim Wieland <joe@mcknight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/* verb.c - the FTP verbs
+ *
+ * The verb of a command line is turned into a small number without copying
+ * it. The numbers come from a perfect hash over the known verbs that is
+ * generated by support/mkverbs.py, so a lookup is one multiplication and
+ * one comparison no matter how many verbs are known. Sets of verbs like the
+ * passcmds option are bitsets over these numbers. */
+
+#include <ctype.h>
+#include "jftpgw.h"
+#include "verbhash.h"
+
+
+/* verb_parse() returns the ID of the verb at the beginning of LINE or
+ * VERB_UNKNOWN. The length of the verb, the characters up to the first
+ * whitespace, is stored in LEN */
+
+int verb_parse(const char* line, size_t* len) {
+	unsigned long int key = 0;
+	size_t n, i;
+	int c, id;
+
+	n = strcspn(line, WHITESPACES);
+	*len = n;
+	if (n == 0 || n > VERB_MAXLEN) {
+		return VERB_UNKNOWN;
+	}
+	for (i = 0; i < n; i++) {
+		c = (unsigned char) line[i];
+		if (isdigit(c)) {
+			key = (key << 6) | (c - '0' + 27);
+		} else if (isalpha(c)) {
+			key = (key << 6) | (toupper(c) - 'A' + 1);
+		} else {
+			return VERB_UNKNOWN;
+		}
+	}
+	id = verb_slots[ ((key * VERB_HASH_MULT) & 0xffffffffUL)
+				>> (32 - VERB_HASH_BITS) ];
+	/* the slot might belong to another verb */
+	if (id == VERB_UNKNOWN
+	    || strncasecmp(verb_names[id], line, n) != 0
+	    || verb_names[id][n] != '\0') {
+		return VERB_UNKNOWN;
+	}
+	return id;
+}
+
+
+const char* verb_name(int verb) {
+	if (verb <= VERB_UNKNOWN || verb >= VERB_MAX) {
+		return "";
+	}
+	return verb_names[verb];
+}
+
+
+/* verbset_parse() fills SET with the verbs of the whitespace separated LIST.
+ * Words that are no known verbs are returned in the list OTHERS */
+
+void verbset_parse(struct verbset* set, const char* list,
+		   struct slist_t** others) {
+	size_t len;
+	int verb;
+
+	memset(set, 0, sizeof(struct verbset));
+	*others = (struct slist_t*) 0;
+	if (!list) {
+		return;
+	}
+	while (*list) {
+		list += strspn(list, WHITESPACES);
+		if (!*list) {
+			break;
+		}
+		verb = verb_parse(list, &len);
+		if (verb != VERB_UNKNOWN) {
+			VERBSET_ADD(set, verb);
+		} else {
+			char* word = (char*) malloc(len + 1);
+			enough_mem(word);
+			strncpy(word, list, len);
+			word[len] = '\0';
+			*others = slist_append(*others, slist_init(word));
+		}
+		list += len;
+	}
+}
+
@@ -0,0 +1,32 @@
+/* generated by support/mkverbs.py, do not edit */
+
+static const char* verb_names[ VERB_MAX ] = {
+	"",
+	"ABOR", "ACCT", "ADAT", "ALLO", "APPE", "AUTH", "CCC", "CDUP",
+	"CLNT", "CONF", "CWD", "DELE", "ENC", "EPRT", "EPSV", "FEAT",
+	"HASH", "HELP", "LANG", "LIST", "MDTM", "MFCT", "MFF", "MFMT",
+	"MIC", "MKD", "MLSD", "MLST", "MODE", "NLST", "NOOP", "OPEN",
+	"OPTS", "PASS", "PASV", "PBSZ", "PORT", "PROT", "PWD", "QUIT",
+	"REIN", "REST", "RETR", "RMD", "RNFR", "RNTO", "SITE", "SIZE",
+	"SMNT", "STAT", "STOR", "STOU", "STRU", "SYST", "TYPE", "USER",
+	"XCRC", "XCUP", "XCWD", "XMD5", "XMKD", "XPWD", "XRMD",
+};
+
+static const unsigned char verb_slots[ 1 << VERB_HASH_BITS ] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 35, 0, 0, 29, 0,
+	0, 0, 0, 0, 0, 0, 44, 0, 0, 18, 8, 23, 24, 0, 15, 0,
+	0, 0, 0, 0, 30, 0, 0, 46, 0, 0, 17, 0, 0, 0, 0, 10,
+	34, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 41, 28, 0, 45,
+	0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 59, 0, 0, 0,
+	0, 0, 61, 14, 2, 0, 5, 0, 0, 27, 49, 0, 0, 0, 0, 62,
+	0, 0, 0, 0, 19, 0, 0, 0, 0, 0, 0, 50, 0, 0, 4, 9,
+	0, 0, 32, 0, 0, 53, 0, 0, 0, 0, 0, 0, 42, 0, 0, 0,
+	0, 0, 0, 0, 40, 0, 0, 0, 0, 38, 47, 0, 0, 0, 0, 0,
+	0, 22, 0, 0, 0, 0, 0, 0, 0, 0, 0, 58, 0, 0, 11, 0,
+	0, 0, 0, 0, 26, 0, 0, 0, 0, 0, 0, 16, 0, 0, 0, 3,
+	12, 39, 0, 0, 55, 0, 0, 0, 0, 0, 21, 54, 0, 56, 6, 60,
+	0, 0, 0, 63, 0, 0, 0, 0, 0, 0, 0, 37, 52, 43, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 33, 31, 0, 0, 48, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 57, 0, 25, 7, 0, 0, 0, 20,
+	0, 51, 13, 0, 0, 0, 0, 0, 0, 0, 0, 0, 36, 0, 0, 0,
+};
@@ -0,0 +1,73 @@
+/* generated by support/mkverbs.py, do not edit */
+
+enum ftp_verb {
+	VERB_UNKNOWN = 0,
+	VERB_ABOR,
+	VERB_ACCT,
+	VERB_ADAT,
+	VERB_ALLO,
+	VERB_APPE,
+	VERB_AUTH,
+	VERB_CCC,
+	VERB_CDUP,
+	VERB_CLNT,
+	VERB_CONF,
+	VERB_CWD,
+	VERB_DELE,
+	VERB_ENC,
+	VERB_EPRT,
+	VERB_EPSV,
+	VERB_FEAT,
+	VERB_HASH,
+	VERB_HELP,
+	VERB_LANG,
+	VERB_LIST,
+	VERB_MDTM,
+	VERB_MFCT,
+	VERB_MFF,
+	VERB_MFMT,
+	VERB_MIC,
+	VERB_MKD,
+	VERB_MLSD,
+	VERB_MLST,
+	VERB_MODE,
+	VERB_NLST,
+	VERB_NOOP,
+	VERB_OPEN,
+	VERB_OPTS,
+	VERB_PASS,
+	VERB_PASV,
+	VERB_PBSZ,
+	VERB_PORT,
+	VERB_PROT,
+	VERB_PWD,
+	VERB_QUIT,
+	VERB_REIN,
+	VERB_REST,
+	VERB_RETR,
+	VERB_RMD,
+	VERB_RNFR,
+	VERB_RNTO,
+	VERB_SITE,
+	VERB_SIZE,
+	VERB_SMNT,
+	VERB_STAT,
+	VERB_STOR,
+	VERB_STOU,
+	VERB_STRU,
+	VERB_SYST,
+	VERB_TYPE,
+	VERB_USER,
+	VERB_XCRC,
+	VERB_XCUP,
+	VERB_XCWD,
+	VERB_XMD5,
+	VERB_XMKD,
+	VERB_XPWD,
+	VERB_XRMD,
+	VERB_MAX
+};
+
+#define VERB_MAXLEN		4
+#define VERB_HASH_BITS		8
+#define VERB_HASH_MULT		0x9e3779cfUL